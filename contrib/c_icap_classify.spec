@@ -27,7 +27,7 @@ supplied by the user to recognize various image characteristics.
 %package -n	%{name}-training
 Summary:	Programs to train FHS (Fast HyperSpace) or FNB (Fast Naive Bayes) files
 Group:		Admin Tools
-Provides:       %{name}-training fhs_learn fhs_judge fhs_makepreload fnb_learn fnb_judge fnb_makepreload
+Provides:       %{name}-training fhs_learn fhs_judge fhs_makepreload fhs_makeimage fnb_learn fnb_judge fnb_makepreload fnb_makeimage fnb_prune
 Requires:	c_icap_classify
 
 %description -n %{name}-training
@@ -70,10 +70,13 @@ rm -rf $RPM_BUILD_ROOT
 %{_bindir}/fhs_judge
 %{_bindir}/fhs_learn
 %{_bindir}/fhs_makepreload
+%{_bindir}/fhs_makeimage
 %{_bindir}/fhs_findtolearn
 %{_bindir}/fnb_judge
 %{_bindir}/fnb_learn
 %{_bindir}/fnb_makepreload
+%{_bindir}/fnb_makeimage
+%{_bindir}/fnb_prune
 %{_bindir}/fnb_findtolearn
 %attr(0644,root,root) %{_mandir}/man8/fhs*
 %attr(0644,root,root) %{_mandir}/man8/fnb*
@@ -49,6 +49,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <sys/file.h>
 #ifdef _POSIX_MAPPED_FILES
 #include <sys/mman.h>
 #endif
@@ -66,46 +67,98 @@
 // How many keys can we process before we must rescale to conserve bits
 // If this turns into a configuration parameter, it must be bounded at 100 and 500
 #define KEYS_PROCESS_BEFORE_RESCALE 200
+// How many keys the log domain classifier scores between checks of whether it can stop early
+#define KEYS_PROCESS_BEFORE_EARLY_EXIT 64
+// The log domain classifier puts the best category at exp(LOG_BAYES_MAXIMUM), the same top value
+// as doBayesPrepandClassify, which leaves room to add up 20000 of them.
+#define LOG_BAYES_MAXIMUM log(DBL_MAX / 20000)
+// doBayesClassify divides by a total of at most DBL_MAX, so a category less than this far below
+// the best in the log domain still comes out a normal double. Further behind, categories
+// underflow and can come out equal.
+#define FBC_UNDERFLOW_GAP (LOG_BAYES_MAXIMUM - log(DBL_MAX) - log(DBL_MIN))
+// Levels closer than this to one of FBCExitLevels count as on both sides of it
+#define FBC_LEVEL_SLACK 0.001
+#define FBC_EXIT_LEVELS_MAX 8
 // How many matches must there be in a file for it to be trusted?
 #define MINIMUM_MATCHES 5
 
 FBCTextCategoryExt NBCategories = { .categories = NULL };
 FBCHashList NBJudgeHashList = { .FBC_LOCKED = 0 };
+FBCModel NBModel = { .categories = &NBCategories, .hashes = &NBJudgeHashList };
+
+// Levels the caller compares primary_probScaled and secondary_probScaled to, see setBayesExitLevels
+static double FBCExitLevels[FBC_EXIT_LEVELS_MAX];
+static int FBCExitLevelCount = 0;
 
 // Radix hybrid binary search does speed things up in my testing
 // if it doesn't for you, please comment the following define
 #define CLASSIFYWITHRADIX
-#ifdef CLASSIFYWITHRADIX
-myRadix_t radixNodes[256];
-
-static void initRadix(FBCHashList *hashes)
+// Most document hashes are not in the table. With this defined, a Bloom filter turns most of
+// them away before any search.
+#define CLASSIFYWITHBLOOM
+
+// Build the search helpers of a table that has just been loaded or changed. Each table carries
+// its own, sized from its number of keys (see buildRadixIndex and buildBloomFilter).
+static void FBCBuildHierarchy(FBCHashList *hashes);
+static void initFBCSearch(FBCHashList *hashes)
 {
-    uint8_t lastRadix = 0, curRadix = 0;
-    uint32_t i;
-    memset(radixNodes, 0, sizeof(myRadix_t) * 256);
-    // Do precomputing
-    for (i = 0; i < hashes->used; i++) {
-        curRadix = (hashes->hashes[i].hash & 0xFF00000000000000LL) >> 56;
-        if (curRadix != lastRadix) {
-            radixNodes[curRadix].start = i;
-            radixNodes[lastRadix].stop = i ? i - 1 : 0;
-            lastRadix = curRadix;
-        }
-    }
-    radixNodes[lastRadix].stop = i ? i - 1 : 0;
-    /*  for(i = 0; i < 256; i++)
-            printf("Radix %X starts at %d and ends at %d\n", i, radixNodes[i].start, radixNodes[i].stop); */
-}
+    const void *keys = hashes->FBC_LOCKED ? (const void *) hashes->keys : (const void *) hashes->hashes;
+    size_t stride = hashes->FBC_LOCKED ? sizeof(HTMLFeature) : sizeof(FBCFeatureExt);
+#ifdef CLASSIFYWITHRADIX
+    buildRadixIndex(&hashes->radix, keys, stride, hashes->used);
 #endif
+#ifdef CLASSIFYWITHBLOOM
+    buildBloomFilter(&hashes->bloom, keys, stride, hashes->used);
+#endif
+    if (hashes->FBC_LOCKED && hashes->FBC_LOG_DOMAIN) FBCBuildHierarchy(hashes);
+    else freeHierarchy(&hashes->hierarchy);
+    // Only the judge table follows loads into NBCategories, learning snapshots add no categories
+    if (hashes == &NBJudgeHashList) buildBayesSecondaries();
+}
+
+// computeOSBHashes gives us sorted unique hashes. With this defined, classifying an optimized
+// table walks it alongside the document with a galloping search instead of doing a full
+// search per hash. Comment it out to go back to the radix / binary search above.
+#define CLASSIFYWITHMERGE
 
 void initBayesClassifier(void)
 {
     NBJudgeHashList.slots = 0;
     NBJudgeHashList.hashes = NULL;
     NBJudgeHashList.used = 0;
+    NBJudgeHashList.FBC_LOCKED = 0;
+    NBJudgeHashList.FBC_LOG_DOMAIN = 0;
+    NBJudgeHashList.FBC_EYTZINGER = 0;
+    NBJudgeHashList.eytzinger = NULL;
+    NBJudgeHashList.eytzingerRank = NULL;
+    NBJudgeHashList.keys = NULL;
+    NBJudgeHashList.offsets = NULL;
+    NBJudgeHashList.pool = NULL;
+    NBJudgeHashList.FBC_QUANTIZE = 0;
+    NBJudgeHashList.pool8 = NULL;
+    NBJudgeHashList.pool16 = NULL;
+    NBJudgeHashList.dequant = NULL;
+    NBJudgeHashList.FBC_EARLY_EXIT = 0;
+    NBJudgeHashList.scoreLow = 0;
+    NBJudgeHashList.FBC_PRUNE = 0;
+    NBJudgeHashList.scoreHigh = 0;
+    NBJudgeHashList.image = NULL;
+    NBJudgeHashList.imageSize = 0;
+    NBJudgeHashList.radix.start = NULL;
+    NBJudgeHashList.radix.bits = 0;
+    NBJudgeHashList.bloom.blocks = NULL;
+    NBJudgeHashList.bloom.shift = 0;
+    NBJudgeHashList.hierarchy.groupOf = NULL;
+    NBJudgeHashList.hierarchy.offsets = NULL;
+    NBJudgeHashList.hierarchy.entries = NULL;
+    NBJudgeHashList.hierarchy.categories = 0;
+    NBJudgeHashList.hierarchy.groups = 0;
     NBCategories.slots = BAYES_CATEGORY_INC;
     NBCategories.categories = calloc(NBCategories.slots, sizeof(FBCTextCategory));
     NBCategories.used = 0;
+    NBCategories.secondaries.bits = NULL;
+    NBCategories.secondaries.categories = 0;
+    selectBayesKernels();
 }
 
 void deinitBayesClassifier(void)
@@ -115,41 +168,317 @@ void deinitBayesClassifier(void)
         free(NBCategories.categories[i].name);
     }
     if (NBCategories.categories) free(NBCategories.categories);
+    freeSecondaries(&NBCategories.secondaries);
+
+    freeFBCHashList(&NBJudgeHashList);
+}
+
+// Release the judge table of hashes, whether it is optimized, mapped from an image or neither,
+// and leave it empty and unlocked. The options (FBC_LOG_DOMAIN and the like) are kept.
+void freeFBCHashList(FBCHashList *hashes)
+{
+    uint32_t i;
+
+    if (hashes->FBC_LOCKED) {
+        if (hashes->image) {
+#ifdef _POSIX_MAPPED_FILES
+            munmap(hashes->image, hashes->imageSize);
+#endif
+        } else {
+            free(hashes->keys);
+            free(hashes->offsets);
+            free(hashes->pool);
+            free(hashes->pool8);
+            free(hashes->pool16);
+            free(hashes->dequant);
+        }
+        free(hashes->eytzinger);
+        free(hashes->eytzingerRank);
+    } else {
+        for (i=0; i < hashes->used; i++) {
+            free(hashes->hashes[i].users);
+        }
+        if (hashes->used) free(hashes->hashes);
+    }
+    hashes->hashes = NULL;
+    hashes->keys = NULL;
+    hashes->offsets = NULL;
+    hashes->pool = NULL;
+    hashes->pool8 = NULL;
+    hashes->pool16 = NULL;
+    hashes->dequant = NULL;
+    hashes->eytzinger = NULL;
+    hashes->eytzingerRank = NULL;
+    hashes->image = NULL;
+    hashes->imageSize = 0;
+    freeRadixIndex(&hashes->radix);
+    freeBloomFilter(&hashes->bloom);
+    freeHierarchy(&hashes->hierarchy);
+    hashes->used = 0;
+    hashes->slots = 0;
+    hashes->FBC_LOCKED = 0;
+}
+
+// In order walk of the implicit tree, so the sorted keys land in breadth first order
+static uint32_t FBCEytzingerFill(FBCHashList *hashes, uint32_t i, uint32_t k)
+{
+    if (k <= (uint32_t) hashes->used) {
+        i = FBCEytzingerFill(hashes, i, 2 * k);
+        hashes->eytzinger[k] = hashes->keys[i];
+        hashes->eytzingerRank[k] = i;
+        i++;
+        i = FBCEytzingerFill(hashes, i, 2 * k + 1);
+    }
+    return i;
+}
+
+static int FBCBuildEytzinger(FBCHashList *hashes)
+{
+    void *temp = NULL;
+
+    // Cache line aligned so that the prefetch in FBCEytzingerSearch fetches whole nodes
+    if (posix_memalign(&temp, 64, (hashes->used + 1) * sizeof(HTMLFeature)) != 0) temp = NULL;
+    hashes->eytzinger = temp;
+    hashes->eytzingerRank = malloc((hashes->used + 1) * sizeof(uint32_t));
+    if (hashes->eytzinger == NULL || hashes->eytzingerRank == NULL) {
+        ci_debug_printf(1, "FBCBuildEytzinger: unable to allocate memory, using the sorted keys.\n");
+        free(hashes->eytzinger);
+        free(hashes->eytzingerRank);
+        hashes->eytzinger = NULL;
+        hashes->eytzingerRank = NULL;
+        return -2;
+    }
+    hashes->eytzinger[0] = 0;
+    hashes->eytzingerRank[0] = 0;
+    FBCEytzingerFill(hashes, 0, 1);
+    return 0;
+}
+
+// Find the range of scores one hash can add to a category for the early exit bound. It is taken
+// from the values the classifier will actually add, so quantized tables use the decoded codes.
+static void FBCScoreBounds(FBCHashList *hashes)
+{
+    uint32_t pool_used = hashes->offsets[hashes->used], i;
+    double score;
+
+    hashes->scoreLow = 0;
+    hashes->scoreHigh = 0;
+    for (i = 0; i < pool_used; i++) {
+        if (hashes->pool8) score = hashes->dequant[hashes->pool8[i].code];
+        else if (hashes->pool16) score = hashes->dequant[0] + hashes->pool16[i].code * hashes->dequant[1];
+        else score = hashes->pool[i].data.probability;
+        if (score < hashes->scoreLow) hashes->scoreLow = score;
+        else if (score > hashes->scoreHigh) hashes->scoreHigh = score;
+    }
+}
+
+// Histogram resolution used to place the 8 bit codes
+#define FBC_QUANTIZE_BINS 4096
+
+// Replace the log domain scores in pool with FBC_QUANTIZE bit codes. 16 bit codes are evenly
+// spaced between the lowest and highest score. 8 bit codes each cover about the same number
+// of pool entries and decode to the mean of the scores they cover, so common scores lose
+// the least. On failure pool is left alone and FBC_QUANTIZE is cleared.
+static int FBCQuantize(FBCHashList *hashes)
+{
+    uint32_t pool_used = hashes->offsets[hashes->used], i, bin;
+    uint64_t *histogram = NULL, *code_count = NULL, below;
+    uint8_t *bin_code = NULL;
+    double min, max, step, *code_sum = NULL;
+
+    if (pool_used == 0) {
+        hashes->FBC_QUANTIZE = 0;
+        return -1;
+    }
+    min = max = hashes->pool[0].data.probability;
+    for (i = 1; i < pool_used; i++) {
+        if (hashes->pool[i].data.probability < min) min = hashes->pool[i].data.probability;
+        else if (hashes->pool[i].data.probability > max) max = hashes->pool[i].data.probability;
+    }
+
+    if (hashes->FBC_QUANTIZE == 16) {
+        hashes->pool16 = malloc(pool_used * sizeof(FBCHashJudgeUsersQ16));
+        hashes->dequant = malloc(FBC_DEQUANT16_SIZE * sizeof(double));
+        if (hashes->pool16 == NULL || hashes->dequant == NULL) goto NO_MEMORY;
+        step = (max > min) ? (max - min) / UINT16_MAX : 1;
+        for (i = 0; i < pool_used; i++) {
+            hashes->pool16[i].category = hashes->pool[i].category;
+            hashes->pool16[i].code = lround((hashes->pool[i].data.probability - min) / step);
+        }
+        hashes->dequant[0] = min;
+        hashes->dequant[1] = step;
+    } else {
+        hashes->pool8 = malloc(pool_used * sizeof(FBCHashJudgeUsersQ8));
+        hashes->dequant = malloc(FBC_DEQUANT8_SIZE * sizeof(double));
+        histogram = calloc(FBC_QUANTIZE_BINS, sizeof(uint64_t));
+        bin_code = malloc(FBC_QUANTIZE_BINS * sizeof(uint8_t));
+        code_sum = calloc(FBC_DEQUANT8_SIZE, sizeof(double));
+        code_count = calloc(FBC_DEQUANT8_SIZE, sizeof(uint64_t));
+        if (hashes->pool8 == NULL || hashes->dequant == NULL || histogram == NULL || bin_code == NULL || code_sum == NULL || code_count == NULL) goto NO_MEMORY;
+        step = (max > min) ? (max - min) / (FBC_QUANTIZE_BINS - 1) : 1;
+        for (i = 0; i < pool_used; i++) {
+            histogram[lround((hashes->pool[i].data.probability - min) / step)]++;
+        }
+        // Each bin goes to the code its middle entry falls in when the pool is cut into 256 equal parts
+        below = 0;
+        for (bin = 0; bin < FBC_QUANTIZE_BINS; bin++) {
+            bin_code[bin] = ((below + histogram[bin] / 2) * FBC_DEQUANT8_SIZE) / pool_used;
+            below += histogram[bin];
+        }
+        for (i = 0; i < pool_used; i++) {
+            hashes->pool8[i].category = hashes->pool[i].category;
+            hashes->pool8[i].code = bin_code[lround((hashes->pool[i].data.probability - min) / step)];
+            code_sum[hashes->pool8[i].code] += hashes->pool[i].data.probability;
+            code_count[hashes->pool8[i].code]++;
+        }
+        for (i = 0; i < FBC_DEQUANT8_SIZE; i++) {
+            hashes->dequant[i] = code_count[i] ? code_sum[i] / code_count[i] : min;
+        }
+        free(histogram);
+        free(bin_code);
+        free(code_sum);
+        free(code_count);
+    }
+    free(hashes->pool);
+    hashes->pool = NULL;
+    return 0;
+
+NO_MEMORY:
+    ci_debug_printf(1, "FBCQuantize: unable to allocate memory, keeping unquantized scores.\n");
+    free(hashes->pool8);
+    free(hashes->pool16);
+    free(hashes->dequant);
+    free(histogram);
+    free(bin_code);
+    free(code_sum);
+    free(code_count);
+    hashes->pool8 = NULL;
+    hashes->pool16 = NULL;
+    hashes->dequant = NULL;
+    hashes->FBC_QUANTIZE = 0;
+    return -2;
+}
+
+// What one category's count of a hash makes its Bayes factor, as optimizeFBC stores it before
+// taking the log. It is rounded to float at each step, like the stored score always was.
+static inline float FBCProbability(uint64_t count, uint64_t total)
+{
+    float probability = ((double) count / (double) (total)); // compute P(w|C)
+    probability /= ((double) (total - count) / (double) (total)); // compute and divide by P(w|not C)
+    if (probability < MAGIC_MINIMUM) probability = MAGIC_MINIMUM;
+    else if (probability > 1) probability = 1;
+    return probability + MAGIC_CONSERVE_OFFSET; // Not strictly mathematically accurate, but it conserves bits
+}
+
+// How far apart the log domain scores of a hash are across all categories. Categories without
+// the hash score 0. A hash that moves every category alike cannot change the result.
+static double FBCScoreSpread(const FBCFeatureExt *feature)
+{
+    uint64_t total = MARKOV_C2 + 1;
+    double score, low, high = 0;
+    uint_least16_t j;
+
+    if (feature->used == 0) return 0;
+    for (j = 0; j < feature->used; j++) total += feature->users[j].data.count;
+    low = (feature->used < NBCategories.used ? 0 : DBL_MAX);
+    for (j = 0; j < feature->used; j++) {
+        score = log(FBCProbability(feature->users[j].data.count, total)) - log(MAGIC_MINIMUM);
+        if (score < low) low = score;
+        if (score > high) high = score;
+    }
+    return high - low;
+}
+
+// Drop the hashes of an unoptimized table that do not tell categories apart, those whose
+// scores are all within minSpread (natural log units) of each other. This includes preload
+// only hashes. Returns the number of hashes dropped.
+int pruneFBC(FBCHashList *hashes, double minSpread)
+{
+    int32_t i, kept = 0;
 
-    for (i=0; i < NBJudgeHashList.used; i++) {
-        free(NBJudgeHashList.hashes[i].users);
+    if (hashes->FBC_LOCKED) return -1; // Optimized tables have no counts left
+    for (i = 0; i < hashes->used; i++) {
+        if (FBCScoreSpread(&hashes->hashes[i]) < minSpread) free(hashes->hashes[i].users);
+        else hashes->hashes[kept++] = hashes->hashes[i];
     }
-    if (NBJudgeHashList.used) free(NBJudgeHashList.hashes);
+    i = hashes->used - kept;
+    hashes->used = kept;
+    if (i) initFBCSearch(hashes);
+    return i;
 }
 
 int optimizeFBC(FBCHashList *hashes)
 {
     uint64_t total;
     uint64_t count;
+    uint64_t pool_used = 0;
+    FBCHashJudgeUsers *users;
 
     if (hashes->FBC_LOCKED) return -1;
+    if (hashes->FBC_QUANTIZE != 0 && hashes->FBC_QUANTIZE != 8 && hashes->FBC_QUANTIZE != 16) {
+        ci_debug_printf(1, "optimizeFBC: codes must be 8 or 16 bits, not %d. Not quantizing.\n", hashes->FBC_QUANTIZE);
+        hashes->FBC_QUANTIZE = 0;
+    }
+    if (hashes->FBC_QUANTIZE) hashes->FBC_LOG_DOMAIN = 1; // Codes are log domain scores
+    if (hashes->FBC_EARLY_EXIT) hashes->FBC_LOG_DOMAIN = 1; // The bound needs additive scores
+    if (hierarchy_groups > 0) hashes->FBC_LOG_DOMAIN = 1; // So do the group scores
+    if (hashes->FBC_PRUNE > 0) ci_debug_printf(3, "optimizeFBC: pruned %d hashes\n", pruneFBC(hashes, hashes->FBC_PRUNE));
+
+    // Flatten into keys / offsets / pool so the judge table is three allocations
+    // instead of one per hash.
+    for (uint32_t i = 0; i < hashes->used; i++) {
+        pool_used += hashes->hashes[i].used;
+    }
+    if (pool_used > UINT32_MAX) {
+        ci_debug_printf(1, "optimizeFBC: too many hash users (%"PRIu64") to flatten. Not optimizing.\n", pool_used);
+        return -2;
+    }
+    hashes->keys = malloc((hashes->used ? hashes->used : 1) * sizeof(HTMLFeature));
+    hashes->offsets = malloc((hashes->used + 1) * sizeof(uint32_t));
+    hashes->pool = malloc((pool_used ? pool_used : 1) * sizeof(FBCHashJudgeUsers));
+    if (hashes->keys == NULL || hashes->offsets == NULL || hashes->pool == NULL) {
+        ci_debug_printf(1, "optimizeFBC: unable to allocate memory for the judge table. Not optimizing.\n");
+        free(hashes->keys);
+        free(hashes->offsets);
+        free(hashes->pool);
+        hashes->keys = NULL;
+        hashes->offsets = NULL;
+        hashes->pool = NULL;
+        return -2;
+    }
 
     // Do precomputing
+    pool_used = 0;
     for (uint32_t i = 0; i < hashes->used; i++) {
         total = MARKOV_C2 + 1;
         for (uint_least16_t j = 0; j < hashes->hashes[i].used; j++) {
             total += hashes->hashes[i].users[j].data.count;
         }
 
+        hashes->keys[i] = hashes->hashes[i].hash;
+        hashes->offsets[i] = pool_used;
+        users = &hashes->pool[pool_used];
         for (uint_least16_t j = 0; j < hashes->hashes[i].used; j++) {
-            count = hashes->hashes[i].users[j].data.count; // necessary since count and probability are a union
-            hashes->hashes[i].users[j].data.probability = ((double) count / (double) (total)); // compute P(w|C)
-            hashes->hashes[i].users[j].data.probability /= ((double) (total - count) / (double) (total)); // compute and divide by P(w|not C)
-            if (hashes->hashes[i].users[j].data.probability < MAGIC_MINIMUM) hashes->hashes[i].users[j].data.probability = MAGIC_MINIMUM;
-            else if (hashes->hashes[i].users[j].data.probability > 1) hashes->hashes[i].users[j].data.probability = 1;
-            hashes->hashes[i].users[j].data.probability += MAGIC_CONSERVE_OFFSET; // Not strictly mathematically accurate, but it conserves bits
-//          ci_debug_printf(10, "Probability %G\n", hashes->hashes[i].users[j].data.probability);
+            count = hashes->hashes[i].users[j].data.count;
+            users[j].category = hashes->hashes[i].users[j].category;
+            users[j].data.probability = FBCProbability(count, total);
+            // Every category that lacks this hash is multiplied by MAGIC_MINIMUM. Storing the log of
+            // our probability relative to that lets the classifier skip the missing categories.
+            if (hashes->FBC_LOG_DOMAIN) users[j].data.probability = log(users[j].data.probability) - log(MAGIC_MINIMUM);
+//          ci_debug_printf(10, "Probability %G\n", users[j].data.probability);
         }
+        pool_used += hashes->hashes[i].used;
+        free(hashes->hashes[i].users);
     }
+    hashes->offsets[hashes->used] = pool_used;
+    free(hashes->hashes);
+    hashes->hashes = NULL;
+    hashes->slots = hashes->used;
     hashes->FBC_LOCKED = 1;
-#ifdef CLASSIFYWITHRADIX
-    initRadix(hashes);
-#endif
+    if (hashes->FBC_QUANTIZE) FBCQuantize(hashes);
+    if (hashes->FBC_EARLY_EXIT) FBCScoreBounds(hashes);
+    if (hashes->FBC_EYTZINGER) FBCBuildEytzinger(hashes);
+    initFBCSearch(hashes);
     return 0;
 }
 
@@ -510,16 +839,244 @@ static int32_t FBCBinarySearch(FBCHashList *hashes_list, int32_t start, int32_t
     return -1;
 }
 
+// Same as above, but over the flat keys of an optimized (FBC_LOCKED) table
+static int32_t FBCFlatBinarySearch(const HTMLFeature *keys, int32_t start, int32_t end, uint64_t key)
+{
+    int32_t mid=0;
+    while (start <= end) {
+        mid = start + ((end - start) / 2);
+        if (keys[mid] > key)
+            end = mid - 1;
+        else if (keys[mid] < key)
+            start = mid + 1;
+        else return mid;
+    }
+    return -1;
+}
+
 #ifdef CLASSIFYWITHRADIX
 static inline int32_t FBCRadixBinarySearch(FBCHashList *hashes_list, uint64_t key)
 {
-    uint8_t radix;
-    radix = (key & 0xFF00000000000000LL) >> 56;
-    return FBCBinarySearch(hashes_list, radixNodes[radix].start, radixNodes[radix].stop, key);
+    int32_t start = 0, end = hashes_list->used - 1;
+    if (hashes_list->radix.start) radixRange(&hashes_list->radix, key, &start, &end);
+    if (hashes_list->FBC_LOCKED) return FBCFlatBinarySearch(hashes_list->keys, start, end, key);
+    return FBCBinarySearch(hashes_list, start, end, key);
+}
+#endif
+
+// Branch free search of the Eytzinger ordered keys. Each step only picks a child, the
+// prefetch pulls in the cache line holding the nodes three levels further down.
+static inline int32_t FBCEytzingerSearch(FBCHashList *hashes_list, uint64_t key)
+{
+    const HTMLFeature *eytzinger = hashes_list->eytzinger;
+    uint32_t k = 1;
+
+    while (k <= (uint32_t) hashes_list->used) {
+        __builtin_prefetch(eytzinger + k * 8);
+        k = 2 * k + (eytzinger[k] < key);
+    }
+    k >>= __builtin_ffs(~k); // Undo the right turns taken after the last left turn
+    if (k && eytzinger[k] == key) return hashes_list->eytzingerRank[k];
+    return -1;
+}
+
+#ifdef CLASSIFYWITHMERGE
+// Galloping (exponential) search starting at *cursor. Everything before *cursor is
+// smaller than the previous key, so with ascending keys each search picks up where the
+// last one ended. *cursor is left at the first key not smaller than key (past it on a hit).
+static inline int32_t FBCGallopSearch(const HTMLFeature *keys, int32_t used, int32_t *cursor, uint64_t key)
+{
+    int32_t lo = *cursor, hi, mid, step = 1;
+
+    // Keys out of order, start over rather than miss
+    if (lo > 0 && keys[lo - 1] >= key) lo = 0;
+    hi = lo;
+    while (hi < used && keys[hi] < key) {
+        lo = hi + 1;
+        hi += step;
+        step <<= 1;
+    }
+    if (hi >= used) hi = used - 1;
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (keys[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    *cursor = lo;
+    if (lo < used && keys[lo] == key) {
+        (*cursor)++;
+        return lo;
+    }
+    return -1;
 }
 #endif
 
-static HTMLClassification doBayesClassify(FBCJudge *categories, HashList *unknown, double correction_factor)
+// Find key in the judge table for classification. cursor must start at 0 for each document.
+static inline int32_t FBCJudgeSearch(FBCHashList *hashes_list, int32_t *cursor, uint64_t key)
+{
+#if defined(CLASSIFYWITHMERGE) && defined(CLASSIFYWITHRADIX)
+    int32_t start, end;
+#endif
+
+#ifdef CLASSIFYWITHBLOOM
+    if (hashes_list->bloom.blocks && !bloomMayContain(&hashes_list->bloom, key)) return -1;
+#endif
+    if (hashes_list->eytzinger) return FBCEytzingerSearch(hashes_list, key);
+#ifdef CLASSIFYWITHMERGE
+#ifdef CLASSIFYWITHRADIX
+    // Gallop only inside the key's bucket, jumping straight to it past any gap in the document
+    if (hashes_list->FBC_LOCKED && hashes_list->radix.start) {
+        radixRange(&hashes_list->radix, key, &start, &end);
+        if (*cursor < start || *cursor > end + 1) *cursor = start;
+        return FBCGallopSearch(hashes_list->keys, end + 1, cursor, key);
+    }
+#endif
+    if (hashes_list->FBC_LOCKED) return FBCGallopSearch(hashes_list->keys, hashes_list->used, cursor, key);
+#endif
+// See comment on Radix at top
+#ifdef CLASSIFYWITHRADIX
+    return FBCRadixBinarySearch(hashes_list, key);
+#else
+    if (hashes_list->FBC_LOCKED) return FBCFlatBinarySearch(hashes_list->keys, 0, hashes_list->used-1, key);
+    return FBCBinarySearch(hashes_list, 0, hashes_list->used-1, key);
+#endif
+}
+
+// Category, log domain score and address of user u of the optimized pool, whichever form it is
+// stored in
+static inline uint16_t FBCUserCategory(const FBCHashList *hashes, uint32_t u)
+{
+    if (hashes->pool8) return hashes->pool8[u].category;
+    if (hashes->pool16) return hashes->pool16[u].category;
+    return hashes->pool[u].category;
+}
+
+static inline double FBCUserScore(const FBCHashList *hashes, uint32_t u)
+{
+    if (hashes->pool8) return hashes->dequant[hashes->pool8[u].code];
+    if (hashes->pool16) return hashes->dequant[0] + hashes->pool16[u].code * hashes->dequant[1];
+    return hashes->pool[u].data.probability;
+}
+
+static inline const void *FBCUserAddress(const FBCHashList *hashes, uint32_t u)
+{
+    if (hashes->pool8) return &hashes->pool8[u];
+    if (hashes->pool16) return &hashes->pool16[u];
+    return &hashes->pool[u];
+}
+
+// Add the log domain scores of users first through end - 1 of the optimized pool to their categories
+static inline void FBCAddScores(FBCJudge *categories, const FBCHashList *hashes, uint32_t first, uint32_t end)
+{
+    const double *dequant = hashes->dequant;
+    uint32_t u;
+
+    if (hashes->pool8) {
+        for (u = first; u < end; u++) {
+            categories[hashes->pool8[u].category].naiveBayesResult += dequant[hashes->pool8[u].code];
+        }
+    } else if (hashes->pool16) {
+        for (u = first; u < end; u++) {
+            categories[hashes->pool16[u].category].naiveBayesResult += dequant[0] + hashes->pool16[u].code * dequant[1];
+        }
+    } else {
+        for (u = first; u < end; u++) {
+            categories[hashes->pool[u].category].naiveBayesResult += hashes->pool[u].data.probability;
+        }
+    }
+}
+
+// Only the judge table load sort has other versions. An AVX-512 gather and scatter version
+// of FBCAddScores was no faster, as the scatter to the categories is all of its work.
+void selectBayesKernels(void)
+{
+    FBCSortKernel = kernelLevel();
+}
+
+static uint32_t FBCHierarchyUsers(const void *table, uint32_t hash, uint16_t *categories, float *scores)
+{
+    const FBCHashList *hashes = table;
+    uint32_t j, first = hashes->offsets[hash], used = hashes->offsets[hash + 1] - first;
+
+    for (j = 0; j < used; j++) {
+        categories[j] = FBCUserCategory(hashes, first + j);
+        if (scores) scores[j] = FBCUserScore(hashes, first + j);
+    }
+    return used;
+}
+
+static void FBCHierarchyRegroup(void *table, uint32_t hash, const uint32_t *order, void *scratch)
+{
+    FBCHashList *hashes = table;
+    uint32_t j, first = hashes->offsets[hash], used = hashes->offsets[hash + 1] - first;
+
+    if (hashes->pool8) {
+        FBCHashJudgeUsersQ8 *users = scratch;
+        memcpy(users, &hashes->pool8[first], used * sizeof(FBCHashJudgeUsersQ8));
+        for (j = 0; j < used; j++) {
+            hashes->pool8[first + j] = users[order[j]];
+        }
+    } else if (hashes->pool16) {
+        FBCHashJudgeUsersQ16 *users = scratch;
+        memcpy(users, &hashes->pool16[first], used * sizeof(FBCHashJudgeUsersQ16));
+        for (j = 0; j < used; j++) {
+            hashes->pool16[first + j] = users[order[j]];
+        }
+    } else {
+        FBCHashJudgeUsers *users = scratch;
+        memcpy(users, &hashes->pool[first], used * sizeof(FBCHashJudgeUsers));
+        for (j = 0; j < used; j++) {
+            hashes->pool[first + j] = users[order[j]];
+        }
+    }
+}
+
+// Group the categories by top level name, see buildHierarchy. Once grouped the users of a hash
+// are no longer in category order, which only the linear domain classifier needs. An image can
+// only be grouped if it was written from a grouped table.
+static void FBCBuildHierarchy(FBCHashList *hashes)
+{
+    const char **names;
+    uint16_t i;
+
+    freeHierarchy(&hashes->hierarchy);
+    if (hierarchy_groups <= 0) return;
+    if ((names = malloc((NBCategories.used ? NBCategories.used : 1) * sizeof(char *))) == NULL) return;
+    for (i = 0; i < NBCategories.used; i++) {
+        names[i] = NBCategories.categories[i].name;
+    }
+    buildHierarchy(&hashes->hierarchy, names, NBCategories.used, hashes, hashes->used, NBCategories.used, FBCHierarchyUsers, hashes->image ? NULL : FBCHierarchyRegroup, 1);
+    free(names);
+}
+
+// Resolve TextPrimarySecondary for the categories in NBCategories. It must be done again
+// whenever categories are loaded or secondaries are added.
+void buildBayesSecondaries(void)
+{
+    const char **names;
+    uint32_t i;
+
+    if ((names = malloc((NBCategories.used ? NBCategories.used : 1) * sizeof(char *))) == NULL) {
+        freeSecondaries(&NBCategories.secondaries);
+        return;
+    }
+    for (i = 0; i < NBCategories.used; i++) {
+        names[i] = NBCategories.categories[i].name;
+    }
+    buildSecondaries(&NBCategories.secondaries, names, NBCategories.used);
+    free(names);
+}
+
+// May secondbest be reported as the secondary of bestseen?
+static int FBCIsSecondary(const FBCModel *model, uint32_t bestseen, uint32_t secondbest)
+{
+    if (model->categories->secondaries.bits && model->categories->secondaries.categories == model->categories->used)
+        return isSecondary(&model->categories->secondaries, bestseen, secondbest);
+    return secondaryMatch(model->categories->categories[bestseen].name, model->categories->categories[secondbest].name);
+}
+
+// Only the categories set in allowed may be reported, unless it is NULL
+static HTMLClassification doBayesClassify(const FBCModel *model, FBCJudge *categories, HashList *unknown, double correction_factor, const uint8_t *allowed)
 {
     double total_probability = DBL_MIN;
     double remainder = DBL_MIN;
@@ -536,12 +1093,12 @@ static HTMLClassification doBayesClassify(FBCJudge *categories, HashList *unknow
     do {
         if (total_probability > DBL_MAX_SPEC) { // reset total_probability so that we are not overflowing
             total_probability = DBL_MIN;
-            for (cls = 0; cls < NBCategories.used; cls++) {
+            for (cls = 0; cls < model->categories->used; cls++) {
                 categories[cls].naiveBayesResult /= 100;
             }
         }
 
-        for (cls = 0; cls < NBCategories.used; cls++) {
+        for (cls = 0; cls < model->categories->used; cls++) {
             // Avoid divide by zero and keep value small, for log10(remainder) below
             if (categories[cls].naiveBayesResult > DBL_MAX)
                 categories[cls].naiveBayesResult = DBL_MAX;
@@ -554,13 +1111,18 @@ static HTMLClassification doBayesClassify(FBCJudge *categories, HashList *unknow
     if (correction_factor > 1.0f)
         total_probability *= correction_factor;
 
+    if (allowed) { // Start from the first two that may be reported, there are at least two
+        for (bestseen = 0; !allowed[bestseen]; bestseen++);
+        for (secondbest = bestseen + 1; !allowed[secondbest]; secondbest++);
+    }
+
     // Find the best and second best categories
-    for (cls = 0; cls < NBCategories.used; cls++) { // Order of instructions in this loop matters!
+    for (cls = 0; cls < model->categories->used; cls++) { // Order of instructions in this loop matters!
         categories[cls].naiveBayesResult = categories[cls].naiveBayesResult / total_probability; // fix-up probability
-        if (categories[cls].naiveBayesResult > categories[bestseen].naiveBayesResult) {
+        if ((!allowed || allowed[cls]) && categories[cls].naiveBayesResult > categories[bestseen].naiveBayesResult) {
             secondbest = bestseen;
             bestseen = cls; // are we the best
-        } else if (cls != bestseen && categories[cls].naiveBayesResult > categories[secondbest].naiveBayesResult) secondbest = cls;
+        } else if (cls != bestseen && (!allowed || allowed[cls]) && categories[cls].naiveBayesResult > categories[secondbest].naiveBayesResult) secondbest = cls;
         remainder += categories[cls].naiveBayesResult; // add up remainder
     }
 
@@ -568,44 +1130,283 @@ static HTMLClassification doBayesClassify(FBCJudge *categories, HashList *unknow
     if (remainder < DBL_MIN) remainder = DBL_MIN;
 
     // Setup data for second best category, if applicable
-    for (int i = 0; i < number_secondaries; i++) {
-        if (tre_regexec(&secondary_compares[i].primary_regex, NBCategories.categories[bestseen].name, 0, NULL, 0) != REG_NOMATCH && tre_regexec(&secondary_compares[i].secondary_regex, NBCategories.categories[secondbest].name, 0, NULL, 0) != REG_NOMATCH) {
-            remainder -= categories[secondbest].naiveBayesResult;
-            if (remainder < DBL_MIN) remainder = DBL_MIN;
-            myReply.secondary_probability = categories[secondbest].naiveBayesResult;
-            myReply.secondary_probScaled = 10 * (log10(categories[secondbest].naiveBayesResult) - log10(remainder));
-            myReply.secondary_name = NBCategories.categories[secondbest].name;
-            i = number_secondaries;
-        } else if (secondary_compares[i].bidirectional == 1) {
-            if (tre_regexec(&secondary_compares[i].primary_regex, NBCategories.categories[secondbest].name, 0, NULL, 0) != REG_NOMATCH && tre_regexec(&secondary_compares[i].secondary_regex, NBCategories.categories[bestseen].name, 0, NULL, 0) != REG_NOMATCH) {
-                remainder -= categories[secondbest].naiveBayesResult;
-                if (remainder < DBL_MIN) remainder = DBL_MIN;
-                myReply.secondary_probability = categories[secondbest].naiveBayesResult;
-                myReply.secondary_probScaled = 10 * (log10(categories[secondbest].naiveBayesResult) - log10(remainder));
-                myReply.secondary_name = NBCategories.categories[secondbest].name;
-                i = number_secondaries;
-            }
-        }
+    if (number_secondaries && FBCIsSecondary(model, bestseen, secondbest)) {
+        remainder -= categories[secondbest].naiveBayesResult;
+        if (remainder < DBL_MIN) remainder = DBL_MIN;
+        myReply.secondary_probability = categories[secondbest].naiveBayesResult;
+        myReply.secondary_probScaled = 10 * (log10(categories[secondbest].naiveBayesResult) - log10(remainder));
+        myReply.secondary_name = model->categories->categories[secondbest].name;
     }
 
-    /*  for (cls = 0; cls < NBCategories.used; cls++)
+    /*  for (cls = 0; cls < model->categories->used; cls++)
         {
-            ci_debug_printf(10, "Category %s Result %G\n", NBCategories.categories[cls].name, categories[cls].naiveBayesResult);
+            ci_debug_printf(10, "Category %s Result %G\n", model->categories->categories[cls].name, categories[cls].naiveBayesResult);
         }*/
 
     myReply.primary_probability = categories[bestseen].naiveBayesResult;
     myReply.primary_probScaled = 10 * (log10(categories[bestseen].naiveBayesResult) - log10(remainder));
-    myReply.primary_name = NBCategories.categories[bestseen].name;
+    myReply.primary_name = model->categories->categories[bestseen].name;
 
     return myReply;
 }
 
-HTMLClassification doBayesPrepandClassify(HashList *toClassify)
+// Early exit stops only where the reported levels of a full run would be on the same side of
+// each of these as well (at most FBC_EXIT_LEVELS_MAX of them), so a caller acting on levels
+// gets the same answer. Without any, only the categories reported are sure to be the same.
+void setBayesExitLevels(const double *levels, int count)
+{
+    if (count > FBC_EXIT_LEVELS_MAX) count = FBC_EXIT_LEVELS_MAX;
+    if (count > 0) memcpy(FBCExitLevels, levels, count * sizeof(double));
+    FBCExitLevelCount = count > 0 ? count : 0;
+}
+
+// Back to the linear domain with the best category at the same maximum the
+// multiplying classifier rescales to, so doBayesClassify sees the same range.
+static void FBCFromLogDomain(const FBCModel *model, FBCJudge *categories)
+{
+    double best = categories[0].naiveBayesResult;
+    uint32_t cls;
+
+    for (cls = 1; cls < model->categories->used; cls++) {
+        if (categories[cls].naiveBayesResult > best) best = categories[cls].naiveBayesResult;
+    }
+    for (cls = 0; cls < model->categories->used; cls++) {
+        categories[cls].naiveBayesResult = exp(categories[cls].naiveBayesResult - best + LOG_BAYES_MAXIMUM);
+    }
+}
+
+// What doBayesClassify makes of the log domain scores in categories once the best category
+// gains bestShift, the second best secondShift and every other one otherShift. Categories left
+// at -DBL_MAX stay there. shifted is left holding the shares doBayesClassify worked out.
+static HTMLClassification FBCShiftedClassify(const FBCModel *model, const FBCJudge *categories, FBCJudge *shifted, HashList *unknown,
+        uint32_t first, uint32_t second, double bestShift, double secondShift, double otherShift, const uint8_t *allowed)
+{
+    uint32_t cls;
+
+    for (cls = 0; cls < model->categories->used; cls++) {
+        shifted[cls].naiveBayesResult = categories[cls].naiveBayesResult;
+        if (shifted[cls].naiveBayesResult == -DBL_MAX) continue;
+        shifted[cls].naiveBayesResult += (cls == first ? bestShift : (cls == second ? secondShift : otherShift));
+    }
+    FBCFromLogDomain(model, shifted);
+    return doBayesClassify(model, shifted, unknown, 1, allowed);
+}
+
+// Bound on the level doBayesClassify gives category k, from the shares FBCShiftedClassify left
+// in shifted: 10 * log10 of its share over what the categories not reported (first, and second
+// unless it is first too) leave. doBayesClassify gets that remainder by subtracting from the sum
+// of all the shares, so it can be off by the rounding of that sum; lower picks the bound.
+static double FBCLevelBound(const FBCModel *model, const FBCJudge *shifted, uint32_t k, uint32_t first, uint32_t second, int lower)
+{
+    double rest = 0, rounding = 2 * (model->categories->used + 3) * DBL_EPSILON;
+    uint32_t cls;
+
+    for (cls = 0; cls < model->categories->used; cls++) {
+        if (cls != first && cls != second) rest += shifted[cls].naiveBayesResult;
+    }
+    rest += lower ? rounding : -rounding;
+    if (rest < DBL_MIN) rest = DBL_MIN;
+    return 10 * (log10(shifted[k].naiveBayesResult) - log10(rest));
+}
+
+// Are low and high on the same side of every one of FBCExitLevels, by more than FBC_LEVEL_SLACK?
+static int FBCLevelsPinned(double low, double high)
+{
+    int i;
+
+    for (i = 0; i < FBCExitLevelCount; i++) {
+        if (low < FBCExitLevels[i] + FBC_LEVEL_SLACK && high >= FBCExitLevels[i] - FBC_LEVEL_SLACK) return 0;
+    }
+    return 1;
+}
+
+// Can the remaining hashes, each adding between scoreLow and scoreHigh to any category, still
+// change what doBayesClassify reports? reach is how much the gap between two categories could
+// still shrink. The best category, and the second best when secondaries may be reported, must
+// be settled, and their levels must stay on the same side of each of FBCExitLevels. A level
+// only goes up with its own category and down with the others, so the remaining hashes all
+// landing one way or the other bound it. shifted has room for every category. Returns 1 if
+// nothing reported can change.
+static int FBCEarlyExit(const FBCModel *model, const FBCJudge *categories, FBCJudge *shifted, HashList *unknown, uint32_t remaining, const uint8_t *allowed)
+{
+    double first = -DBL_MAX, second = -DBL_MAX, third = -DBL_MAX, score, reach, low, high, lowest, highest;
+    uint32_t cls, best = 0, next = 0, reported;
+    HTMLClassification shiftedReply;
+
+    for (cls = 0; cls < model->categories->used; cls++) {
+        score = categories[cls].naiveBayesResult;
+        if (score > first) {
+            third = second;
+            second = first;
+            next = best;
+            first = score;
+            best = cls;
+        } else if (score > second) {
+            third = second;
+            second = score;
+            next = cls;
+        } else if (score > third) third = score;
+    }
+    low = remaining * model->hashes->scoreLow;
+    high = remaining * model->hashes->scoreHigh;
+    reach = high - low;
+    // Leave room for rounding in the sums still to come
+    reach += 1e-9 * (fabs(first) + reach + 1);
+    if (first - second <= reach) return 0;
+    if (number_secondaries) {
+        // The second best must also stay clear of the categories that underflow to the same
+        // value in doBayesClassify, or which one of them comes second would be a coin toss.
+        if (first - second + reach >= FBC_UNDERFLOW_GAP) return 0;
+        if (model->categories->used > 2 && second - third <= reach) return 0;
+    }
+    if (FBCExitLevelCount == 0) return 1;
+
+    shiftedReply = FBCShiftedClassify(model, categories, shifted, unknown, best, next, low, high, high, allowed);
+    reported = shiftedReply.secondary_name ? next : best;
+    lowest = FBCLevelBound(model, shifted, best, best, reported, 1);
+    FBCShiftedClassify(model, categories, shifted, unknown, best, next, high, low, low, allowed);
+    highest = FBCLevelBound(model, shifted, best, best, reported, 0);
+    if (!FBCLevelsPinned(lowest, highest)) return 0;
+    if (reported == best) return 1;
+    FBCShiftedClassify(model, categories, shifted, unknown, best, next, high, low, high, allowed);
+    lowest = FBCLevelBound(model, shifted, next, best, next, 1);
+    FBCShiftedClassify(model, categories, shifted, unknown, best, next, low, high, low, allowed);
+    highest = FBCLevelBound(model, shifted, next, best, next, 0);
+    return FBCLevelsPinned(lowest, highest);
+}
+
+// Two stage version of the scoring loop of doBayesLogClassify. The first stage gives each group
+// the sum of its best score for each hash, which no category of the group can beat; the second
+// scores only the categories of the best hierarchy_groups groups and leaves the others at
+// -DBL_MAX, as it does those not set in allowed. Returns the number of hashes found, or -2 if
+// there is no memory for it.
+static int32_t FBCHierarchyScore(const FBCModel *model, FBCJudge *categories, HashList *toClassify, const uint8_t *allowed)
+{
+    const myHierarchy_t *hierarchy = &model->hashes->hierarchy;
+    const myHierarchyEntry_t *entry, *last;
+    int32_t *found = malloc((toClassify->used ? toClassify->used : 1) * sizeof(int32_t));
+    double *groupScores = calloc(hierarchy->groups, sizeof(double));
+    uint8_t *active = malloc(hierarchy->groups);
+    int32_t BSRet, cursor = 0, hits = 0, h;
+    uint32_t i, u;
+
+    if (found == NULL || groupScores == NULL || active == NULL) {
+        free(found);
+        free(groupScores);
+        free(active);
+        return -2;
+    }
+
+    for (i = 0; i < toClassify->used; i++) {
+        if ((BSRet = FBCJudgeSearch(model->hashes, &cursor, toClassify->hashes[i])) >= 0) {
+            found[hits++] = BSRet;
+            last = &hierarchy->entries[hierarchy->offsets[BSRet + 1]];
+            for (entry = &hierarchy->entries[hierarchy->offsets[BSRet]]; entry < last; entry++) {
+                groupScores[entry->group] += entry->score;
+            }
+        }
+    }
+    hierarchyTopGroups(hierarchy, groupScores, hierarchy_groups, allowed, active);
+
+    for (i = 0; i < model->categories->used; i++) {
+        categories[i].naiveBayesResult = active[hierarchy->groupOf[i]] && (!allowed || allowed[i]) ? 0 : -DBL_MAX;
+    }
+    for (h = 0; h < hits; h++) {
+        // The hashes were last seen a whole document ago
+        if (h + HIERARCHY_PREFETCH < hits) {
+            BSRet = found[h + HIERARCHY_PREFETCH];
+            __builtin_prefetch(&hierarchy->entries[hierarchy->offsets[BSRet]]);
+            __builtin_prefetch(FBCUserAddress(model->hashes, model->hashes->offsets[BSRet]));
+        }
+        BSRet = found[h];
+        u = model->hashes->offsets[BSRet];
+        last = &hierarchy->entries[hierarchy->offsets[BSRet + 1]];
+        for (entry = &hierarchy->entries[hierarchy->offsets[BSRet]]; entry < last; entry++) {
+            if (active[entry->group]) FBCAddScores(categories, model->hashes, u, u + entry->used);
+            u += entry->used;
+        }
+    }
+
+    free(found);
+    free(groupScores);
+    free(active);
+    return hits;
+}
+
+// Log domain version of the locked path of doBayesPrepandClassify. Each hit adds
+// log(MAGIC_MINIMUM) to every category and then the stored log ratio to the categories
+// that have the hash. The common term cancels out on normalization, so only the
+// ratios are summed and there is no missing category loop and no rescaling.
+// Categories not set in allowed start at -DBL_MAX, which no sum of ratios can move.
+static HTMLClassification doBayesLogClassify(const FBCModel *model, FBCJudge *categories, HashList *toClassify, const uint8_t *allowed)
+{
+    uint32_t i, total_processed = 0, next_check = KEYS_PROCESS_BEFORE_EARLY_EXIT;
+    int32_t BSRet = -1, cursor = 0, hierarchical = -1;
+    double correction_factor = 1;
+    FBCJudge *shifted = NULL;
+    uint32_t cls;
+
+    if (model->hashes->hierarchy.entries && model->hashes->hierarchy.categories == model->categories->used)
+        hierarchical = FBCHierarchyScore(model, categories, toClassify, allowed);
+    if (hierarchical >= 0) total_processed = hierarchical;
+    else {
+        for (cls = 0; cls < model->categories->used; cls++) {
+            categories[cls].naiveBayesResult = !allowed || allowed[cls] ? 0 : -DBL_MAX;
+        }
+
+        // Without room to work out the levels, every hash is scored
+        if (model->hashes->FBC_EARLY_EXIT) shifted = malloc(model->categories->used * sizeof(FBCJudge));
+        for (i = 0; i < toClassify->used; i++) {
+            if ((BSRet=FBCJudgeSearch(model->hashes, &cursor, toClassify->hashes[i])) >= 0) {
+                FBCAddScores(categories, model->hashes, model->hashes->offsets[BSRet], model->hashes->offsets[BSRet + 1]);
+                total_processed++;
+                if (shifted && total_processed == next_check) {
+                    if (FBCEarlyExit(model, categories, shifted, toClassify, toClassify->used - i - 1, allowed)) break;
+                    next_check += KEYS_PROCESS_BEFORE_EARLY_EXIT;
+                }
+            }
+        }
+        free(shifted);
+    }
+
+    FBCFromLogDomain(model, categories);
+
+    if (total_processed && total_processed < MINIMUM_MATCHES && toClassify->used > 20)
+        correction_factor = MINIMUM_MATCHES / total_processed;
+
+    return doBayesClassify(model, categories, toClassify, correction_factor, allowed);
+}
+
+// Which categories subset names, see categoryInSubset. Returns NULL with *count set to
+// the number of categories of model if subset is NULL or empty, as then all of them are scored.
+static uint8_t *FBCSubset(const FBCModel *model, const char *subset, uint32_t *count)
+{
+    uint8_t *allowed;
+    uint32_t cls;
+
+    *count = model->categories->used;
+    if (subset == NULL || subset[0] == '\0') return NULL;
+    if ((allowed = malloc(model->categories->used)) == NULL) {
+        *count = 0;
+        return NULL;
+    }
+    *count = 0;
+    for (cls = 0; cls < model->categories->used; cls++) {
+        allowed[cls] = categoryInSubset(subset, model->categories->categories[cls].name);
+        *count += allowed[cls];
+    }
+    return allowed;
+}
+
+// subset restricts scoring to the categories it names, see categoryInSubset. NULL scores them all.
+HTMLClassification doBayesPrepandClassify(const FBCModel *model, HashList *toClassify, const char *subset)
 {
     uint32_t i, j, processed = 0, total_processed = 0;
     uint16_t missing, nextReal;
     FBCJudge *categories = NULL;
-    int32_t BSRet = -1;
+    const FBCHashJudgeUsers *users;
+    uint32_t users_used;
+    int32_t BSRet = -1, cursor = 0;
     HTMLClassification data = { .primary_name = NULL, .primary_probability = 0.0, .primary_probScaled = 0.0, .secondary_name = NULL, .secondary_probability = 0.0, .secondary_probScaled = 0.0  };;
     uint64_t total;
     double local_probability;
@@ -614,81 +1415,93 @@ HTMLClassification doBayesPrepandClassify(HashList *toClassify)
     double scale = 0;
     double correction_factor = 1;
     const double BAYES_MAXIMUM = DBL_MAX / 20000; // Conserve bits toward a maximum, but try to avoid overflow
+    uint8_t *allowed;
+    uint32_t allowed_used;
 
-    if (NBCategories.used < 2) return data; // We must have at least two categories loaded or it is pointless to run
-    else categories = malloc(NBCategories.used * sizeof(FBCJudge));
+    if (model->categories->used < 2) return data; // We must have at least two categories loaded or it is pointless to run
 
-    // Set result to 1 so we don't have 0's as all answers
-    for (i = 0; i < NBCategories.used; i++) {
-        categories[i].naiveBayesResult = BAYES_MAXIMUM;
+    allowed = FBCSubset(model, subset, &allowed_used);
+    if (allowed_used < 2) { // The same goes for the categories we may score
+        ci_debug_printf(3, "Category subset %s leaves fewer than two FNB categories, not classifying\n", subset);
+        free(allowed);
+        return data;
+    }
+    categories = malloc(model->categories->used * sizeof(FBCJudge));
+
+    if (model->hashes->FBC_LOCKED && model->hashes->FBC_LOG_DOMAIN) {
+        data = doBayesLogClassify(model, categories, toClassify, allowed);
+        free(categories);
+        free(allowed);
+        return data;
+    }
+
+    // Set result to 1 so we don't have 0's as all answers, and to 0 where it may not be reported
+    for (i = 0; i < model->categories->used; i++) {
+        categories[i].naiveBayesResult = !allowed || allowed[i] ? BAYES_MAXIMUM : 0;
     }
 
     // do bayes multiplication
     for (i = 0; i < toClassify->used; i++) {
-// See comment on Radix at top
-#ifdef CLASSIFYWITHRADIX
-        if ((BSRet=FBCRadixBinarySearch(&NBJudgeHashList, toClassify->hashes[i])) >= 0)
-#else
-        if ((BSRet=FBCBinarySearch(&NBJudgeHashList, 0, NBJudgeHashList.used-1, toClassify->hashes[i])) >= 0)
-#endif
-        {
+        if ((BSRet=FBCJudgeSearch(model->hashes, &cursor, toClassify->hashes[i])) >= 0) {
 //          ci_debug_printf(10, "Found %"PRIX64"\n", toClassify->hashes[i]);
-            if (NBJudgeHashList.FBC_LOCKED) {
-                for (j = 0; j < NBJudgeHashList.hashes[BSRet].used; j++) {
+            if (model->hashes->FBC_LOCKED) {
+                users = &model->hashes->pool[model->hashes->offsets[BSRet]];
+                users_used = model->hashes->offsets[BSRet + 1] - model->hashes->offsets[BSRet];
+                for (j = 0; j < users_used; j++) {
                     /*BAYES*/
                     if (j == 0) { // Catch missing at the beginning
-                        nextReal = NBJudgeHashList.hashes[BSRet].users[j].category;
+                        nextReal = users[j].category;
                         for (missing = 0; missing < nextReal; missing++) {
 //                          ci_debug_printf(10, "Last: (empty) Next: %"PRIu16" Missing: %"PRIu16"\n", nextReal, missing);
                             categories[missing].naiveBayesResult *= MAGIC_MINIMUM;
                         }
                     }
 
-//                  ci_debug_printf(10, "Category: %"PRIu16" out of %"PRIu16"\n", NBJudgeHashList.hashes[BSRet].users[j].category, NBCategories.used - 1);
+//                  ci_debug_printf(10, "Category: %"PRIu16" out of %"PRIu16"\n", users[j].category, model->categories->used - 1);
 
-                    categories[NBJudgeHashList.hashes[BSRet].users[j].category].naiveBayesResult *= NBJudgeHashList.hashes[BSRet].users[j].data.probability;
+                    categories[users[j].category].naiveBayesResult *= users[j].data.probability;
 
                     // Catch missing at the end or in between
-                    if (j + 1 < NBJudgeHashList.hashes[BSRet].used) {
-                        nextReal = NBJudgeHashList.hashes[BSRet].users[j + 1].category;
-                    } else nextReal = NBCategories.used;
-                    for (missing = NBJudgeHashList.hashes[BSRet].users[j].category + 1; missing < nextReal; missing++) {
-//                      ci_debug_printf(10, "Last: %"PRIu16" Next: %"PRIu16" Missing: %"PRIu16"\n", NBJudgeHashList.hashes[BSRet].users[j].category, nextReal, missing);
+                    if (j + 1 < users_used) {
+                        nextReal = users[j + 1].category;
+                    } else nextReal = model->categories->used;
+                    for (missing = users[j].category + 1; missing < nextReal; missing++) {
+//                      ci_debug_printf(10, "Last: %"PRIu16" Next: %"PRIu16" Missing: %"PRIu16"\n", users[j].category, nextReal, missing);
                         categories[missing].naiveBayesResult *= MAGIC_MINIMUM;
                     }
                 }
             } else {
                 /*BAYES*/
                 total = MARKOV_C2 + 1;
-                for (uint_least16_t k = 0; k < NBJudgeHashList.hashes[BSRet].used; k++) {
-                    total += NBJudgeHashList.hashes[BSRet].users[k].data.count;
+                for (uint_least16_t k = 0; k < model->hashes->hashes[BSRet].used; k++) {
+                    total += model->hashes->hashes[BSRet].users[k].data.count;
                 }
 
-                for (uint_least16_t j = 0; j < NBJudgeHashList.hashes[BSRet].used; j++) {
+                for (uint_least16_t j = 0; j < model->hashes->hashes[BSRet].used; j++) {
                     if (j == 0) { // Catch missing at the beginning
-                        nextReal = NBJudgeHashList.hashes[BSRet].users[j].category;
+                        nextReal = model->hashes->hashes[BSRet].users[j].category;
                         for (missing = 0; missing < nextReal; missing++) {
 //                          ci_debug_printf(10, "Last: (empty) Next: %"PRIu16" Missing: %"PRIu16"\n", nextReal, missing);
                             categories[missing].naiveBayesResult *= MAGIC_MINIMUM;
                         }
                     }
 
-//                  ci_debug_printf(10, "Category: %"PRIu16" out of %"PRIu16"\n", NBJudgeHashList.hashes[BSRet].users[j].category, NBCategories.used);
+//                  ci_debug_printf(10, "Category: %"PRIu16" out of %"PRIu16"\n", model->hashes->hashes[BSRet].users[j].category, model->categories->used);
 
-                    local_probability = ((double) NBJudgeHashList.hashes[BSRet].users[j].data.count / (double) (total)); // compute P(w|C)
-                    local_probability /= ((double) (total - NBJudgeHashList.hashes[BSRet].users[j].data.count) / (double) (total)); // compute and divide by P(w|not C)
+                    local_probability = ((double) model->hashes->hashes[BSRet].users[j].data.count / (double) (total)); // compute P(w|C)
+                    local_probability /= ((double) (total - model->hashes->hashes[BSRet].users[j].data.count) / (double) (total)); // compute and divide by P(w|not C)
                     if (local_probability < MAGIC_MINIMUM) local_probability = MAGIC_MINIMUM;
                     else if (local_probability > 1) local_probability = 1;
                     local_probability += MAGIC_CONSERVE_OFFSET; // Not strictly mathematically accurate, but it conserves bits
 
-                    categories[NBJudgeHashList.hashes[BSRet].users[j].category].naiveBayesResult *= local_probability;
+                    categories[model->hashes->hashes[BSRet].users[j].category].naiveBayesResult *= local_probability;
 
                     // Catch missing at the end or in between
-                    if (j + 1 < NBJudgeHashList.hashes[BSRet].used) {
-                        nextReal = NBJudgeHashList.hashes[BSRet].users[j + 1].category;
-                    } else nextReal = NBCategories.used;
-                    for (missing = NBJudgeHashList.hashes[BSRet].users[j].category + 1; missing < nextReal; missing++) {
-//                      ci_debug_printf(10, "Last: %"PRIu16" Next: %"PRIu16" Missing: %"PRIu16"\n", NBJudgeHashList.hashes[BSRet].users[j].category, nextReal, missing);
+                    if (j + 1 < model->hashes->hashes[BSRet].used) {
+                        nextReal = model->hashes->hashes[BSRet].users[j + 1].category;
+                    } else nextReal = model->categories->used;
+                    for (missing = model->hashes->hashes[BSRet].users[j].category + 1; missing < nextReal; missing++) {
+//                      ci_debug_printf(10, "Last: %"PRIu16" Next: %"PRIu16" Missing: %"PRIu16"\n", model->hashes->hashes[BSRet].users[j].category, nextReal, missing);
                         categories[missing].naiveBayesResult *= MAGIC_MINIMUM;
                     }
                 }
@@ -700,7 +1513,7 @@ HTMLClassification doBayesPrepandClassify(HashList *toClassify)
                 // It has been changed to do a simple compare instead of a division and compare.
             {
                 // Find class with highest naiveBayesResult
-                for (cls = 0; cls < NBCategories.used; cls++) {
+                for (cls = 0; cls < model->categories->used; cls++) {
                     // If we are over DBL_MAX reset to DBL_MAX.
                     // Doing this only every so many processed keys
                     // makes this not be perfectly accurate, but it is worth
@@ -722,7 +1535,7 @@ HTMLClassification doBayesPrepandClassify(HashList *toClassify)
                 if (scale > DBL_MAX) scale = BAYES_MAXIMUM;
 
                 // Maximize values for bit conservation
-                for (cls = 0; cls < NBCategories.used; cls++) {
+                for (cls = 0; cls < model->categories->used; cls++) {
                     categories[cls].naiveBayesResult *= scale;
                 }
                 total_processed += processed;
@@ -733,18 +1546,19 @@ HTMLClassification doBayesPrepandClassify(HashList *toClassify)
     total_processed += processed;
 //  ci_debug_printf(10, "Found %"PRIu16" out of %"PRIu16" items\n", z, toClassify->used);
 
-    /*  for(i = 0; i < NBCategories.used; i++)
+    /*  for(i = 0; i < model->categories->used; i++)
         {
-            ci_debug_printf(10, "Here Category %s Result %G\n", NBCategories.categories[i].name, categories[i].naiveBayesResult);
+            ci_debug_printf(10, "Here Category %s Result %G\n", model->categories->categories[i].name, categories[i].naiveBayesResult);
         } */
 
     if (total_processed && total_processed < MINIMUM_MATCHES && toClassify->used > 20)
         correction_factor = MINIMUM_MATCHES / total_processed;
 
-    data = doBayesClassify(categories, toClassify, correction_factor);
+    data = doBayesClassify(model, categories, toClassify, correction_factor, allowed);
 
     // cleanup
     free(categories);
+    free(allowed);
     return data;
 }
 
@@ -878,9 +1692,7 @@ STORE_NEW:
 #endif
     close(fbc_file);
 
-#ifdef CLASSIFYWITHRADIX
-    initRadix(&NBJudgeHashList);
-#endif
+    initFBCSearch(&NBJudgeHashList);
     return 1;
 }
 
@@ -962,6 +1774,7 @@ STORE_NEW:
 //    if (startHashes != NBJudgeHashList.used) qsort(NBJudgeHashList.hashes, NBJudgeHashList.used, sizeof(FBCFeatureExt), &FBCjudgeHash_compare);
     if (startHashes != NBJudgeHashList.used) FBC_fluxsort(NBJudgeHashList.hashes, NBJudgeHashList.used, sizeof(FBCFeatureExt), &FBCjudgeHash_compare);
 //  ci_debug_printf(10, "Categories: %"PRIu32" Hashes Used: %"PRIu32"\n", NBCategories.used, NBJudgeHashList.used);
+    if (startHashes != NBJudgeHashList.used) initFBCSearch(&NBJudgeHashList);
 
     // Fixup memory usage
     /*  if(NBJudgeHashList.slots > NBJudgeHashList.used && NBJudgeHashList.used > 1)
@@ -1085,12 +1898,359 @@ ADD_HASH:
     munmap(address, size);
 #endif
     close(fbc_file);
-#ifdef CLASSIFYWITHRADIX
-    initRadix(&NBJudgeHashList);
-#endif
+    initFBCSearch(&NBJudgeHashList);
+    return 1;
+}
+
+#ifdef _POSIX_MAPPED_FILES
+#define FBC_MERGE_RECORD_SIZE (FBC_v1_HASH_SIZE + FBC_v1_HASH_USE_COUNT_SIZE)
+
+// One mapped fnb file taking part in loadMassBayesCategories' k-way merge
+typedef struct {
+    char *fileName;
+    char *catName;
+    char *address;
+    int64_t size;
+    int64_t start;      // Offset of the first record
+    uint32_t records;
+} FBCMergeStream;
+
+// A partition's position in one stream
+typedef struct {
+    int64_t offset;     // Offset of the next record
+    uint32_t next;
+    uint32_t first;     // Records [first, end) belong to the partition
+    uint32_t end;
+    HTMLFeature hash;   // Current record
+    FBC_v1_HASH_COUNT count;
+} FBCMergeCursor;
+
+typedef struct {
+    FBCMergeStream *streams;
+    uint16_t used;
+    uint16_t slots;
+} FBCMergeList;
+
+// One slice of the hash space, merged on its own thread
+typedef struct {
+    FBCMergeList *list;
+    FBCMergeCursor *cursors;    // One per stream
+    HTMLFeature low;            // Hashes [low, high] belong to the partition
+    HTMLFeature high;
+    uint32_t existing;          // Entries [existing, existingEnd) of NBJudgeHashList belong to the partition
+    uint32_t existingEnd;
+    uint16_t firstCategory;
+    FBCFeatureExt *merged;      // NULL to only count
+    int64_t unique;             // Hashes in the partition or -1 if a file is out of order
+} FBCMergePartition;
+
+static void FBCMergeAdd(FBCMergeList *list, const char *fbc_name, const char *cat_name)
+{
+    int fbc_file;
+    FBC_HEADERv1 header;
+    struct stat st;
+    FBCMergeStream *stream, *tempStreams;
+    char *address;
+
+    if ((fbc_file = openFBC(fbc_name, &header, 0)) < 0) return;
+    if (list->used == list->slots) {
+        tempStreams = realloc(list->streams, (list->slots + BAYES_CATEGORY_INC) * sizeof(FBCMergeStream));
+        if (tempStreams == NULL) {
+            ci_debug_printf(1, "Unable to allocate memory for %s in loadMassBayesCategories\n", fbc_name);
+            close(fbc_file);
+            return;
+        }
+        list->streams = tempStreams;
+        list->slots += BAYES_CATEGORY_INC;
+    }
+    stream = &list->streams[list->used];
+    fstat(fbc_file, &st);
+    stream->size = st.st_size;
+    stream->start = lseek64(fbc_file, 0, SEEK_CUR);
+    stream->records = header.records;
+    if (stream->start + (int64_t) header.records * FBC_MERGE_RECORD_SIZE > stream->size) {
+        ci_debug_printf(1, "Corrupted fnb file: %s, it is shorter than its %"PRIu32" records\n", fbc_name, header.records);
+        stream->records = (stream->size - stream->start) / FBC_MERGE_RECORD_SIZE;
+    }
+    address = mmap(0, stream->size, PROT_READ, MAP_PRIVATE, fbc_file, 0);
+    close(fbc_file);
+    if (address == MAP_FAILED) {
+        ci_debug_printf(3, "Failed to mmap %s in loadMassBayesCategories\n", fbc_name);
+        return;
+    }
+    stream->address = address;
+    stream->fileName = strdup(fbc_name);
+    stream->catName = strdup(cat_name);
+    list->used++;
+}
+
+// First record of stream whose hash is not below hash, assuming the file is sorted
+static uint32_t FBCMergeStreamFind(const FBCMergeStream *stream, HTMLFeature hash)
+{
+    uint32_t low = 0, high = stream->records, mid;
+    HTMLFeature current;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        char2binary(stream->address + stream->start + (int64_t) mid * FBC_MERGE_RECORD_SIZE, (char *) &current, FBC_v1_HASH_SIZE);
+        if (current < hash) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// First entry of NBJudgeHashList whose hash is not below hash
+static uint32_t FBCMergeExistingFind(HTMLFeature hash)
+{
+    uint32_t low = 0, high = NBJudgeHashList.used, mid;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (NBJudgeHashList.hashes[mid].hash < hash) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Read the next record of stream into cursor. Returns 1 if there was one, 0 at the end of the
+// partition and -1 if the file is not sorted or the record is outside of [low, high], which the
+// merge cannot handle.
+static inline int FBCMergeStreamNext(const FBCMergeStream *stream, FBCMergeCursor *cursor, HTMLFeature high)
+{
+    HTMLFeature last = cursor->hash;
+    if (cursor->next >= cursor->end) return 0;
+    char2binary(stream->address + cursor->offset, (char *) &cursor->hash, FBC_v1_HASH_SIZE);
+    char2binary(stream->address + cursor->offset + FBC_v1_HASH_SIZE, (char *) &cursor->count, FBC_v1_HASH_USE_COUNT_SIZE);
+    cursor->offset += FBC_MERGE_RECORD_SIZE;
+    cursor->next++;
+    if (cursor->hash < last || cursor->hash > high) return -1;
     return 1;
 }
 
+// Heap order. Equal hashes come out in stream (category) order, so users stay sorted by category.
+static inline int FBCMergeBefore(const FBCMergeCursor *cursors, uint16_t a, uint16_t b)
+{
+    return cursors[a].hash < cursors[b].hash || (cursors[a].hash == cursors[b].hash && a < b);
+}
+
+static void FBCMergeSiftDown(const FBCMergeCursor *cursors, uint16_t *heap, uint32_t heapUsed, uint32_t i)
+{
+    uint32_t child;
+    uint16_t top = heap[i];
+    while ((child = 2 * i + 1) < heapUsed) {
+        if (child + 1 < heapUsed && FBCMergeBefore(cursors, heap[child + 1], heap[child])) child++;
+        if (!FBCMergeBefore(cursors, heap[child], top)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = top;
+}
+
+// One sequential pass merging the partition's part of NBJudgeHashList (preload and anything
+// loaded before) with its part of every stream. With merged == NULL it only counts the hashes of
+// the final table, so that merged can be allocated at exactly that size. Sets unique to the
+// number of hashes or -1 if a file is out of order.
+static void *FBCMergePass(void *arg)
+{
+    FBCMergePartition *part = arg;
+    FBCMergeStream *streams = part->list->streams;
+    FBCMergeCursor *cursors = part->cursors;
+    FBCFeatureExt *merged = part->merged;
+    uint16_t *heap;
+    uint32_t heapUsed = 0, existing = part->existing, i, gatherUsed, gatherSlots = 0;
+    int64_t unique = 0;
+    HTMLFeature hash;
+    FBCHashJudgeUsers *gather = NULL, *tempUsers;
+    int status;
+
+    part->unique = -1;
+    heap = malloc(part->list->used * sizeof(uint16_t));
+    if (heap == NULL) return NULL;
+    for (i = 0; i < part->list->used; i++) {
+        cursors[i].offset = streams[i].start + (int64_t) cursors[i].first * FBC_MERGE_RECORD_SIZE;
+        cursors[i].next = cursors[i].first;
+        cursors[i].hash = part->low;
+        if ((status = FBCMergeStreamNext(&streams[i], &cursors[i], part->high)) < 0) goto OUT_OF_ORDER;
+        if (status) heap[heapUsed++] = i;
+    }
+    for (i = heapUsed / 2; i-- > 0;) FBCMergeSiftDown(cursors, heap, heapUsed, i);
+
+    while (heapUsed || existing < part->existingEnd) {
+        if (heapUsed && (existing >= part->existingEnd || cursors[heap[0]].hash < NBJudgeHashList.hashes[existing].hash))
+            hash = cursors[heap[0]].hash;
+        else hash = NBJudgeHashList.hashes[existing].hash;
+
+        gatherUsed = 0;
+        while (heapUsed && cursors[heap[0]].hash == hash) {
+            if (merged) {
+                if (gatherUsed == gatherSlots) {
+                    gatherSlots += BAYES_CATEGORY_INC;
+                    tempUsers = realloc(gather, gatherSlots * sizeof(FBCHashJudgeUsers));
+                    if (tempUsers == NULL) goto NO_MEMORY;
+                    gather = tempUsers;
+                }
+                gather[gatherUsed].category = part->firstCategory + heap[0];
+                gather[gatherUsed].data.count = cursors[heap[0]].count;
+            }
+            gatherUsed++;
+            if ((status = FBCMergeStreamNext(&streams[heap[0]], &cursors[heap[0]], part->high)) < 0) goto OUT_OF_ORDER;
+            if (status == 0) heap[0] = heap[--heapUsed];
+            if (heapUsed) FBCMergeSiftDown(cursors, heap, heapUsed, 0);
+        }
+
+        if (existing < part->existingEnd && NBJudgeHashList.hashes[existing].hash == hash) {
+            if (merged) {
+                merged[unique] = NBJudgeHashList.hashes[existing];
+                if (gatherUsed) {
+                    tempUsers = realloc(merged[unique].users, (merged[unique].used + gatherUsed) * sizeof(FBCHashJudgeUsers));
+                    if (tempUsers == NULL) goto NO_MEMORY;
+                    memcpy(&tempUsers[merged[unique].used], gather, gatherUsed * sizeof(FBCHashJudgeUsers));
+                    merged[unique].users = tempUsers;
+                    merged[unique].used += gatherUsed;
+                }
+            }
+            existing++;
+        } else if (merged) {
+            merged[unique].hash = hash;
+            merged[unique].used = gatherUsed;
+            merged[unique].users = NULL;
+            if (gatherUsed) {
+                if ((merged[unique].users = malloc(gatherUsed * sizeof(FBCHashJudgeUsers))) == NULL) goto NO_MEMORY;
+                memcpy(merged[unique].users, gather, gatherUsed * sizeof(FBCHashJudgeUsers));
+            }
+        }
+        unique++;
+    }
+    part->unique = unique;
+
+OUT_OF_ORDER:
+    free(heap);
+    free(gather);
+    return NULL;
+
+NO_MEMORY:
+    ci_debug_printf(1, "Unable to allocate memory while merging fnb files. Dying.\n");
+    exit(-1);
+}
+
+// Split the hash space into partitions and find where each of them starts in every stream and in
+// NBJudgeHashList. Returns 0 if a file is visibly unsorted.
+static int FBCMergePartitions(FBCMergeList *list, FBCMergePartition *parts, FBCMergeCursor *cursors, int partitions)
+{
+    int p;
+    uint16_t i;
+
+    for (p = 0; p < partitions; p++) {
+        parts[p].list = list;
+        parts[p].cursors = &cursors[p * list->used];
+        parts[p].low = loadPartitionStart(p, partitions);
+        parts[p].high = (p + 1 < partitions ? loadPartitionStart(p + 1, partitions) - 1 : UINT64_MAX);
+        parts[p].existing = (p ? parts[p - 1].existingEnd : 0);
+        parts[p].existingEnd = (p + 1 < partitions ? FBCMergeExistingFind(parts[p].high + 1) : (uint32_t) NBJudgeHashList.used);
+        parts[p].firstCategory = NBCategories.used;
+        parts[p].merged = NULL;
+        for (i = 0; i < list->used; i++) {
+            parts[p].cursors[i].first = (p ? parts[p - 1].cursors[i].end : 0);
+            parts[p].cursors[i].end = (p + 1 < partitions ? FBCMergeStreamFind(&list->streams[i], parts[p].high + 1) : list->streams[i].records);
+            // Searching an unsorted file can send a partition backwards. Otherwise the partitions
+            // cover every record and each pass checks that its records are sorted and in range.
+            if (parts[p].cursors[i].end < parts[p].cursors[i].first) return 0;
+        }
+    }
+    return 1;
+}
+
+// Build NBJudgeHashList from every file in list with a k-way merge instead of merging and
+// re-sorting the table once per category. The hash space is split into one partition per load
+// thread; each is counted and then merged on its own thread straight into its place in the table.
+static int FBCMergeLoad(FBCMergeList *list)
+{
+    FBCFeatureExt *merged = NULL;
+    FBCTextCategory *tempCategory = NULL;
+    FBCMergePartition *parts = NULL;
+    FBCMergeCursor *cursors = NULL;
+    int64_t unique = 0;
+    int partitions = loadThreadCount(), p;
+    uint16_t i;
+    int ret = 1;
+
+    if (list->used == 0) return 1;
+    if (NBJudgeHashList.FBC_LOCKED) {
+        ret = -1; // We cannot load if we are optimized
+        goto CLEANUP;
+    }
+
+    parts = malloc(partitions * sizeof(FBCMergePartition));
+    cursors = malloc((size_t) partitions * list->used * sizeof(FBCMergeCursor));
+    if (parts == NULL || cursors == NULL) {
+        ci_debug_printf(1, "Unable to allocate memory for partitions in loadMassBayesCategories\n");
+        ret = -2;
+        goto CLEANUP;
+    }
+    if (FBCMergePartitions(list, parts, cursors, partitions)) {
+        runLoadWorkers(FBCMergePass, parts, sizeof(FBCMergePartition), partitions);
+        for (p = 0; p < partitions && unique >= 0; p++) {
+            unique = (parts[p].unique < 0 ? -1 : unique + parts[p].unique);
+        }
+    } else unique = -1;
+    if (unique < 0) {
+        // Old or hand made files may not be sorted, fall back to loading them one at a time
+        ci_debug_printf(1, "loadMassBayesCategories: found an unsorted fnb file, loading one file at a time.\n");
+        for (i = 0; i < list->used; i++) {
+            munmap(list->streams[i].address, list->streams[i].size);
+            list->streams[i].address = NULL;
+            loadBayesCategory(list->streams[i].fileName, list->streams[i].catName);
+        }
+        goto CLEANUP;
+    }
+    if (unique > INT32_MAX || (unique && (merged = malloc(unique * sizeof(FBCFeatureExt))) == NULL)) {
+        ci_debug_printf(1, "Unable to allocate memory for %"PRId64" hashes in loadMassBayesCategories\n", unique);
+        ret = -2;
+        goto CLEANUP;
+    }
+    if (NBCategories.used + list->used > NBCategories.slots) {
+        tempCategory = realloc(NBCategories.categories, (NBCategories.used + list->used) * sizeof(FBCTextCategory));
+        if (tempCategory == NULL) {
+            ci_debug_printf(1, "Unable to allocate memory for categories in loadMassBayesCategories\n");
+            free(merged);
+            ret = -2;
+            goto CLEANUP;
+        }
+        NBCategories.categories = tempCategory;
+        NBCategories.slots = NBCategories.used + list->used;
+    }
+
+    // Partitions are in hash order, so laying them out one after the other gives the sorted table
+    for (p = 0, unique = 0; p < partitions; p++) {
+        parts[p].merged = merged + unique;
+        unique += parts[p].unique;
+    }
+    runLoadWorkers(FBCMergePass, parts, sizeof(FBCMergePartition), partitions);
+    for (i = 0; i < list->used; i++) {
+        NBCategories.categories[NBCategories.used].name = strndup(list->streams[i].catName, MAX_BAYES_CATEGORY_NAME);
+        NBCategories.categories[NBCategories.used].totalFeatures = list->streams[i].records;
+        NBCategories.used++;
+    }
+    // The users of the old entries now belong to merged
+    free(NBJudgeHashList.hashes);
+    NBJudgeHashList.hashes = merged;
+    NBJudgeHashList.used = unique;
+    NBJudgeHashList.slots = unique;
+    initFBCSearch(&NBJudgeHashList);
+
+CLEANUP:
+    free(parts);
+    free(cursors);
+    for (i = 0; i < list->used; i++) {
+        if (list->streams[i].address) munmap(list->streams[i].address, list->streams[i].size);
+        free(list->streams[i].fileName);
+        free(list->streams[i].catName);
+    }
+    free(list->streams);
+    list->streams = NULL;
+    list->used = list->slots = 0;
+    return ret;
+}
+#endif
+
 int loadMassBayesCategories(const char *fbc_dir)
 {
     DIR *dirp;
@@ -1098,6 +2258,9 @@ int loadMassBayesCategories(const char *fbc_dir)
     char old_dir[PATH_MAX];
     int name_len;
     char *cat_name;
+#ifdef _POSIX_MAPPED_FILES
+    FBCMergeList merge = { .streams = NULL, .used = 0, .slots = 0 };
+#endif
 
     if (getcwd(old_dir, PATH_MAX) == NULL) {
         ci_debug_printf(1, "Unable to get current working directory in loadMassBayesCategories because %s. Dying.", strerror(errno));
@@ -1128,7 +2291,11 @@ int loadMassBayesCategories(const char *fbc_dir)
                 cat_name = malloc(name_len + 1);
                 strncpy(cat_name, dp->d_name, name_len);
                 cat_name[name_len] = '\0';
+#ifdef _POSIX_MAPPED_FILES
+                FBCMergeAdd(&merge, dp->d_name, cat_name);
+#else
                 loadBayesCategory(dp->d_name, cat_name);
+#endif
                 free(cat_name);
             }
         }
@@ -1137,9 +2304,553 @@ int loadMassBayesCategories(const char *fbc_dir)
         perror("error reading directory");
     else
         (void) closedir(dirp);
+#ifdef _POSIX_MAPPED_FILES
+    FBCMergeLoad(&merge);
+#endif
 
     if (chdir(old_dir) == -1) {
         ci_debug_printf(1, "Unable to change directory in loadMassBayesCategories because %s. This should be impossible. Ignoring.", strerror(errno));
     }
     return 1;
 }
+
+#ifdef TRAINER
+static int writeFBCImageData(int file, const void *data, int64_t bytes)
+{
+    ssize_t i;
+    const char *pos = data;
+    while (bytes > 0) {
+        i = write(file, pos, bytes);
+        if (i < 0) {
+            if (errno == EINTR) continue;
+            ci_debug_printf(1, "writeFBCImage: write failed with error: %s\n", strerror(errno));
+            return -1;
+        }
+        pos += i;
+        bytes -= i;
+    }
+    return 0;
+}
+
+static int writeFBCImagePadding(int file, int64_t written)
+{
+    const char zeros[8] = { 0 };
+    return writeFBCImageData(file, zeros, FBC_IMAGE_ALIGN(written) - written);
+}
+
+int writeFBCImage(int file, FBCHashList *hashes)
+{
+    FBC_IMAGE_HEADERv1 header;
+    int64_t written;
+    int32_t totalFeatures;
+    uint32_t i;
+    int status;
+
+    if (!hashes->FBC_LOCKED) {
+        ci_debug_printf(1, "writeFBCImage: the judge table must be optimized before it can be written\n");
+        return -1;
+    }
+    memset(&header, 0, sizeof(FBC_IMAGE_HEADERv1));
+    memcpy(&header.ID, "FNI", 4);
+    header.version = FBC_IMAGE_FORMAT_VERSION;
+    header.UBM = UNICODE_BYTE_MARK;
+    header.WCS = sizeof(wchar_t);
+    header.flags = hashes->FBC_LOG_DOMAIN ? FBC_IMAGE_LOG_DOMAIN : 0;
+    if (hashes->pool8) header.flags |= FBC_IMAGE_QUANTIZE8;
+    else if (hashes->pool16) header.flags |= FBC_IMAGE_QUANTIZE16;
+    header.categories = NBCategories.used;
+    header.keys = hashes->used;
+    header.pool = hashes->offsets[hashes->used];
+    for (i = 0; i < NBCategories.used; i++) {
+        header.namesSize += strlen(NBCategories.categories[i].name) + 1;
+    }
+
+    do {
+        status = ftruncate(file, 0);
+    } while (status == -1 && errno == EINTR);
+    if (status == -1) {
+        ci_debug_printf(1, "writeFBCImage: failed to truncate file: %s\n", strerror(errno));
+        return -1;
+    }
+    lseek64(file, 0, SEEK_SET);
+
+    if (writeFBCImageData(file, &header, sizeof(FBC_IMAGE_HEADERv1)) < 0) return -1;
+    written = sizeof(FBC_IMAGE_HEADERv1);
+    for (i = 0; i < NBCategories.used; i++) {
+        totalFeatures = NBCategories.categories[i].totalFeatures;
+        if (writeFBCImageData(file, &totalFeatures, sizeof(int32_t)) < 0) return -1;
+    }
+    written += NBCategories.used * sizeof(int32_t);
+    if (writeFBCImagePadding(file, written) < 0) return -1;
+    written = FBC_IMAGE_ALIGN(written);
+    for (i = 0; i < NBCategories.used; i++) {
+        if (writeFBCImageData(file, NBCategories.categories[i].name, strlen(NBCategories.categories[i].name) + 1) < 0) return -1;
+    }
+    written += header.namesSize;
+    if (writeFBCImagePadding(file, written) < 0) return -1;
+    written = FBC_IMAGE_ALIGN(written);
+    if (writeFBCImageData(file, hashes->keys, (int64_t) header.keys * sizeof(HTMLFeature)) < 0) return -1;
+    written += (int64_t) header.keys * sizeof(HTMLFeature);
+    if (writeFBCImageData(file, hashes->offsets, ((int64_t) header.keys + 1) * sizeof(uint32_t)) < 0) return -1;
+    written += ((int64_t) header.keys + 1) * sizeof(uint32_t);
+    if (writeFBCImagePadding(file, written) < 0) return -1;
+    written = FBC_IMAGE_ALIGN(written);
+    if (hashes->pool8) {
+        if (writeFBCImageData(file, hashes->dequant, FBC_DEQUANT8_SIZE * sizeof(double)) < 0) return -1;
+        if (writeFBCImageData(file, hashes->pool8, (int64_t) header.pool * sizeof(FBCHashJudgeUsersQ8)) < 0) return -1;
+    } else if (hashes->pool16) {
+        if (writeFBCImageData(file, hashes->dequant, FBC_DEQUANT16_SIZE * sizeof(double)) < 0) return -1;
+        if (writeFBCImageData(file, hashes->pool16, (int64_t) header.pool * sizeof(FBCHashJudgeUsersQ16)) < 0) return -1;
+    } else if (writeFBCImageData(file, hashes->pool, (int64_t) header.pool * sizeof(FBCHashJudgeUsers)) < 0) return -1;
+    return 0;
+}
+#endif
+
+#ifdef _POSIX_MAPPED_FILES
+// Is a mapped image sound enough to use? The searches need the keys in order, and scoring uses
+// the offsets and each user's category without any further checks. The users in pool are
+// user_size bytes apart, and every kind of them starts with its category.
+static int checkFBCImage(const FBC_IMAGE_HEADERv1 *header, const HTMLFeature *keys, const uint32_t *offsets, const char *pool, int64_t user_size)
+{
+    uint32_t i;
+
+    // offsets[header->keys] is already known to be header->pool
+    for (i = 0; i < header->keys; i++) {
+        if (offsets[i] > offsets[i + 1] || (i && keys[i - 1] >= keys[i])) return 0;
+    }
+    for (i = 0; i < header->pool; i++) {
+        if (((const FBCHashJudgeUsers *) (pool + i * user_size))->category >= header->categories) return 0;
+    }
+    return 1;
+}
+#endif
+
+// Map a compiled image made by fnb_makeimage. Every process mapping the same image shares
+// the pages, and there is nothing to parse, merge, sort or optimize.
+int loadBayesImage(const char *image_name)
+{
+#ifndef _POSIX_MAPPED_FILES
+    ci_debug_printf(1, "loadBayesImage: %s cannot be loaded, this system lacks mmap\n", image_name);
+    return -1;
+#else
+    int image_file;
+    struct stat st;
+    char *address, *names, *name_end;
+    FBC_IMAGE_HEADERv1 *header;
+    FBCTextCategory *tempCategory = NULL;
+    int32_t *totalFeatures;
+    int64_t pos, size, keys_pos, offsets_pos, pool_pos, dequant_size = 0, user_size = sizeof(FBCHashJudgeUsers);
+    uint32_t i;
+
+    if (NBJudgeHashList.FBC_LOCKED || NBJudgeHashList.used || NBCategories.used) {
+        ci_debug_printf(1, "loadBayesImage: %s cannot be loaded on top of other fnb data\n", image_name);
+        return -1;
+    }
+    if ((image_file = open(image_name, O_RDONLY)) < 0) {
+        ci_debug_printf(1, "loadBayesImage: unable to open %s: %s\n", image_name, strerror(errno));
+        return -1;
+    }
+    if (fstat(image_file, &st) < 0 || st.st_size < (off_t) sizeof(FBC_IMAGE_HEADERv1)) {
+        ci_debug_printf(1, "loadBayesImage: %s is not a fnb image\n", image_name);
+        close(image_file);
+        return -1;
+    }
+    size = st.st_size;
+    address = mmap(0, size, PROT_READ, MAP_SHARED, image_file, 0);
+    close(image_file);
+    if (address == MAP_FAILED) {
+        ci_debug_printf(1, "loadBayesImage: failed to mmap %s: %s\n", image_name, strerror(errno));
+        return -1;
+    }
+
+    header = (FBC_IMAGE_HEADERv1 *) address;
+    if (memcmp(header->ID, "FNI", 4) != 0 || header->version != FBC_IMAGE_FORMAT_VERSION ||
+            header->UBM != UNICODE_BYTE_MARK || header->WCS != sizeof(wchar_t)) {
+        ci_debug_printf(1, "loadBayesImage: %s is not a fnb image for this system\n", image_name);
+        goto BAD_IMAGE;
+    }
+    pos = FBC_IMAGE_ALIGN(sizeof(FBC_IMAGE_HEADERv1) + header->categories * sizeof(int32_t));
+    keys_pos = FBC_IMAGE_ALIGN(pos + header->namesSize);
+    offsets_pos = keys_pos + (int64_t) header->keys * sizeof(HTMLFeature);
+    pool_pos = FBC_IMAGE_ALIGN(offsets_pos + ((int64_t) header->keys + 1) * sizeof(uint32_t));
+    if (header->flags & FBC_IMAGE_QUANTIZE8) {
+        dequant_size = FBC_DEQUANT8_SIZE * sizeof(double);
+        user_size = sizeof(FBCHashJudgeUsersQ8);
+    } else if (header->flags & FBC_IMAGE_QUANTIZE16) {
+        dequant_size = FBC_DEQUANT16_SIZE * sizeof(double);
+        user_size = sizeof(FBCHashJudgeUsersQ16);
+    }
+    if (pool_pos + dequant_size + (int64_t) header->pool * user_size > size ||
+            ((uint32_t *) (address + offsets_pos))[header->keys] != header->pool) {
+        ci_debug_printf(1, "loadBayesImage: %s is truncated or corrupted\n", image_name);
+        goto BAD_IMAGE;
+    }
+    if (!checkFBCImage(header, (HTMLFeature *) (address + keys_pos), (uint32_t *) (address + offsets_pos), address + pool_pos + dequant_size, user_size)) {
+        ci_debug_printf(1, "loadBayesImage: %s has corrupted hashes\n", image_name);
+        goto BAD_IMAGE;
+    }
+
+    if (header->categories > NBCategories.slots) {
+        tempCategory = realloc(NBCategories.categories, header->categories * sizeof(FBCTextCategory));
+        if (tempCategory == NULL) {
+            ci_debug_printf(1, "loadBayesImage: unable to allocate memory for categories\n");
+            goto BAD_IMAGE;
+        }
+        NBCategories.categories = tempCategory;
+        NBCategories.slots = header->categories;
+    }
+    totalFeatures = (int32_t *) (address + sizeof(FBC_IMAGE_HEADERv1));
+    names = address + pos;
+    name_end = names + header->namesSize;
+    for (i = 0; i < header->categories; i++) {
+        if (names >= name_end || memchr(names, '\0', name_end - names) == NULL) {
+            ci_debug_printf(1, "loadBayesImage: %s has corrupted category names\n", image_name);
+            while (NBCategories.used) free(NBCategories.categories[--NBCategories.used].name);
+            goto BAD_IMAGE;
+        }
+        NBCategories.categories[i].name = strndup(names, MAX_BAYES_CATEGORY_NAME);
+        NBCategories.categories[i].totalFeatures = totalFeatures[i];
+        NBCategories.used++;
+        names += strlen(names) + 1;
+    }
+
+    NBJudgeHashList.keys = (HTMLFeature *) (address + keys_pos);
+    NBJudgeHashList.offsets = (uint32_t *) (address + offsets_pos);
+    if (header->flags & FBC_IMAGE_QUANTIZE8) {
+        NBJudgeHashList.dequant = (double *) (address + pool_pos);
+        NBJudgeHashList.pool8 = (FBCHashJudgeUsersQ8 *) (address + pool_pos + dequant_size);
+        NBJudgeHashList.FBC_QUANTIZE = 8;
+    } else if (header->flags & FBC_IMAGE_QUANTIZE16) {
+        NBJudgeHashList.dequant = (double *) (address + pool_pos);
+        NBJudgeHashList.pool16 = (FBCHashJudgeUsersQ16 *) (address + pool_pos + dequant_size);
+        NBJudgeHashList.FBC_QUANTIZE = 16;
+    } else NBJudgeHashList.pool = (FBCHashJudgeUsers *) (address + pool_pos);
+    NBJudgeHashList.used = header->keys;
+    NBJudgeHashList.slots = header->keys;
+    NBJudgeHashList.FBC_LOG_DOMAIN = (header->flags & (FBC_IMAGE_LOG_DOMAIN | FBC_IMAGE_QUANTIZE8 | FBC_IMAGE_QUANTIZE16)) ? 1 : 0;
+    NBJudgeHashList.image = address;
+    NBJudgeHashList.imageSize = size;
+    NBJudgeHashList.FBC_LOCKED = 1;
+    if (NBJudgeHashList.FBC_EARLY_EXIT && !NBJudgeHashList.FBC_LOG_DOMAIN) {
+        ci_debug_printf(1, "loadBayesImage: %s is not log domain, early exit is not possible.\n", image_name);
+        NBJudgeHashList.FBC_EARLY_EXIT = 0;
+    }
+    if (hierarchy_groups > 0 && !NBJudgeHashList.FBC_LOG_DOMAIN) {
+        ci_debug_printf(1, "loadBayesImage: %s is not log domain, classification stays flat.\n", image_name);
+    }
+    if (NBJudgeHashList.FBC_EARLY_EXIT) FBCScoreBounds(&NBJudgeHashList);
+    if (NBJudgeHashList.FBC_EYTZINGER) FBCBuildEytzinger(&NBJudgeHashList);
+    initFBCSearch(&NBJudgeHashList);
+    return 1;
+
+BAD_IMAGE:
+    munmap(address, size);
+    return -1;
+#endif
+}
+
+// Deep copy of the unoptimized table src into dest, options included, so that dest can be
+// optimized into a snapshot while src keeps the counts for the next one.
+int copyFBCCounts(FBCHashList *dest, const FBCHashList *src)
+{
+    int32_t i;
+
+    if (src->FBC_LOCKED) return -1; // Optimized tables have no counts left
+    *dest = *src;
+    dest->radix.start = NULL; // Built for dest when it is optimized
+    dest->radix.bits = 0;
+    dest->bloom.blocks = NULL;
+    dest->bloom.shift = 0;
+    memset(&dest->hierarchy, 0, sizeof(myHierarchy_t));
+    dest->hashes = malloc((src->used ? src->used : 1) * sizeof(FBCFeatureExt));
+    if (dest->hashes == NULL) goto NO_MEMORY;
+    dest->slots = src->used;
+    for (i = 0; i < src->used; i++) {
+        dest->hashes[i] = src->hashes[i];
+        if (src->hashes[i].used) {
+            dest->hashes[i].users = malloc(src->hashes[i].used * sizeof(FBCHashJudgeUsers));
+            if (dest->hashes[i].users == NULL) {
+                dest->used = i;
+                freeFBCHashList(dest);
+                goto NO_MEMORY;
+            }
+            memcpy(dest->hashes[i].users, src->hashes[i].users, src->hashes[i].used * sizeof(FBCHashJudgeUsers));
+        } else dest->hashes[i].users = NULL;
+    }
+    return 0;
+
+NO_MEMORY:
+    ci_debug_printf(1, "copyFBCCounts: unable to allocate memory for %"PRId32" hashes\n", src->used);
+    dest->hashes = NULL;
+    dest->used = 0;
+    dest->slots = 0;
+    return -2;
+}
+
+// Count one more document with hash for category, keeping users sorted by category.
+// Returns 1 if the hash is new to category, 0 if it only got counted again.
+static int FBCLearnUser(FBCFeatureExt *feature, uint16_t category)
+{
+    FBCHashJudgeUsers *tempUsers;
+    uint_least16_t j;
+
+    for (j = 0; j < feature->used && feature->users[j].category < category; j++);
+    if (j < feature->used && feature->users[j].category == category) {
+        if (feature->users[j].data.count < UINT_LEAST32_MAX) feature->users[j].data.count++;
+        return 0;
+    }
+    if (feature->used == FBC_v1_QTY_MAX) return 0;
+    tempUsers = realloc(feature->users, (feature->used + 1) * sizeof(FBCHashJudgeUsers));
+    if (tempUsers == NULL) {
+        ci_debug_printf(1, "Unable to allocate memory while learning. Dying.\n");
+        exit(-1);
+    }
+    memmove(&tempUsers[j + 1], &tempUsers[j], (feature->used - j) * sizeof(FBCHashJudgeUsers));
+    tempUsers[j].category = category;
+    tempUsers[j].data.count = 1;
+    feature->users = tempUsers;
+    feature->used++;
+    return 1;
+}
+
+// Add a document's sorted unique hashes to category in the unoptimized table counts. Unlike
+// learnHashesBayesCategory this merges into the sorted table in place, from the back, so
+// learning one document costs one pass over the table and no sort. Returns how many of the
+// hashes were new to category, or a negative number if nothing was learned.
+int learnFBCCounts(FBCHashList *counts, uint16_t category, const HashList *docHashes)
+{
+    FBCFeatureExt *tempHashes;
+    int64_t old, doc, pos;
+    uint32_t i, added = 0;
+    int learned = 0;
+
+    if (counts->FBC_LOCKED) return -1; // We cannot learn once we are optimized
+    for (i = 1; i < docHashes->used; i++) {
+        if (docHashes->hashes[i] <= docHashes->hashes[i - 1]) {
+            ci_debug_printf(1, "learnFBCCounts: document hashes must be sorted and unique\n");
+            return -3;
+        }
+    }
+
+    // Count the hashes the table does not have yet, to grow it once
+    for (old = 0, doc = 0; doc < docHashes->used; doc++) {
+        while (old < counts->used && counts->hashes[old].hash < docHashes->hashes[doc]) old++;
+        if (old >= counts->used || counts->hashes[old].hash != docHashes->hashes[doc]) added++;
+    }
+    if ((int64_t) counts->used + added > INT32_MAX) return -2;
+    if (counts->used + added > counts->slots) {
+        tempHashes = realloc(counts->hashes, (counts->used + added) * sizeof(FBCFeatureExt));
+        if (tempHashes == NULL) {
+            ci_debug_printf(1, "learnFBCCounts: unable to allocate memory for %"PRIu32" more hashes\n", added);
+            return -2;
+        }
+        counts->hashes = tempHashes;
+        counts->slots = counts->used + added;
+    }
+
+    // Merge from the back so nothing is overwritten before it has moved
+    old = counts->used - 1;
+    doc = (int64_t) docHashes->used - 1;
+    pos = counts->used + added - 1;
+    while (doc >= 0) {
+        if (old >= 0 && counts->hashes[old].hash > docHashes->hashes[doc]) {
+            counts->hashes[pos--] = counts->hashes[old--];
+        } else if (old >= 0 && counts->hashes[old].hash == docHashes->hashes[doc]) {
+            learned += FBCLearnUser(&counts->hashes[old], category);
+            counts->hashes[pos--] = counts->hashes[old--];
+            doc--;
+        } else {
+            counts->hashes[pos].hash = docHashes->hashes[doc];
+            counts->hashes[pos].used = 0;
+            counts->hashes[pos].users = NULL;
+            learned += FBCLearnUser(&counts->hashes[pos], category);
+            pos--;
+            doc--;
+        }
+    }
+    counts->used += added;
+    // Stale now. optimizeFBC builds them again, rebuilding here would make learning a log O(n^2).
+    freeRadixIndex(&counts->radix);
+    freeBloomFilter(&counts->bloom);
+    return learned;
+}
+
+// Put the optimized table snapshot in place of NBJudgeHashList and hand back the old one in
+// snapshot, to be released with freeFBCHashList. The caller must hold the lock classification
+// reads NBJudgeHashList under, so no classification sees half of either table.
+void swapBayesSnapshot(FBCHashList *snapshot)
+{
+    FBCHashList old = NBJudgeHashList;
+    NBJudgeHashList = *snapshot;
+    *snapshot = old;
+}
+
+// Exchange the contents of model with NBCategories and NBJudgeHashList, so the loading and
+// optimizing functions, which only know those, work on model. Swap again to put them back.
+void swapBayesModel(FBCModel *model)
+{
+    FBCTextCategoryExt categories = NBCategories;
+    FBCHashList hashes = NBJudgeHashList;
+
+    NBCategories = *model->categories;
+    NBJudgeHashList = *model->hashes;
+    *model->categories = categories;
+    *model->hashes = hashes;
+}
+
+// An empty model set to load categories into, or NULL if there is no memory for it
+FBCModel *newBayesModel(void)
+{
+    FBCModel *model = malloc(sizeof(FBCModel));
+
+    if (model == NULL) return NULL;
+    model->categories = calloc(1, sizeof(FBCTextCategoryExt));
+    model->hashes = calloc(1, sizeof(FBCHashList));
+    if (model->categories == NULL || model->hashes == NULL) {
+        free(model->categories);
+        free(model->hashes);
+        free(model);
+        return NULL;
+    }
+    swapBayesModel(model);
+    initBayesClassifier();
+    swapBayesModel(model);
+    return model;
+}
+
+void freeBayesModel(FBCModel *model)
+{
+    if (model == NULL) return;
+    swapBayesModel(model);
+    deinitBayesClassifier();
+    swapBayesModel(model);
+    free(model->categories);
+    free(model->hashes);
+    free(model);
+}
+
+static int writeFBCLearnData(int file, const void *data, int64_t bytes)
+{
+    ssize_t i;
+    const char *pos = data;
+    while (bytes > 0) {
+        i = write(file, pos, bytes);
+        if (i < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        pos += i;
+        bytes -= i;
+    }
+    return 0;
+}
+
+// Append one learned document to the learning log log_name, creating it if needed. The log is
+// locked while writing, so several c-icap children can share it.
+int writeBayesLearnLog(const char *log_name, const char *cat_name, const HashList *docHashes)
+{
+    int log_file, ret = 0;
+    struct stat st;
+    uint16_t version = FBC_LEARN_LOG_FORMAT_VERSION, UBM = UNICODE_BYTE_MARK, WCS = sizeof(wchar_t), len;
+    uint32_t qty = docHashes->used;
+    char *record;
+    int64_t size;
+
+    len = strnlen(cat_name, MAX_BAYES_CATEGORY_NAME);
+    size = sizeof(len) + len + sizeof(qty) + (int64_t) qty * FBC_v1_HASH_SIZE;
+    if ((record = malloc(size)) == NULL) return -2;
+    memcpy(record, &len, sizeof(len));
+    memcpy(record + sizeof(len), cat_name, len);
+    memcpy(record + sizeof(len) + len, &qty, sizeof(qty));
+    if (qty) memcpy(record + sizeof(len) + len + sizeof(qty), docHashes->hashes, (int64_t) qty * FBC_v1_HASH_SIZE);
+
+    if ((log_file = open(log_name, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) < 0) {
+        ci_debug_printf(1, "Unable to open learning log %s because %s\n", log_name, strerror(errno));
+        free(record);
+        return -1;
+    }
+    flock(log_file, LOCK_EX);
+    if (fstat(log_file, &st) == 0 && st.st_size == 0) {
+        if (writeFBCLearnData(log_file, "FNL", FBC_HEADERv1_ID_SIZE) != 0 ||
+                writeFBCLearnData(log_file, &version, FBC_HEADERv1_VERSION_SIZE) != 0 ||
+                writeFBCLearnData(log_file, &UBM, FBC_HEADERv1_UBM_SIZE) != 0 ||
+                writeFBCLearnData(log_file, &WCS, FBC_HEADERv2_WCS_SIZE) != 0) ret = -1;
+    }
+    if (ret == 0 && writeFBCLearnData(log_file, record, size) != 0) ret = -1;
+    if (ret != 0) ci_debug_printf(1, "Unable to write to learning log %s because %s\n", log_name, strerror(errno));
+    flock(log_file, LOCK_UN);
+    close(log_file);
+    free(record);
+    return ret;
+}
+
+// Learn every document of the learning log log_name past *offset (0 for the start of the log)
+// into the unoptimized table counts and move *offset past them. Categories are looked up by
+// name in NBCategories; newFeatures[category] (or, without newFeatures, the category's
+// totalFeatures) is increased by the hashes new to each category.
+// Returns the number of documents learned, or a negative number if the log is not usable.
+int applyBayesLearnLog(const char *log_name, int64_t *offset, FBCHashList *counts, int32_t *newFeatures)
+{
+    int log_file, applied = 0, learned;
+    struct stat st;
+    char header[FBC_LEARN_LOG_HEADER_SIZE];
+    char name[MAX_BAYES_CATEGORY_NAME + 1];
+    uint16_t version, UBM, WCS, len, cat;
+    uint32_t qty;
+    HashList doc = { .hashes = NULL, .used = 0, .slots = 0 };
+    HTMLFeature *tempHashes;
+
+    if ((log_file = open(log_name, O_RDONLY)) < 0) {
+        if (errno == ENOENT) return 0; // Nothing learned yet
+        ci_debug_printf(1, "Unable to open learning log %s because %s\n", log_name, strerror(errno));
+        return -1;
+    }
+    flock(log_file, LOCK_SH);
+    if (fstat(log_file, &st) != 0 || st.st_size < FBC_LEARN_LOG_HEADER_SIZE) goto DONE;
+    if (*offset == 0) {
+        if (pread(log_file, header, FBC_LEARN_LOG_HEADER_SIZE, 0) != FBC_LEARN_LOG_HEADER_SIZE) goto BAD_LOG;
+        memcpy(&version, header + FBC_HEADERv1_ID_SIZE, FBC_HEADERv1_VERSION_SIZE);
+        memcpy(&UBM, header + FBC_HEADERv1_ID_SIZE + FBC_HEADERv1_VERSION_SIZE, FBC_HEADERv1_UBM_SIZE);
+        memcpy(&WCS, header + FBC_HEADERv1_ID_SIZE + FBC_HEADERv1_VERSION_SIZE + FBC_HEADERv1_UBM_SIZE, FBC_HEADERv2_WCS_SIZE);
+        if (memcmp(header, "FNL", FBC_HEADERv1_ID_SIZE) != 0 || version != FBC_LEARN_LOG_FORMAT_VERSION || UBM != UNICODE_BYTE_MARK || WCS != sizeof(wchar_t)) goto BAD_LOG;
+        *offset = FBC_LEARN_LOG_HEADER_SIZE;
+    }
+
+    // A record that is still short is being written, it is picked up next time
+    while (*offset + (int64_t) (sizeof(len) + sizeof(qty)) <= st.st_size) {
+        if (pread(log_file, &len, sizeof(len), *offset) != sizeof(len) || len > MAX_BAYES_CATEGORY_NAME) goto BAD_LOG;
+        if (*offset + (int64_t) (sizeof(len) + len + sizeof(qty)) > st.st_size) break;
+        if (pread(log_file, name, len, *offset + sizeof(len)) != len) goto BAD_LOG;
+        name[len] = '\0';
+        if (pread(log_file, &qty, sizeof(qty), *offset + sizeof(len) + len) != sizeof(qty)) goto BAD_LOG;
+        if (*offset + (int64_t) (sizeof(len) + len + sizeof(qty)) + (int64_t) qty * FBC_v1_HASH_SIZE > st.st_size) break;
+        if (qty > doc.slots) {
+            if ((tempHashes = realloc(doc.hashes, qty * FBC_v1_HASH_SIZE)) == NULL) break;
+            doc.hashes = tempHashes;
+            doc.slots = qty;
+        }
+        if (qty && pread(log_file, doc.hashes, (int64_t) qty * FBC_v1_HASH_SIZE, *offset + sizeof(len) + len + sizeof(qty)) != (int64_t) qty * FBC_v1_HASH_SIZE) goto BAD_LOG;
+        doc.used = qty;
+        *offset += sizeof(len) + len + sizeof(qty) + (int64_t) qty * FBC_v1_HASH_SIZE;
+
+        for (cat = 0; cat < NBCategories.used && strcmp(NBCategories.categories[cat].name, name) != 0; cat++);
+        if (cat == NBCategories.used) {
+            ci_debug_printf(3, "Learning log %s has a document for unknown category %s, skipping it\n", log_name, name);
+            continue;
+        }
+        if ((learned = learnFBCCounts(counts, cat, &doc)) < 0) continue;
+        if (newFeatures) newFeatures[cat] += learned;
+        else NBCategories.categories[cat].totalFeatures += learned;
+        applied++;
+    }
+    goto DONE;
+
+BAD_LOG:
+    ci_debug_printf(1, "Learning log %s is not a valid learning log or is corrupted\n", log_name);
+    if (applied == 0) applied = -1;
+DONE:
+    flock(log_file, LOCK_UN);
+    close(log_file);
+    free(doc.hashes);
+    return applied;
+}
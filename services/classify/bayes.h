@@ -67,6 +67,63 @@ typedef struct {
     uint_least32_t records;
 } FBC_HEADERv1;
 
+// Fast Naive Bayes Image File Format Version 1 is as follows
+// An image is a compiled, read only copy of an optimized NBJudgeHashList (see fnb_makeimage)
+// so that c-icap can mmap it instead of loading and optimizing every fnb file.
+// Header
+// BYTE 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32
+//      ID      Ver UBM WCS   FLAGS CATS  RSVD  KEYS        POOL        NAMES       RSVD
+//      F N I 0
+// ID = 3 characters and a NUL, Ver, UBM, WCS are as in the FNB format
+// FLAGS is UINT16_T, FBC_IMAGE_LOG_DOMAIN is set if pool holds log domain scores
+// CATS is UINT16_T, the number of categories
+// KEYS is UINT32_T, the number of hashes; POOL is UINT32_T, the number of hash users
+// NAMES is UINT32_T, the size in bytes of the category name block
+// FBC_IMAGE_QUANTIZE8 or FBC_IMAGE_QUANTIZE16 is set if the pool holds quantized codes
+// Sections, each starting on an 8 byte boundary
+// INT32_T total features for each category
+// Category names, each NUL terminated, in category order
+// KEYS sorted UINT64_T hashes
+// KEYS + 1 UINT32_T offsets into the pool
+// If quantized, the dequantization table (FBC_DEQUANT8_SIZE or FBC_DEQUANT16_SIZE doubles)
+// POOL FBCHashJudgeUsers, already converted to probabilities (or log domain scores),
+// or FBCHashJudgeUsersQ8 / FBCHashJudgeUsersQ16 if quantized
+#define FBC_IMAGE_FORMAT_VERSION 1
+#define FBC_IMAGE_LOG_DOMAIN 1
+#define FBC_IMAGE_QUANTIZE8 2
+#define FBC_IMAGE_QUANTIZE16 4
+#define FBC_IMAGE_ALIGN(x) (((x) + 7) & ~((int64_t) 7))
+
+typedef struct {
+    char ID[4];
+    uint16_t version;
+    uint16_t UBM;
+    uint16_t WCS;
+    uint16_t flags;
+    uint16_t categories;
+    uint16_t reserved;
+    uint32_t keys;
+    uint32_t pool;
+    uint32_t namesSize;
+    uint32_t reserved2;
+} FBC_IMAGE_HEADERv1;
+
+// Fast Naive Bayes Learning Log Format Version 1 is as follows
+// A learning log collects documents learned by c-icap (see LearnLogFNB) so that every child,
+// and c-icap after a restart, can add them to its model. Records are only ever appended.
+// Header
+// BYTE 1 2 3 4 5 6 7 8 9
+//      ID    Ver UBM WCS
+//      F N L
+// ID = 3 characters, Ver, UBM, WCS are as in the FNB format
+// Records, one per learned document
+// BYTE 1 2 3 ....
+//      LEN NAME QTY H H H ....
+// LEN is UINT16_T, the length of the category NAME that follows (not NUL terminated)
+// QTY is UINT32_T, the number of sorted unique UINT64_T hashes H that follow
+#define FBC_LEARN_LOG_FORMAT_VERSION 1
+#define FBC_LEARN_LOG_HEADER_SIZE (FBC_HEADERv1_ID_SIZE + FBC_HEADERv1_VERSION_SIZE + FBC_HEADERv1_UBM_SIZE + FBC_HEADERv2_WCS_SIZE)
+
 typedef struct {
     char *name;
     int32_t totalFeatures;
@@ -76,6 +133,7 @@ typedef struct {
     FBCTextCategory *categories;
     uint16_t used;
     uint16_t slots;
+    mySecondaries_t secondaries; // see buildBayesSecondaries
 } FBCTextCategoryExt;
 
 typedef struct __attribute__ ((__packed__))
@@ -87,6 +145,22 @@ typedef struct __attribute__ ((__packed__))
     } data;
 } FBCHashJudgeUsers;
 
+// Quantized log domain scores, see FBC_QUANTIZE
+typedef struct __attribute__ ((__packed__))
+{
+    uint_least16_t category;
+    uint8_t code;
+} FBCHashJudgeUsersQ8;
+
+typedef struct __attribute__ ((__packed__))
+{
+    uint_least16_t category;
+    uint16_t code;
+} FBCHashJudgeUsersQ16;
+
+#define FBC_DEQUANT8_SIZE 256 // One score per code
+#define FBC_DEQUANT16_SIZE 2  // Score of code 0 and the step between codes
+
 typedef struct __attribute__ ((__packed__))
 {
     HTMLFeature hash;
@@ -99,8 +173,55 @@ typedef struct  {
     int32_t used;
     int32_t slots;
     int FBC_LOCKED; // FBC_LOCKED is used to keep from loading more data or writing data if we are in an optimized state.
+    // Flat judge table, built by optimizeFBC. Once FBC_LOCKED is set hashes is released and
+    // the users of keys[i] are pool[offsets[i]] through pool[offsets[i + 1] - 1].
+    HTMLFeature *keys;
+    uint32_t *offsets;
+    FBCHashJudgeUsers *pool;
+    // If set before optimizeFBC, pool holds log(probability) - log(MAGIC_MINIMUM) and
+    // doBayesPrepandClassify sums in the log domain.
+    int FBC_LOG_DOMAIN;
+    // If set before optimizeFBC, lookups use a copy of keys in Eytzinger (breadth first) order.
+    // eytzinger is 1 based and eytzingerRank[k] is the index in keys of eytzinger[k].
+    int FBC_EYTZINGER;
+    HTMLFeature *eytzinger;
+    uint32_t *eytzingerRank;
+    // If set to 8 or 16 before optimizeFBC, the log domain scores (FBC_LOG_DOMAIN is implied)
+    // are stored as codes of that many bits in pool8 or pool16 instead of pool, and dequant
+    // turns a code back into a score.
+    int FBC_QUANTIZE;
+    FBCHashJudgeUsersQ8 *pool8;
+    FBCHashJudgeUsersQ16 *pool16;
+    double *dequant;
+    // If set before optimizeFBC (FBC_LOG_DOMAIN is implied) or loadBayesImage, log domain
+    // classification stops once the hashes left to score cannot change the best category (or,
+    // with secondaries configured, the second best), nor move their levels across any level
+    // given to setBayesExitLevels. scoreLow and scoreHigh bound what one
+    // hash can add to any category, 0 included since categories without the hash get nothing.
+    int FBC_EARLY_EXIT;
+    double scoreLow;
+    double scoreHigh;
+    // If above 0 before optimizeFBC, pruneFBC first drops the hashes whose log domain scores
+    // across all categories are closer together than this.
+    double FBC_PRUNE;
+    // If the table came from loadBayesImage, keys, offsets and pool point into this read only mapping
+    char *image;
+    int64_t imageSize;
+    // Prefix index and Bloom filter of hashes (or of keys once FBC_LOCKED), rebuilt whenever
+    // either changes
+    myRadix_t radix;
+    myBloom_t bloom;
+    // Category groups of a log domain table once FBC_LOCKED, if hierarchy_groups is set
+    myHierarchy_t hierarchy;
 } FBCHashList;
 
+// Categories and judge table classified together. NBModel is NBCategories and NBJudgeHashList,
+// the other model sets are swapped into them with swapBayesModel to be loaded.
+typedef struct {
+    FBCTextCategoryExt *categories;
+    FBCHashList *hashes;
+} FBCModel;
+
 #ifdef IN_BAYES
 void writeFBCHeader(int file, FBC_HEADERv1 *header);
 int openFBC(const char *filename, FBC_HEADERv1 *header, int forWriting);
@@ -110,12 +231,27 @@ void computeHashes(regexHead *myHead, uint32_t primaryseed, uint32_t secondaryse
 int preLoadBayes(const char *fbc_name);
 int loadBayesCategory(const char *fbc_name, const char *cat_name);
 int learnHashesBayesCategory(uint16_t cat_num, HashList *docHashes);
-HTMLClassification doBayesPrepandClassify(HashList *toClassify);
+HTMLClassification doBayesPrepandClassify(const FBCModel *model, HashList *toClassify, const char *subset);
 void initBayesClassifier(void);
 void deinitBayesClassifier(void);
+void buildBayesSecondaries(void);
+void selectBayesKernels(void);
 int isBayes(const char *filename);
 int loadMassBayesCategories(const char *fbc_dir);
 int optimizeFBC(FBCHashList *hashes);
+int pruneFBC(FBCHashList *hashes, double minSpread);
+int writeFBCImage(int file, FBCHashList *hashes);
+int loadBayesImage(const char *image_name);
+void freeFBCHashList(FBCHashList *hashes);
+int copyFBCCounts(FBCHashList *dest, const FBCHashList *src);
+int learnFBCCounts(FBCHashList *counts, uint16_t category, const HashList *docHashes);
+void swapBayesSnapshot(FBCHashList *snapshot);
+FBCModel *newBayesModel(void);
+void swapBayesModel(FBCModel *model);
+void freeBayesModel(FBCModel *model);
+int writeBayesLearnLog(const char *log_name, const char *cat_name, const HashList *docHashes);
+int applyBayesLearnLog(const char *log_name, int64_t *offset, FBCHashList *counts, int32_t *newFeatures);
+void setBayesExitLevels(const double *levels, int count);
 #else
 extern void writeFBCHeader(int file, FBC_HEADERv1 *header);
 extern int openFBC(const char *filename, FBC_HEADERv1 *header, int forWriting);
@@ -124,12 +260,27 @@ extern int writeFBCHashesPreload(int file, FBC_HEADERv1 *header, HashList *hashe
 extern int preLoadBayes(const char *fbc_name);
 extern int loadBayesCategory(const char *fbc_name, const char *cat_name);
 extern int learnHashesBayesCategory(uint16_t cat_num, HashList *docHashes);
-extern HTMLClassification doBayesPrepandClassify(HashList *toClassify);
+extern HTMLClassification doBayesPrepandClassify(const FBCModel *model, HashList *toClassify, const char *subset);
 extern void initBayesClassifier(void);
 extern void deinitBayesClassifier(void);
+extern void buildBayesSecondaries(void);
+extern void selectBayesKernels(void);
 extern int isBayes(const char *filename);
 extern int loadMassBayesCategories(const char *fbc_dir);
 extern int optimizeFBC(FBCHashList *hashes);
+extern int pruneFBC(FBCHashList *hashes, double minSpread);
+extern int writeFBCImage(int file, FBCHashList *hashes);
+extern int loadBayesImage(const char *image_name);
+extern void freeFBCHashList(FBCHashList *hashes);
+extern int copyFBCCounts(FBCHashList *dest, const FBCHashList *src);
+extern int learnFBCCounts(FBCHashList *counts, uint16_t category, const HashList *docHashes);
+extern void swapBayesSnapshot(FBCHashList *snapshot);
+extern FBCModel *newBayesModel(void);
+extern void swapBayesModel(FBCModel *model);
+extern void freeBayesModel(FBCModel *model);
+extern int writeBayesLearnLog(const char *log_name, const char *cat_name, const HashList *docHashes);
+extern int applyBayesLearnLog(const char *log_name, int64_t *offset, FBCHashList *counts, int32_t *newFeatures);
+extern void setBayesExitLevels(const double *levels, int count);
 #endif
 
 #define BAYES_CATEGORY_INC 10
@@ -137,6 +288,7 @@ extern int optimizeFBC(FBCHashList *hashes);
 #ifndef IN_BAYES
 extern FBCTextCategoryExt NBCategories;
 extern FBCHashList NBJudgeHashList;
+extern FBCModel NBModel;
 #endif
 
 #ifndef IN_BAYES
@@ -203,6 +355,20 @@ typedef int CMPFUNC (const void *a, const void *b);
 #include "quadsort.c"
 #include "fluxsort.c"
 
+#ifdef KERNEL_DISPATCH
+// The same sort for AVX2 with the hash comparison inlined, picked by selectBayesKernels
+#undef FUNC
+#define FUNC(NAME) NAME##FBCFeatureExtKey
+#define cmp(a, b) ((a)->hash > (b)->hash)
+#pragma GCC push_options
+#pragma GCC target("avx2,bmi2")
+#include "quadsort.c"
+#include "fluxsort.c"
+#pragma GCC pop_options
+#undef cmp
+#endif
+static int FBCSortKernel = KERNEL_SCALAR;
+
 static void FBC_fluxsort(void *array, size_t nmemb, size_t size, CMPFUNC *cmp)
 {
 	if (nmemb < 2)
@@ -210,6 +376,9 @@ static void FBC_fluxsort(void *array, size_t nmemb, size_t size, CMPFUNC *cmp)
 		return;
 	}
 
+#ifdef KERNEL_DISPATCH
+	if (FBCSortKernel >= KERNEL_AVX2) return fluxsortFBCFeatureExtKey(array, nmemb, cmp);
+#endif
 	return fluxsortFBCFeatureExt(array, nmemb, cmp);
 }
 #endif
@@ -186,7 +186,7 @@ HTMLClassification judgeFile(char *judge_file)
         classification.secondary_probability = DBL_MAX;
         classification.primary_probScaled = DBL_MAX;
         classification.secondary_probScaled = DBL_MAX;
-    } else classification = doHSPrepandClassify(&myHashes);
+    } else classification = doHSPrepandClassify(&HSModel, &myHashes, NULL);
 
 #ifdef _GNU_SOURCE
     if (prehash_data_file <= 0 && myHashes.used > 0) {
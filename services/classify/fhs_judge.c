@@ -54,6 +54,7 @@
 
 char *judge_file;
 char *fhs_dir;
+int eytzinger = 0;
 
 int readArguments(int argc, char *argv[])
 {
@@ -67,10 +68,12 @@ int readArguments(int argc, char *argv[])
         printf("\t-i INPUT_FILE_TO_JUDGE\n");
         printf("\t-d CATEGORY_FHS_FILES_DIR\n");
         printf("\t-r Related categories in form of \"primary,secondary,bidirectional\". Bidirectional should be 1 for yes, 0 for no. This option should only be supplied once. To include more than one, separate with \"=\".\n");
+        printf("\t-e EYTZINGER_SEARCH (1 to search the hashes in Eytzinger order, defaults to 0)\n");
+        printf("\t-k KERNEL_LEVEL (auto, scalar, avx2 or avx512, the newest instructions to use, defaults to auto)\n");
         printf("Spaces and case matter.\n");
         return -1;
     }
-    for (i=1; i<9; i+=2) {
+    for (i=1; i<argc-1; i+=2) {
         if (strcmp(argv[i], "-p") == 0) sscanf(argv[i+1], "%"PRIx32, &HASHSEED1);
         else if (strcmp(argv[i], "-s") == 0) sscanf(argv[i+1], "%"PRIx32, &HASHSEED2);
         else if (strcmp(argv[i], "-i") == 0) {
@@ -84,6 +87,15 @@ int readArguments(int argc, char *argv[])
         } else if (strcmp(argv[i], "-r") == 0) {
             strncpy(temp, argv[i+1], PATH_MAX-1);
             setupPrimarySecondFromCmdLine(temp);
+        } else if (strcmp(argv[i], "-e") == 0) {
+            eytzinger = atoi(argv[i+1]) ? 1 : 0;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            if ((kernel_level = parseKernelLevel(argv[i+1])) < KERNEL_AUTO) {
+                printf("Unknown kernel level %s\n", argv[i+1]);
+                return -1;
+            }
+            selectHTMLKernels();
+            selectHSKernels();
         }
     }
     /*  printf("Primary Seed: %"PRIX32"\n", HASHSEED1);
@@ -112,6 +124,7 @@ int main (int argc, char *argv[])
 
     printf("Loading hashes -- be patient!\n");
     loadMassHSCategories(fhs_dir);
+    if (eytzinger) optimizeFHS(&HSJudgeHashList);
 
     printf("Classifying\n");
     start = clock();
@@ -128,7 +141,7 @@ int main (int argc, char *argv[])
     computeOSBHashes(&myRegexHead, HASHSEED1, HASHSEED2, &myHashes);
     s3 = clock();
 
-    classification=doHSPrepandClassify(&myHashes);
+    classification=doHSPrepandClassify(&HSModel, &myHashes, NULL);
     end=clock();
 
 //  printf("%ld: %.*ls\n", myRegexHead.head->rm_eo - myRegexHead.head->rm_so, myRegexHead.head->rm_eo - myRegexHead.head->rm_so, myRegexHead.main_memory);
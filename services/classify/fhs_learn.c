@@ -96,7 +96,7 @@ int main (int argc, char *argv[])
     wchar_t *myData;
     HashList myHashes;
     FHS_HEADERv1 header;
-    int fhs_file;
+    int fhs_file, ret;
     if (readArguments(argc, argv)==-1) exit(-1);
     checkMakeUTF8();
     initHTML();
@@ -120,14 +120,22 @@ int main (int argc, char *argv[])
     myHashes.used = 0;
     computeOSBHashes(&myRegexHead, HASHSEED1, HASHSEED2, &myHashes);
     fhs_file = openFHS(fhs_out_file, &header, 1);
-    if (writeFHSHashes(fhs_file, &header, &myHashes) == -1)
-        printf("MAJOR PROBLEM: Input file: %s had no hashed data!\n", learn_in_file);
-    close(fhs_file);
+    if (fhs_file < 0) {
+        printf("Unable to open %s to learn %s!\n", fhs_out_file, learn_in_file);
+        ret = 1;
+    } else {
+        if ((ret = writeFHSHashes(fhs_file, &header, &myHashes)) == -1)
+            printf("MAJOR PROBLEM: Input file: %s had no hashed data!\n", learn_in_file);
+        else if (ret < 0)
+            printf("Unable to learn %s into %s!\n", learn_in_file, fhs_out_file);
+        ret = (ret < 0 ? 1 : 0);
+        close(fhs_file);
+    }
 
     free(myHashes.hashes);
     freeRegexHead(&myRegexHead);
     free(learn_in_file);
     free(fhs_out_file);
     deinitHTML();
-    return 0;
+    return ret;
 }
@@ -113,7 +113,7 @@ int main(int argc, char *argv[])
     int fhs_file;
     FHS_HEADERv1 header;
     clock_t start, end;
-    uint_least16_t docsWritten = 0;
+    uint32_t docsWritten = 0;
     initHTML();
     initHyperSpaceClassifier();
     if (readArguments(argc, argv) == -1) exit(-1);
@@ -130,7 +130,7 @@ int main(int argc, char *argv[])
     close(fhs_file);
 
     end = clock();
-    printf("Wrote out: %"PRIu32" hashes as %"PRIu16" documents.\n", HSJudgeHashList.used, docsWritten);
+    printf("Wrote out: %"PRIu32" hashes as %"PRIu32" documents.\n", HSJudgeHashList.used, docsWritten);
     printf("Preload making took %lf seconds\n", (double)((end-start)/(CLOCKS_PER_SEC)));
 
     deinitHyperSpaceClassifier();
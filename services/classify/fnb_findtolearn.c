@@ -185,7 +185,7 @@ HTMLClassification judgeFile(char *judge_file)
         classification.secondary_probability = DBL_MAX;
         classification.primary_probScaled = DBL_MAX;
         classification.secondary_probScaled = DBL_MAX;
-    } else classification = doBayesPrepandClassify(&myHashes);
+    } else classification = doBayesPrepandClassify(&NBModel, &myHashes, NULL);
 
 #ifdef _GNU_SOURCE
     if (prehash_data_file <= 0 && myHashes.used > 0) {
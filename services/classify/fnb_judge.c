@@ -67,10 +67,15 @@ int readArguments(int argc, char *argv[])
         printf("\t-i INPUT_FILE_TO_JUDGE\n");
         printf("\t-d CATEGORY_FNB_FILES_DIR\n");
         printf("\t-r Related categories in form of \"primary,secondary,bidirectional\". Bidirectional should be 1 for yes, 0 for no. This option should only be supplied once. To include more than one, separate with \"=\".\n");
+        printf("\t-l LOG_DOMAIN_SCORING (1 to sum log probabilities, 0 to multiply, defaults to 0)\n");
+        printf("\t-e EYTZINGER_SEARCH (1 to search the hashes in Eytzinger order, defaults to 0)\n");
+        printf("\t-q QUANTIZE_BITS (8 or 16 to store log probabilities as codes of that many bits, defaults to 0, not quantized)\n");
+        printf("\t-x EARLY_EXIT (1 to stop scoring once the best category cannot change, implies -l 1, defaults to 0)\n");
+        printf("\t-k KERNEL_LEVEL (auto, scalar, avx2 or avx512, the newest instructions to use, defaults to auto)\n");
         printf("Spaces and case matter.\n");
         return -1;
     }
-    for (i=1; i<9; i+=2) {
+    for (i=1; i<argc-1; i+=2) {
         if (strcmp(argv[i], "-p") == 0) sscanf(argv[i+1], "%"PRIx32, &HASHSEED1);
         else if (strcmp(argv[i], "-s") == 0) sscanf(argv[i+1], "%"PRIx32, &HASHSEED2);
         else if (strcmp(argv[i], "-i") == 0) {
@@ -84,6 +89,21 @@ int readArguments(int argc, char *argv[])
         } else if (strcmp(argv[i], "-r") == 0) {
             strncpy(temp, argv[i+1], PATH_MAX-1);
             setupPrimarySecondFromCmdLine(temp);
+        } else if (strcmp(argv[i], "-l") == 0) {
+            NBJudgeHashList.FBC_LOG_DOMAIN = atoi(argv[i+1]) ? 1 : 0;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            NBJudgeHashList.FBC_EYTZINGER = atoi(argv[i+1]) ? 1 : 0;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            NBJudgeHashList.FBC_QUANTIZE = atoi(argv[i+1]);
+        } else if (strcmp(argv[i], "-x") == 0) {
+            NBJudgeHashList.FBC_EARLY_EXIT = atoi(argv[i+1]) ? 1 : 0;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            if ((kernel_level = parseKernelLevel(argv[i+1])) < KERNEL_AUTO) {
+                printf("Unknown kernel level %s\n", argv[i+1]);
+                return -1;
+            }
+            selectHTMLKernels();
+            selectBayesKernels();
         }
     }
     /*  printf("Primary Seed: %"PRIX32"\n", HASHSEED1);
@@ -132,7 +152,7 @@ int main (int argc, char *argv[])
     computeOSBHashes(&myRegexHead, HASHSEED1, HASHSEED2, &myHashes);
     s3 = clock();
 
-    classification=doBayesPrepandClassify(&myHashes);
+    classification=doBayesPrepandClassify(&NBModel, &myHashes, NULL);
     end = clock();
 
 //  printf("%ld: %.*ls\n", myRegexHead.head->rm_eo - myRegexHead.head->rm_so, myRegexHead.head->rm_eo - myRegexHead.head->rm_so, myRegexHead.main_memory);
@@ -0,0 +1,138 @@
+/*
+ *  Copyright (C) 2008-2021 Trever L. Adams
+ *
+ *  This file is part of srv_classify c-icap module and accompanying tools.
+ *
+ *  srv_classify is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  srv_classify is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#if (_FILE_OFFSET_BITS != 64)
+#undef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#ifndef NOT_CICAP
+#define NOT_CICAP
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#include "hash.c"
+#include "bayes.c"
+
+char *fbc_out_file;
+char *fbc_dir;
+int log_domain = 0;
+int quantize = 0;
+double prune = 0;
+
+int readArguments(int argc, char *argv[])
+{
+    int i;
+    if (argc < 5) {
+        printf("Format of arguments is:\n");
+        printf("\t-d FNB_DIRECTORY\n");
+        printf("\t-o OUTPUT_FNB_IMAGE_FILE\n");
+        printf("\t-l LOG_DOMAIN_SCORING (1 to store log probabilities for summing, defaults to 0)\n");
+        printf("\t-q QUANTIZE_BITS (8 or 16 to store log probabilities as codes of that many bits, defaults to 0)\n");
+        printf("\t-p MINIMUM_SPREAD (drop hashes whose category scores are closer than this, defaults to 0)\n");
+        printf("\t-g GROUP_USERS (1 to keep the users of each hash together by top level group for HierarchyGroups, defaults to 0)\n");
+        printf("Spaces and case matter.\n");
+        return -1;
+    }
+    for (i=1; i<argc-1; i+=2) {
+        if (strcmp(argv[i], "-o") == 0) {
+            fbc_out_file = malloc(strlen(argv[i+1]) + 1);
+            sscanf(argv[i+1], "%s", fbc_out_file);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            fbc_dir = malloc(strlen(argv[i+1]) + 1);
+            sscanf(argv[i+1], "%s", fbc_dir);
+        } else if (strcmp(argv[i], "-l") == 0) {
+            log_domain = atoi(argv[i+1]) ? 1 : 0;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            quantize = atoi(argv[i+1]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            prune = strtod(argv[i+1], NULL);
+        } else if (strcmp(argv[i], "-g") == 0) {
+            hierarchy_groups = atoi(argv[i+1]) ? 1 : 0;
+        }
+    }
+    if (fbc_out_file == NULL || fbc_dir == NULL) {
+        printf("Both -d and -o are required.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int fbc_file;
+    clock_t start, end;
+    initHTML();
+    initBayesClassifier();
+    if (readArguments(argc, argv) == -1) exit(-1);
+
+    printf("Loading hashes -- be patient!\n");
+    start = clock();
+    loadMassBayesCategories(fbc_dir);
+    NBJudgeHashList.FBC_LOG_DOMAIN = log_domain;
+    NBJudgeHashList.FBC_QUANTIZE = quantize;
+    NBJudgeHashList.FBC_PRUNE = prune;
+    if (optimizeFBC(&NBJudgeHashList) < 0) {
+        printf("Unable to optimize the loaded categories.\n");
+        exit(-1);
+    }
+    printf("\nWriting out image file: %s\n", fbc_out_file);
+
+    fbc_file = open(fbc_out_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fbc_file < 0) {
+        printf("Unable to open %s: %s\n", fbc_out_file, strerror(errno));
+        exit(-1);
+    }
+    if (writeFBCImage(fbc_file, &NBJudgeHashList) < 0) {
+        printf("Failed to write %s\n", fbc_out_file);
+        close(fbc_file);
+        exit(-1);
+    }
+    close(fbc_file);
+
+    end = clock();
+    printf("Wrote out: %"PRIu16" categories, %"PRId32" hashes.\n", NBCategories.used, NBJudgeHashList.used);
+    printf("Image making took %lf seconds\n", (double)((end-start)/(CLOCKS_PER_SEC)));
+
+    deinitBayesClassifier();
+    deinitHTML();
+    return 0;
+}
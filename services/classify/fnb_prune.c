@@ -0,0 +1,132 @@
+/*
+ *  Copyright (C) 2008-2021 Trever L. Adams
+ *
+ *  This file is part of srv_classify c-icap module and accompanying tools.
+ *
+ *  srv_classify is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of
+ *  the License, or (at your option) any later version.
+ *
+ *  srv_classify is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#if (_FILE_OFFSET_BITS != 64)
+#undef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#ifndef NOT_CICAP
+#define NOT_CICAP
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#include "hash.c"
+#include "bayes.c"
+
+char *fbc_dir;
+char *fbc_out_dir;
+double min_spread = -1;
+
+int readArguments(int argc, char *argv[])
+{
+    int i;
+    if (argc < 7) {
+        printf("Format of arguments is:\n");
+        printf("\t-d FNB_DIRECTORY\n");
+        printf("\t-o OUTPUT_FNB_DIRECTORY (may be the same as FNB_DIRECTORY)\n");
+        printf("\t-s MINIMUM_SPREAD (hashes whose category scores are closer than this are dropped, 0 to 1.25)\n");
+        printf("Spaces and case matter.\n");
+        return -1;
+    }
+    for (i=1; i<argc-1; i+=2) {
+        if (strcmp(argv[i], "-o") == 0) {
+            fbc_out_dir = malloc(strlen(argv[i+1]) + 1);
+            sscanf(argv[i+1], "%s", fbc_out_dir);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            fbc_dir = malloc(strlen(argv[i+1]) + 1);
+            sscanf(argv[i+1], "%s", fbc_dir);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            min_spread = strtod(argv[i+1], NULL);
+        }
+    }
+    if (fbc_out_dir == NULL || fbc_dir == NULL || min_spread < 0) {
+        printf("-d, -o and -s are all required.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int fbc_file, pruned;
+    uint16_t i;
+    int32_t before;
+    char fbc_name[PATH_MAX];
+    FBC_HEADERv1 header;
+    clock_t start, end;
+    initHTML();
+    initBayesClassifier();
+    if (readArguments(argc, argv) == -1) exit(-1);
+
+    printf("Loading hashes -- be patient!\n");
+    start = clock();
+    loadMassBayesCategories(fbc_dir);
+    before = NBJudgeHashList.used;
+    if ((pruned = pruneFBC(&NBJudgeHashList, min_spread)) < 0) {
+        printf("Unable to prune the loaded categories.\n");
+        exit(-1);
+    }
+    printf("Pruned %d of %"PRId32" hashes.\n", pruned, before);
+
+    // Every category is written back, as pruning looks at all of them together
+    for (i = 0; i < NBCategories.used; i++) {
+        snprintf(fbc_name, PATH_MAX, "%s/%s.fnb", fbc_out_dir, NBCategories.categories[i].name);
+        printf("Writing out: %s\n", fbc_name);
+        if ((fbc_file = openFBC(fbc_name, &header, 1)) < 0) {
+            printf("Unable to open %s: %s\n", fbc_name, strerror(errno));
+            exit(-1);
+        }
+        if (writeFBCHashes(fbc_file, &header, &NBJudgeHashList, i, 0) == -1)
+            printf("Category %s has no hashes left!\n", NBCategories.categories[i].name);
+        close(fbc_file);
+    }
+
+    end = clock();
+    printf("Wrote out: %"PRIu16" categories, %"PRId32" hashes.\n", NBCategories.used, NBJudgeHashList.used);
+    printf("Pruning took %lf seconds\n", (double)((end-start)/(CLOCKS_PER_SEC)));
+
+    free(fbc_dir);
+    free(fbc_out_dir);
+    deinitBayesClassifier();
+    deinitHTML();
+    return 0;
+}
@@ -47,9 +47,12 @@
 #include <wctype.h>
 #include <float.h>
 #include <math.h>
+#include <pthread.h>
 #include <unicode/ubrk.h>
 #include <unicode/ustring.h>
 #include <unicode/uclean.h>
+#include <unicode/uchar.h>
+#include <unicode/uscript.h>
 
 #define IN_HTML 1
 #ifndef NOT_CICAP
@@ -78,6 +81,10 @@ regex_t insaneFinder;
 
 secondaries_t *secondary_compares = NULL;
 int number_secondaries = 0;
+int load_threads = 0; // Worker threads used by loadMassBayesCategories and loadMassHSCategories, 0 is one per online CPU
+int radix_bits = 0; // Prefix bits of the judge table radix indexes, 0 picks them from the number of keys
+int hierarchy_groups = 0; // Top level category groups hierarchical classification scores in full, 0 is off
+int kernel_level = KERNEL_AUTO; // Best hot kernels to use, KERNEL_AUTO is the best the CPU has
 
 UErrorCode UError;
 
@@ -97,9 +104,472 @@ static int entity_compare(void const *a, void const *b)
     return 0; // Equal
 }
 
+// Number of hash space partitions (and threads) the mass loaders should build with
+int loadThreadCount(void)
+{
+    long cpus = load_threads;
+    if (cpus <= 0) cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > LOAD_PARTITIONS_MAX) cpus = LOAD_PARTITIONS_MAX;
+    return cpus;
+}
+
+// First hash of partition out of partitions. Partitions split the hash space on its top 16 bits,
+// so they are contiguous and in order; the last one runs to the end of the hash space.
+HTMLFeature loadPartitionStart(int partition, int partitions)
+{
+    if (partition <= 0) return 0;
+    return ((HTMLFeature) partition * 65536 / partitions) << 48;
+}
+
+// Run worker once for each of the count argument blocks of argSize bytes in args, each on its
+// own thread. The first block runs on the calling thread, as does any block whose thread could
+// not be started. Returns once all of them are done.
+void runLoadWorkers(void *(*worker)(void *), void *args, size_t argSize, int count)
+{
+    pthread_t *threads = NULL;
+    char *started = NULL;
+    int i;
+
+    if (count > 1) {
+        threads = malloc(count * sizeof(pthread_t));
+        started = calloc(count, sizeof(char));
+        if (threads == NULL || started == NULL) {
+            free(threads);
+            free(started);
+            threads = NULL;
+            started = NULL;
+        }
+    }
+    for (i = 1; i < count && threads; i++) {
+        started[i] = pthread_create(&threads[i], NULL, worker, (char *) args + i * argSize) == 0;
+    }
+    for (i = 0; i < count; i++) {
+        if (started && started[i]) pthread_join(threads[i], NULL);
+        else worker((char *) args + i * argSize);
+    }
+    free(threads);
+    free(started);
+}
+
+// (Re)build radix over the used sorted keys, key i being the HTMLFeature at keys + i * stride,
+// so it works on the flat keys as well as on the start of each table entry. Unless radix_bits
+// says otherwise, it uses about one bucket per two keys. If there is no memory for it radix is
+// left empty and the searches use the whole table.
+int buildRadixIndex(myRadix_t *radix, const void *keys, size_t stride, uint32_t used)
+{
+    uint32_t *start, i, p, next = 0;
+    int bits = radix_bits;
+    HTMLFeature key;
+
+    if (bits <= 0) {
+        bits = RADIX_BITS_MIN;
+        while (bits < RADIX_BITS_AUTO_MAX && ((uint32_t) 2 << bits) < used) bits++;
+    }
+    if (bits < RADIX_BITS_MIN) bits = RADIX_BITS_MIN;
+    if (bits > RADIX_BITS_MAX) bits = RADIX_BITS_MAX;
+    freeRadixIndex(radix);
+    if ((start = malloc(((1 << bits) + 1) * sizeof(uint32_t))) == NULL) {
+        ci_debug_printf(1, "buildRadixIndex: unable to allocate memory for a %d bit index\n", bits);
+        return -2;
+    }
+    for (i = 0; i < used; i++) {
+        memcpy(&key, (const char *) keys + i * stride, sizeof(HTMLFeature)); // Table entries are packed
+        p = key >> (64 - bits);
+        while (next <= p) start[next++] = i;
+    }
+    while (next <= ((uint32_t) 1 << bits)) start[next++] = used;
+    radix->start = start;
+    radix->bits = bits;
+    return 0;
+}
+
+void freeRadixIndex(myRadix_t *radix)
+{
+    free(radix->start);
+    radix->start = NULL;
+    radix->bits = 0;
+}
+
+// (Re)build bloom over the used keys, laid out as for buildRadixIndex. If there is no memory for
+// it bloom is left empty and every lookup goes to the table.
+int buildBloomFilter(myBloom_t *bloom, const void *keys, size_t stride, uint32_t used)
+{
+    void *temp = NULL;
+    uint64_t *block, probe, blocks = 2, want = ((uint64_t) used * BLOOM_BITS_PER_KEY + 511) / 512;
+    HTMLFeature key;
+    uint32_t i;
+    int log2blocks = 1, j;
+
+    while (blocks < want) {
+        blocks <<= 1;
+        log2blocks++;
+    }
+    freeBloomFilter(bloom);
+    // Cache line aligned so that a lookup reads exactly one line
+    if (posix_memalign(&temp, 64, blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t)) != 0) {
+        ci_debug_printf(1, "buildBloomFilter: unable to allocate memory for %"PRIu64" blocks\n", blocks);
+        return -2;
+    }
+    bloom->blocks = temp;
+    bloom->shift = 64 - log2blocks;
+    memset(bloom->blocks, 0, blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+    for (i = 0; i < used; i++) {
+        memcpy(&key, (const char *) keys + i * stride, sizeof(HTMLFeature)); // Table entries are packed
+        block = bloom->blocks + ((key * BLOOM_BLOCK_MIX) >> bloom->shift) * BLOOM_BLOCK_WORDS;
+        probe = key * BLOOM_PROBE_MIX;
+        for (j = 0; j < BLOOM_PROBES; j++) {
+            block[probe & 7] |= (uint64_t) 1 << ((probe >> 3) & 63);
+            probe >>= 9;
+        }
+    }
+    return 0;
+}
+
+void freeBloomFilter(myBloom_t *bloom)
+{
+    free(bloom->blocks);
+    bloom->blocks = NULL;
+    bloom->shift = 0;
+}
+
+// Length of the top level group at the start of name, all of it if there is no dot
+static size_t categoryGroupLength(const char *name)
+{
+    const char *dot = strchr(name, '.');
+    return dot ? (size_t) (dot - name) : strlen(name);
+}
+
+// (Re)build hierarchy over the hashes of table, the users of each (at most maxUsers) coming from
+// users. names are those of the categories, in category order. The users of a hash whose groups
+// are not already together are put in group order by regroup; a table that cannot be changed
+// (an image) passes NULL and must already be in group order. If scored, each entry keeps the best
+// score of its users. Returns 1 if the names make too few groups for there to be any point or the
+// table is not in group order, leaving hierarchy empty, or -2 if there is no memory for it.
+// Classification is then flat.
+int buildHierarchy(myHierarchy_t *hierarchy, const char * const *names, uint16_t categories, void *table, uint32_t hashes, uint32_t maxUsers, hierarchyUsers_t users, hierarchyRegroup_t regroup, int scored)
+{
+    uint16_t *cats = NULL, *seen = NULL, groups = 0, g;
+    uint32_t *count = NULL, *order = NULL, *start = NULL, i, j, k, n, entries = 0;
+    float *scores = NULL;
+    void *scratch = NULL;
+    myHierarchyEntry_t *entry;
+    size_t length;
+    int regrouped, ret = -2;
+
+    freeHierarchy(hierarchy);
+    if (hierarchy_groups <= 0 || categories < 2) return 1;
+    if ((hierarchy->groupOf = malloc(categories * sizeof(uint16_t))) == NULL) goto CLEANUP;
+    for (i = 0; i < categories; i++) {
+        length = categoryGroupLength(names[i]);
+        for (j = 0; j < i; j++) {
+            if (categoryGroupLength(names[j]) == length && strncmp(names[i], names[j], length) == 0) break;
+        }
+        hierarchy->groupOf[i] = (j < i ? hierarchy->groupOf[j] : groups++);
+    }
+    // With all groups kept the second stage would score every category anyway
+    if (groups <= hierarchy_groups) {
+        freeHierarchy(hierarchy);
+        return 1;
+    }
+    hierarchy->categories = categories;
+    hierarchy->groups = groups;
+
+    cats = malloc((maxUsers ? maxUsers : 1) * sizeof(uint16_t));
+    scores = malloc((maxUsers ? maxUsers : 1) * sizeof(float));
+    order = malloc((maxUsers ? maxUsers : 1) * sizeof(uint32_t));
+    scratch = malloc((maxUsers ? maxUsers : 1) * HIERARCHY_USER_MAX);
+    count = calloc(groups, sizeof(uint32_t));
+    seen = malloc(groups * sizeof(uint16_t));
+    start = malloc(groups * sizeof(uint32_t));
+    hierarchy->offsets = malloc((hashes + 1) * sizeof(uint32_t));
+    if (!cats || !scores || !order || !scratch || !count || !seen || !start || !hierarchy->offsets) goto CLEANUP;
+
+    // Put each hash's users in group order, groups in the order they first appear, and count
+    // the entries. Hashes already in group order are left alone.
+    for (i = 0; i < hashes; i++) {
+        hierarchy->offsets[i] = entries;
+        n = users(table, i, cats, NULL);
+        k = 0;
+        regrouped = 0;
+        for (j = 0; j < n; j++) {
+            g = hierarchy->groupOf[cats[j]];
+            if (count[g]++ == 0) seen[k++] = g;
+            else if (hierarchy->groupOf[cats[j - 1]] != g) regrouped = 1;
+        }
+        for (j = 0; j < k; j++) {
+            start[seen[j]] = (j ? start[seen[j - 1]] + count[seen[j - 1]] : 0);
+            entries += (count[seen[j]] + UINT16_MAX - 1) / UINT16_MAX;
+        }
+        if (regrouped) {
+            if (regroup == NULL) {
+                ci_debug_printf(1, "buildHierarchy: users are not in group order, classification stays flat\n");
+                ret = 1;
+                goto CLEANUP;
+            }
+            for (j = 0; j < n; j++) {
+                order[start[hierarchy->groupOf[cats[j]]]++] = j;
+            }
+            regroup(table, i, order, scratch);
+        }
+        for (j = 0; j < k; j++) {
+            count[seen[j]] = 0;
+        }
+    }
+    hierarchy->offsets[hashes] = entries;
+    if ((hierarchy->entries = malloc((entries ? entries : 1) * sizeof(myHierarchyEntry_t))) == NULL) goto CLEANUP;
+
+    for (i = 0; i < hashes; i++) {
+        n = users(table, i, cats, scored ? scores : NULL);
+        entry = &hierarchy->entries[hierarchy->offsets[i]] - 1;
+        for (j = 0; j < n; j++) {
+            if (j == 0 || hierarchy->groupOf[cats[j]] != entry->group || entry->used == UINT16_MAX) {
+                entry++;
+                entry->group = hierarchy->groupOf[cats[j]];
+                entry->used = 0;
+                entry->score = -FLT_MAX;
+            }
+            entry->used++;
+            if (scored && scores[j] > entry->score) entry->score = scores[j];
+        }
+    }
+
+    ret = 0;
+
+CLEANUP:
+    if (ret == -2) ci_debug_printf(1, "buildHierarchy: unable to allocate memory, classification stays flat\n");
+    if (ret != 0) freeHierarchy(hierarchy);
+    free(cats);
+    free(scores);
+    free(order);
+    free(scratch);
+    free(count);
+    free(seen);
+    free(start);
+    return ret;
+}
+
+void freeHierarchy(myHierarchy_t *hierarchy)
+{
+    free(hierarchy->groupOf);
+    free(hierarchy->offsets);
+    free(hierarchy->entries);
+    hierarchy->groupOf = NULL;
+    hierarchy->offsets = NULL;
+    hierarchy->entries = NULL;
+    hierarchy->categories = 0;
+    hierarchy->groups = 0;
+}
+
+// Set active for the keep groups with the highest scores, clear it for the rest. Only groups
+// with a category set in allowed are picked, unless allowed is NULL.
+void hierarchyTopGroups(const myHierarchy_t *hierarchy, const double *scores, int keep, const uint8_t *allowed, uint8_t *active)
+{
+    uint16_t g, best, groups = hierarchy->groups;
+    uint32_t i;
+
+    // 0 is a group that may not be picked, 1 one that may and 2 one that was
+    memset(active, allowed ? 0 : 1, groups);
+    if (allowed) {
+        for (i = 0; i < hierarchy->categories; i++) {
+            if (allowed[i]) active[hierarchy->groupOf[i]] = 1;
+        }
+    }
+    while (keep-- > 0) {
+        best = groups;
+        for (g = 0; g < groups; g++) {
+            if (active[g] == 1 && (best == groups || scores[g] > scores[best])) best = g;
+        }
+        if (best == groups) break;
+        active[best] = 2;
+    }
+    for (g = 0; g < groups; g++) {
+        active[g] = active[g] == 2;
+    }
+}
+
+// Does subset, a comma separated list, name this category? Each entry names a category and the
+// categories under it, so news is news, news.sports and so on. An entry ending in * names every
+// category starting with the rest of it, and a lone * names them all.
+int categoryInSubset(const char *subset, const char *name)
+{
+    size_t length;
+
+    while (*subset != '\0') {
+        length = strcspn(subset, ",");
+        if (length && subset[length - 1] == '*') {
+            if (strncmp(subset, name, length - 1) == 0) return 1;
+        } else if (length && strncmp(subset, name, length) == 0 && (name[length] == '\0' || name[length] == '.')) return 1;
+        subset += length;
+        if (*subset == ',') subset++;
+    }
+    return 0;
+}
+
+// Is secondary named by the secondary regex of a TextPrimarySecondary whose primary regex
+// names primary, or the other way around for a bidirectional one?
+int secondaryMatch(const char *primary, const char *secondary)
+{
+    for (int i = 0; i < number_secondaries; i++) {
+        if (tre_regexec(&secondary_compares[i].primary_regex, primary, 0, NULL, 0) != REG_NOMATCH && tre_regexec(&secondary_compares[i].secondary_regex, secondary, 0, NULL, 0) != REG_NOMATCH) return 1;
+        if (secondary_compares[i].bidirectional == 1 && tre_regexec(&secondary_compares[i].primary_regex, secondary, 0, NULL, 0) != REG_NOMATCH && tre_regexec(&secondary_compares[i].secondary_regex, primary, 0, NULL, 0) != REG_NOMATCH) return 1;
+    }
+    return 0;
+}
+
+// Resolve the TextPrimarySecondary regexes against the category names, so classifying only
+// tests bits (see isSecondary). Each regex runs once per category, not once per pair. Returns 0,
+// or -2 if there is no memory for it, in which case bits is NULL and secondaryMatch must be used.
+int buildSecondaries(mySecondaries_t *secondaries, const char * const *names, uint16_t categories)
+{
+    uint8_t *primaries, *seconds;
+    uint32_t bit;
+    uint16_t p, s;
+    int i;
+
+    freeSecondaries(secondaries);
+    secondaries->categories = categories;
+    if (number_secondaries == 0 || categories == 0) return 0;
+    if (categories > SECONDARIES_CATEGORIES_MAX) {
+        ci_debug_printf(3, "buildSecondaries: too many categories, secondaries are matched for each document\n");
+        return 0;
+    }
+    secondaries->bits = calloc(((uint32_t) categories * categories + 7) / 8, 1);
+    primaries = malloc(categories);
+    seconds = malloc(categories);
+    if (secondaries->bits == NULL || primaries == NULL || seconds == NULL) {
+        ci_debug_printf(1, "buildSecondaries: unable to allocate memory, secondaries are matched for each document\n");
+        freeSecondaries(secondaries);
+        free(primaries);
+        free(seconds);
+        return -2;
+    }
+    for (i = 0; i < number_secondaries; i++) {
+        for (p = 0; p < categories; p++) {
+            primaries[p] = tre_regexec(&secondary_compares[i].primary_regex, names[p], 0, NULL, 0) != REG_NOMATCH;
+            seconds[p] = tre_regexec(&secondary_compares[i].secondary_regex, names[p], 0, NULL, 0) != REG_NOMATCH;
+        }
+        for (p = 0; p < categories; p++) {
+            for (s = 0; s < categories; s++) {
+                if ((primaries[p] && seconds[s]) || (secondary_compares[i].bidirectional == 1 && primaries[s] && seconds[p])) {
+                    bit = (uint32_t) p * categories + s;
+                    secondaries->bits[bit >> 3] |= 1 << (bit & 7);
+                }
+            }
+        }
+    }
+    free(primaries);
+    free(seconds);
+    return 0;
+}
+
+void freeSecondaries(mySecondaries_t *secondaries)
+{
+    free(secondaries->bits);
+    secondaries->bits = NULL;
+    secondaries->categories = 0;
+}
+
+// The kernel level to use: the best the CPU has, no better than kernel_level
+int kernelLevel(void)
+{
+    int level = KERNEL_SCALAR;
+
+#ifdef KERNEL_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+        level = KERNEL_AVX2;
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl"))
+            level = KERNEL_AVX512;
+    }
+#endif
+    if (kernel_level != KERNEL_AUTO && kernel_level < level) level = kernel_level;
+    return level;
+}
+
+const char *kernelLevelName(int level)
+{
+    switch (level) {
+    case KERNEL_AUTO:
+        return "auto";
+    case KERNEL_AVX2:
+        return "avx2";
+    case KERNEL_AVX512:
+        return "avx512";
+    default:
+        return "scalar";
+    }
+}
+
+// KERNEL_AUTO, or the level of name, or -2 if there is no such level
+int parseKernelLevel(const char *name)
+{
+    int level;
+
+    for (level = KERNEL_AUTO; level <= KERNEL_AVX512; level++) {
+        if (strcasecmp(name, kernelLevelName(level)) == 0) return level;
+    }
+    return -2;
+}
+
+// Scan for delimiter as while (data[from] != delimiter && end > from) from++; does: the first
+// offset from from up to end holding it, end if there is none, or from once it is past end.
+static regoff_t findDelimiterScalar(const wchar_t *data, regoff_t from, regoff_t end, wchar_t delimiter)
+{
+    while (data[from] != delimiter && end > from) from++;
+    return from;
+}
+
+#if defined(KERNEL_DISPATCH) && SIZEOFWCHAR == 4
+static KERNEL_TARGET_AVX2 regoff_t findDelimiterAVX2(const wchar_t *data, regoff_t from, regoff_t end, wchar_t delimiter)
+{
+    const __m256i match = _mm256_set1_epi32(delimiter);
+    uint32_t found;
+
+    for (; end - from >= 8; from += 8) {
+        found = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (data + from)), match)));
+        if (found) return from + __builtin_ctz(found);
+    }
+    while (end > from && data[from] != delimiter) from++;
+    return from;
+}
+
+static KERNEL_TARGET_AVX512 regoff_t findDelimiterAVX512(const wchar_t *data, regoff_t from, regoff_t end, wchar_t delimiter)
+{
+    const __m512i match = _mm512_set1_epi32(delimiter);
+    __mmask16 lanes, found;
+
+    if (from >= end) return from;
+    for (; end > from; from += 16) {
+        // Lanes past end are neither read nor compared
+        lanes = end - from >= 16 ? 0xFFFF : (1 << (end - from)) - 1;
+        found = _mm512_mask_cmpeq_epi32_mask(lanes, _mm512_maskz_loadu_epi32(lanes, data + from), match);
+        if (found) return from + __builtin_ctz(found);
+    }
+    return end;
+}
+#endif
+
+static regoff_t (*findDelimiter)(const wchar_t *data, regoff_t from, regoff_t end, wchar_t delimiter) = findDelimiterScalar;
+
+void selectHTMLKernels(void)
+{
+    int level = kernelLevel();
+
+    findDelimiter = findDelimiterScalar;
+#if defined(KERNEL_DISPATCH) && SIZEOFWCHAR == 4
+    if (level >= KERNEL_AVX512) findDelimiter = findDelimiterAVX512;
+    else if (level >= KERNEL_AVX2) findDelimiter = findDelimiterAVX2;
+#endif
+#ifndef HASH_USE_PATRICIA
+    HTMLSortKernel = level;
+#endif
+}
+
 void initHTML(void)
 {
     qsort(htmlentities, sizeof(htmlentities) / sizeof(htmlentities[0]) - 1, sizeof(_htmlentity), &entity_compare);
+    selectHTMLKernels();
     compileRegexes();
     u_init(&UError);
 }
@@ -548,14 +1018,14 @@ void removeHTML(regexHead *myHead)
     while (current != NULL) { // kill scripts, styles -- each used to be a block identical to this with their own regex and a slightly different printf statement
         myData = (wchar_t *)(current->data == NULL ? myHead->main_memory : current->data);
         currentOffset = current->rm_so;
-        while (myData[currentOffset] != L'<' && current->rm_eo > currentOffset) currentOffset++;
+        currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'<');
         while (current->rm_eo > currentOffset && tre_regwnexec(&superFinder, myData + currentOffset, current->rm_eo - currentOffset, 1, singleMatch, 0) != REG_NOMATCH) {
             singleMatch[0].rm_so += currentOffset;
             singleMatch[0].rm_eo += currentOffset;
 //          ci_debug_printf(10, "Killing Script/Style Tag: %.*ls\n", singleMatch[0].rm_eo-singleMatch[0].rm_so, myData+singleMatch[0].rm_so);
             regexRemove(myHead, current, &singleMatch[0]);
             currentOffset = singleMatch[0].rm_eo;
-            while (myData[currentOffset] != L'<' && current->rm_eo > currentOffset) currentOffset++;
+            currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'<');
         }
         current=current->next;
     }
@@ -564,14 +1034,14 @@ void removeHTML(regexHead *myHead)
     while (current != NULL) { // kill comments
         myData = (wchar_t *)(current->data == NULL ? myHead->main_memory : current->data);
         currentOffset = current->rm_so;
-        while (myData[currentOffset] != L'<' && current->rm_eo > currentOffset) currentOffset++;
+        currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'<');
         while (current->rm_eo > currentOffset && tre_regwnexec(&commentFinder, myData + currentOffset, current->rm_eo - currentOffset, 1, singleMatch, 0) != REG_NOMATCH) {
             singleMatch[0].rm_so += currentOffset;
             singleMatch[0].rm_eo += currentOffset;
 //          ci_debug_printf(10, "Killing Comment Tag: %.*ls\n", singleMatch[0].rm_eo-singleMatch[0].rm_so, myData+singleMatch[0].rm_so);
             regexRemove(myHead, current, &singleMatch[0]);
             currentOffset = singleMatch[0].rm_eo;
-            while (myData[currentOffset] != L'<' && current->rm_eo > currentOffset) currentOffset++;
+            currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'<');
         }
         current = current->next;
     }
@@ -580,7 +1050,7 @@ void removeHTML(regexHead *myHead)
     while (current != NULL) { // kill metas
         myData = (wchar_t *)(current->data==NULL ? myHead->main_memory : current->data);
         currentOffset = current->rm_so;
-        while (myData[currentOffset] != L'<' && current->rm_eo > currentOffset) currentOffset++;
+        currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'<');
         while (current->rm_eo > currentOffset && tre_regwnexec(&metaFinder, myData + currentOffset, current->rm_eo - currentOffset, 2, singleMatch, 0) != REG_NOMATCH) {
             singleMatch[0].rm_so += currentOffset;
             singleMatch[0].rm_eo += currentOffset;
@@ -620,7 +1090,7 @@ void removeHTML(regexHead *myHead)
                 regexRemove(myHead, current, &singleMatch[0]);
             }
             currentOffset=singleMatch[0].rm_eo;
-            while (myData[currentOffset] != L'<' && current->rm_eo > currentOffset) currentOffset++;
+            currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'<');
         }
         current = current->next;
     }
@@ -629,7 +1099,7 @@ void removeHTML(regexHead *myHead)
     while (current != NULL) { // kill images (save alt and title tags)
         myData = (wchar_t *)(current->data == NULL ? myHead->main_memory : current->data);
         currentOffset = current->rm_so;
-        while (myData[currentOffset] != L'<' && current->rm_eo > currentOffset) currentOffset++;
+        currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'<');
         while (current->rm_eo > currentOffset && tre_regwnexec(&imageFinder, myData + currentOffset, current->rm_eo - currentOffset, 2, singleMatch, 0) != REG_NOMATCH) {
             singleMatch[0].rm_so += currentOffset;
             singleMatch[0].rm_eo += currentOffset;
@@ -665,7 +1135,7 @@ void removeHTML(regexHead *myHead)
 //          ci_debug_printf(10, "Image Data: %.*ls\n", singleMatch[1].rm_eo - singleMatch[1].rm_so, myData + singleMatch[1].rm_so);
             regexRemove(myHead, current, &singleMatch[0]);
             currentOffset = singleMatch[0].rm_eo;
-            while (myData[currentOffset] != L'<' && current->rm_eo > currentOffset) currentOffset++;
+            currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'<');
         }
         current=current->next;
     }
@@ -676,7 +1146,7 @@ void removeHTML(regexHead *myHead)
     while (current != NULL) { // kill all unused tags (save titles)
         myData = (wchar_t *)(current->data == NULL ? myHead->main_memory : current->data);
         currentOffset = current->rm_so;
-        while (myData[currentOffset] != L'<' && current->rm_eo > currentOffset) currentOffset++;
+        currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'<');
         while (current->rm_eo > currentOffset && tre_regwnexec(&htmlFinder, myData + currentOffset, current->rm_eo-currentOffset, 11, singleMatch, 0) != REG_NOMATCH) {
             singleMatch[0].rm_so += currentOffset;
             singleMatch[0].rm_eo += currentOffset;
@@ -717,7 +1187,7 @@ void removeHTML(regexHead *myHead)
             }
 //          else regexRemove(myHead, current, &singleMatch[0]);
             currentOffset = singleMatch[0].rm_eo;
-            while (myData[currentOffset] != L'<' && current->rm_eo > currentOffset) currentOffset++;
+            currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'<');
         }
         if (shortcut.rm_eo) {
             if (has_spaces) {
@@ -736,7 +1206,7 @@ void removeHTML(regexHead *myHead)
     while (current != NULL) { // HTML Entity removals -- MUST BE LAST
         myData=(wchar_t *)(current->data == NULL ? myHead->main_memory : current->data);
         currentOffset=current->rm_so;
-        while (myData[currentOffset] != L'&' && current->rm_eo > currentOffset) currentOffset++;
+        currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'&');
         while (current->rm_eo > currentOffset && tre_regwnexec(&entityFinder, myData + currentOffset, current->rm_eo - currentOffset, 2, singleMatch, 0) != REG_NOMATCH) {
             singleMatch[0].rm_so += currentOffset;
             singleMatch[0].rm_eo += currentOffset;
@@ -795,7 +1265,7 @@ void removeHTML(regexHead *myHead)
                 ci_debug_printf(3, "Found Unhandled HTML Entity: %.*ls\n", singleMatch[1].rm_eo - singleMatch[1].rm_so, myData+singleMatch[1].rm_so);
                 currentOffset++;
             }
-            while (myData[currentOffset] != L'&' && current->rm_eo > currentOffset) currentOffset++;
+            currentOffset = findDelimiter(myData, currentOffset, current->rm_eo, L'&');
         }
         current=current->next;
     }
@@ -831,6 +1301,54 @@ void removeHTML(regexHead *myHead)
     }
 }
 
+// How many characters guessScript looks at, spread evenly over the text
+#define SCRIPT_SAMPLE_CHARS 4096
+// Script codes guessScript counts, ICU has fewer than this
+#define SCRIPT_CODES 256
+
+// ISO 15924 code of the script most of the letters of myHead are written in, or NULL if it has
+// none. Han with kana counts as Japanese (Jpan) and Han with Hangul as Korean (Kore), or both
+// would go to whatever takes Chinese. myHead must be a single block, see regexMakeSingleBlock.
+const char *guessScript(regexHead *myHead)
+{
+    myRegmatch_t *current = myHead->head;
+    wchar_t *myData;
+    uint32_t counts[SCRIPT_CODES] = { 0 };
+    uint32_t letters = 0;
+    regoff_t offset, step;
+    UErrorCode status = U_ZERO_ERROR;
+    UScriptCode script, best = USCRIPT_COMMON;
+
+    if (current == NULL || current->rm_eo <= current->rm_so) return NULL;
+    myData = (wchar_t *)(current->data == NULL ? myHead->main_memory : current->data);
+    step = (current->rm_eo - current->rm_so) / SCRIPT_SAMPLE_CHARS + 1;
+
+    for (offset = current->rm_so; offset < current->rm_eo; offset += step) {
+        if (!u_isalpha(myData[offset])) continue;
+        script = uscript_getScript(myData[offset], &status);
+        if (U_FAILURE(status)) {
+            status = U_ZERO_ERROR;
+            continue;
+        }
+        if (script <= USCRIPT_INHERITED || script >= SCRIPT_CODES) continue; // Common and Inherited say nothing
+        counts[script]++;
+        letters++;
+    }
+    if (letters == 0) return NULL;
+
+    if (counts[USCRIPT_HIRAGANA] || counts[USCRIPT_KATAKANA]) {
+        counts[USCRIPT_JAPANESE] += counts[USCRIPT_HIRAGANA] + counts[USCRIPT_KATAKANA] + counts[USCRIPT_HAN];
+        counts[USCRIPT_HIRAGANA] = counts[USCRIPT_KATAKANA] = counts[USCRIPT_HAN] = 0;
+    } else if (counts[USCRIPT_HANGUL]) {
+        counts[USCRIPT_KOREAN] += counts[USCRIPT_HANGUL] + counts[USCRIPT_HAN];
+        counts[USCRIPT_HANGUL] = counts[USCRIPT_HAN] = 0;
+    }
+    for (script = 0; script < SCRIPT_CODES; script++) {
+        if (counts[script] > counts[best]) best = script;
+    }
+    return uscript_getShortName(best);
+}
+
 static inline uint32_t u16Otou32O(int ubp_only, UChar *string, uint32_t u16_offset)
 {
     if (ubp_only) return u16_offset;
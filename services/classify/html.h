@@ -34,11 +34,69 @@ enum {UNKNOWN_ERROR=-9999, NO_CATEGORIES=-1, NO_MEMORY=-2, DOCUMENT_TOO_SMALL=-3
 
 enum {CJK_NONE = 0, KATAKANA, HIRAGANA, CJK_BREAK=999};
 
+// Prefix index of a sorted key table: the keys whose top bits bits are p are
+// keys[start[p]] through keys[start[p + 1] - 1]. start has (1 << bits) + 1 entries.
 typedef struct _myRadix_t {
-    int64_t start;
-    int64_t stop;
+    uint32_t *start;
+    int bits;
 } myRadix_t;
 
+#define RADIX_BITS_MIN 8
+#define RADIX_BITS_MAX 24
+#define RADIX_BITS_AUTO_MAX 20 // Largest index radix_bits 0 picks, 4 MB
+
+// Blocked Bloom filter of a key table. Each key sets BLOOM_PROBES bits of one cache line
+// sized block, so a lookup that is not in the table is usually turned away after one read.
+typedef struct _myBloom_t {
+    uint64_t *blocks; // BLOOM_BLOCK_WORDS words per block
+    int shift; // 64 - log2(number of blocks)
+} myBloom_t;
+
+#define BLOOM_BLOCK_WORDS 8 // 512 bits
+#define BLOOM_PROBES 6
+#define BLOOM_BITS_PER_KEY 12 // About 2% false positives
+#define BLOOM_BLOCK_MIX 0x9E3779B97F4A7C15ULL
+#define BLOOM_PROBE_MIX 0xC2B2AE3D27D4EB4FULL
+
+// Top level groups of dotted category names (adult.affairs and adult.porn are in group adult,
+// a name without a dot is a group of its own) for two stage classification: score the groups,
+// then only the categories of the best hierarchy_groups of them. The users of each hash of a
+// judge table are kept together by group, and entries[offsets[i]] through
+// entries[offsets[i + 1] - 1] give the groups of hash i in the order its users are in. A group
+// with more than UINT16_MAX users of a hash takes as many entries one after the other as it needs.
+typedef struct _myHierarchyEntry_t {
+    uint16_t group;
+    uint16_t used; // Number of the hash's users in group
+    float score; // Best score of those users, if the table has scores
+} myHierarchyEntry_t;
+
+typedef struct _myHierarchy_t {
+    uint16_t *groupOf; // Group of each category
+    uint16_t categories;
+    uint16_t groups;
+    uint32_t *offsets;
+    myHierarchyEntry_t *entries;
+} myHierarchy_t;
+
+#define HIERARCHY_USER_MAX 8 // Largest user of a judge table buildHierarchy may have to move
+#define HIERARCHY_PREFETCH 8 // How many hashes ahead the second stage prefetches
+
+// Fill categories (and scores, if not NULL) with the users of hash of table, returning how many
+typedef uint32_t (*hierarchyUsers_t)(const void *table, uint32_t hash, uint16_t *categories, float *scores);
+// Put the users of hash of table in the order given by order, order[k] being the position of
+// the user to put at k. scratch holds HIERARCHY_USER_MAX bytes for each user.
+typedef void (*hierarchyRegroup_t)(void *table, uint32_t hash, const uint32_t *order, void *scratch);
+
+// The TextPrimarySecondary regexes resolved against the loaded categories: bit
+// primary * categories + secondary of bits is set if secondary may be reported with primary.
+// bits is NULL if there are no secondaries or no memory for them.
+typedef struct _mySecondaries_t {
+    uint8_t *bits;
+    uint16_t categories;
+} mySecondaries_t;
+
+#define SECONDARIES_CATEGORIES_MAX 8192 // 8 MB of bits, more categories are matched with the regexes
+
 typedef struct _myRegmatch_t {
     regoff_t rm_so;
     regoff_t rm_eo;
@@ -86,11 +144,32 @@ typedef struct {
     int bidirectional;
 } secondaries_t;
 
+#define LOAD_PARTITIONS_MAX 256
+
 #ifdef IN_HTML
+int loadThreadCount(void);
+HTMLFeature loadPartitionStart(int partition, int partitions);
+void runLoadWorkers(void *(*worker)(void *), void *args, size_t argSize, int count);
+int buildRadixIndex(myRadix_t *radix, const void *keys, size_t stride, uint32_t used);
+void freeRadixIndex(myRadix_t *radix);
+int buildBloomFilter(myBloom_t *bloom, const void *keys, size_t stride, uint32_t used);
+void freeBloomFilter(myBloom_t *bloom);
+int buildHierarchy(myHierarchy_t *hierarchy, const char * const *names, uint16_t categories, void *table, uint32_t hashes, uint32_t maxUsers, hierarchyUsers_t users, hierarchyRegroup_t regroup, int scored);
+void freeHierarchy(myHierarchy_t *hierarchy);
+void hierarchyTopGroups(const myHierarchy_t *hierarchy, const double *scores, int keep, const uint8_t *allowed, uint8_t *active);
+int secondaryMatch(const char *primary, const char *secondary);
+int buildSecondaries(mySecondaries_t *secondaries, const char * const *names, uint16_t categories);
+void freeSecondaries(mySecondaries_t *secondaries);
+int categoryInSubset(const char *subset, const char *name);
+int kernelLevel(void);
+const char *kernelLevelName(int level);
+int parseKernelLevel(const char *name);
+void selectHTMLKernels(void);
 void normalizeCurrency(regexHead *myHead);
 void removeHTML(regexHead *myHead);
 void mkRegexHead(regexHead *head, wchar_t *myData, int is_cicap_membuf);
 void regexMakeSingleBlock(regexHead *myHead);
+const char *guessScript(regexHead *myHead);
 void freeRegexHead(regexHead *myHead);
 static void compileRegexes(void);
 static void freeRegexes(void);
@@ -122,6 +201,7 @@ extern void normalizeCurrency(regexHead *myHead);
 extern void removeHTML(regexHead *myHead);
 extern void mkRegexHead(regexHead *head, wchar_t *myData, int is_cicap_membuf);
 extern void regexMakeSingleBlock(regexHead *myHead);
+extern const char *guessScript(regexHead *myHead);
 extern void freeRegexHead(regexHead *myHead);
 extern regex_t headFinder, charsetFinder;
 extern void initHTML(void);
@@ -132,8 +212,60 @@ extern void makeSortedUniqueHashes(HashList *hashes_list);
 
 extern secondaries_t *secondary_compares;
 extern int number_secondaries;
+extern int load_threads;
+extern int loadThreadCount(void);
+extern HTMLFeature loadPartitionStart(int partition, int partitions);
+extern void runLoadWorkers(void *(*worker)(void *), void *args, size_t argSize, int count);
+extern int radix_bits;
+extern int buildRadixIndex(myRadix_t *radix, const void *keys, size_t stride, uint32_t used);
+extern void freeRadixIndex(myRadix_t *radix);
+extern int buildBloomFilter(myBloom_t *bloom, const void *keys, size_t stride, uint32_t used);
+extern void freeBloomFilter(myBloom_t *bloom);
+extern int hierarchy_groups;
+extern int buildHierarchy(myHierarchy_t *hierarchy, const char * const *names, uint16_t categories, void *table, uint32_t hashes, uint32_t maxUsers, hierarchyUsers_t users, hierarchyRegroup_t regroup, int scored);
+extern void freeHierarchy(myHierarchy_t *hierarchy);
+extern void hierarchyTopGroups(const myHierarchy_t *hierarchy, const double *scores, int keep, const uint8_t *allowed, uint8_t *active);
+extern int secondaryMatch(const char *primary, const char *secondary);
+extern int buildSecondaries(mySecondaries_t *secondaries, const char * const *names, uint16_t categories);
+extern void freeSecondaries(mySecondaries_t *secondaries);
+extern int categoryInSubset(const char *subset, const char *name);
+extern int kernel_level;
+extern int kernelLevel(void);
+extern const char *kernelLevelName(int level);
+extern int parseKernelLevel(const char *name);
+extern void selectHTMLKernels(void);
 #endif
 
+// Narrow the search for key to its radix bucket, *start through *end
+static inline void radixRange(const myRadix_t *radix, HTMLFeature key, int32_t *start, int32_t *end)
+{
+    uint32_t p = key >> (64 - radix->bits);
+    *start = radix->start[p];
+    *end = (int32_t) radix->start[p + 1] - 1;
+}
+
+// 0 if key is certainly not in the table bloom was built from
+static inline int bloomMayContain(const myBloom_t *bloom, HTMLFeature key)
+{
+    const uint64_t *block = bloom->blocks + ((key * BLOOM_BLOCK_MIX) >> bloom->shift) * BLOOM_BLOCK_WORDS;
+    uint64_t probe = key * BLOOM_PROBE_MIX;
+    int i;
+
+    for (i = 0; i < BLOOM_PROBES; i++) {
+        if (!((block[probe & 7] >> ((probe >> 3) & 63)) & 1)) return 0;
+        probe >>= 9;
+    }
+    return 1;
+}
+
+// May category secondary be reported as the secondary of primary? secondaries must have bits.
+static inline int isSecondary(const mySecondaries_t *secondaries, uint32_t primary, uint32_t secondary)
+{
+    uint32_t bit = primary * secondaries->categories + secondary;
+
+    return (secondaries->bits[bit >> 3] >> (bit & 7)) & 1;
+}
+
 extern void makeSortedUniqueHashes(HashList *hashes_list);
 
 
@@ -165,6 +297,22 @@ extern void (*__log_error)(void *req, const char *format,... );
 #endif
 #endif
 
+// Hot kernels have a scalar version and, where it pays, versions for newer x86-64 CPUs. The
+// best one the CPU has is picked when each classifier is initialized. kernel_level caps it,
+// so any of them, the scalar one included, can be forced for testing.
+#define KERNEL_AUTO -1
+#define KERNEL_SCALAR 0
+#define KERNEL_AVX2 1
+#define KERNEL_AVX512 2
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(NO_KERNEL_DISPATCH)
+#define KERNEL_DISPATCH
+#include <immintrin.h>
+// Whatever the module is built for. No multiply-add contraction, so they round as the scalar code does.
+#define KERNEL_TARGET_AVX2 __attribute__((target("avx2,bmi2"), optimize("fp-contract=off")))
+#define KERNEL_TARGET_AVX512 __attribute__((target("avx2,bmi2,avx512f,avx512bw,avx512dq,avx512vl"), optimize("fp-contract=off")))
+#endif
+
 // The following is ONLY to be used for allocating buffers for character
 // conversion to wchar_t whether or not wchar_t is UTF-16 or UTF-32 we need to
 // allocate 4 bytes per input character just in case.
@@ -213,6 +361,20 @@ typedef int CMPFUNC (const void *a, const void *b);
 #include "quadsort.c"
 #include "fluxsort.c"
 
+#ifdef KERNEL_DISPATCH
+// The same sort for AVX2 with the comparison inlined, picked by selectHTMLKernels
+#undef FUNC
+#define FUNC(NAME) NAME##HTMLFeatureKey
+#define cmp(a, b) (*(a) > *(b))
+#pragma GCC push_options
+#pragma GCC target("avx2,bmi2")
+#include "quadsort.c"
+#include "fluxsort.c"
+#pragma GCC pop_options
+#undef cmp
+#endif
+static int HTMLSortKernel = KERNEL_SCALAR;
+
 static void HTML_fluxsort(void *array, size_t nmemb, size_t size, CMPFUNC *cmp)
 {
 	if (nmemb < 2)
@@ -220,6 +382,9 @@ static void HTML_fluxsort(void *array, size_t nmemb, size_t size, CMPFUNC *cmp)
 		return;
 	}
 
+#ifdef KERNEL_DISPATCH
+	if (HTMLSortKernel >= KERNEL_AVX2) return fluxsortHTMLFeatureKey(array, nmemb, cmp);
+#endif
 	return fluxsortHTMLFeature(array, nmemb, cmp);
 }
 #endif
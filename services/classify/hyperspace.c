@@ -49,6 +49,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #ifdef _POSIX_MAPPED_FILES
 #include <sys/mman.h>
 #endif
@@ -61,15 +62,148 @@
 
 FHSTextCategoryExt HSCategories;
 HashListExt HSJudgeHashList;
+FHSModel HSModel = { .categories = &HSCategories, .hashes = &HSJudgeHashList };
+
+// computeOSBHashes gives us sorted unique hashes. With this defined, classification walks
+// the judge table alongside the document with a galloping search instead of doing a full
+// binary search per hash. Comment it out to go back to HSBinarySearch.
+#define CLASSIFYWITHMERGE
+
+// Narrow searches of the judge table to the key's bucket of a prefix index, as bayes.c does.
+// Comment it out to search the whole table.
+#define CLASSIFYWITHRADIX
+// Turn most document hashes that are not in the judge table away with a Bloom filter before
+// searching for them, as bayes.c does.
+#define CLASSIFYWITHBLOOM
+
+// Per thread scratch space for counting the documents an unknown shares hashes with. counts
+// is by global document number and touched has a bit for each document counted into, both are
+// all zero between classifications. Only the touched documents are scored, and only they are
+// reset afterwards, see HSScratchRadiance and HSScratchReset.
+typedef struct {
+    uint32_t *counts;
+    uint64_t *touched;
+    uint32_t documents; // Room in counts and touched
+    uint32_t *intersections; // The touched documents of one category, in order, for HSRadiance
+    uint32_t *known;
+    uint32_t largest; // Room in intersections and known
+} HSScratch;
+
+static pthread_key_t HSScratchKey;
+static pthread_once_t HSScratchOnce = PTHREAD_ONCE_INIT;
+
+static void HSScratchFree(void *data)
+{
+    HSScratch *scratch = data;
+
+    if (scratch == NULL) return;
+    free(scratch->counts);
+    free(scratch->touched);
+    free(scratch->intersections);
+    free(scratch->known);
+    free(scratch);
+}
+
+static void HSScratchKeyCreate(void)
+{
+    pthread_key_create(&HSScratchKey, HSScratchFree);
+}
+
+// The calling thread's scratch space, with room for documents documents in all and largest in
+// one category, or NULL if there is no memory for it
+static HSScratch *HSGetScratch(uint32_t documents, uint32_t largest)
+{
+    HSScratch *scratch;
+
+    pthread_once(&HSScratchOnce, HSScratchKeyCreate);
+    if ((scratch = pthread_getspecific(HSScratchKey)) == NULL) {
+        if ((scratch = calloc(1, sizeof(HSScratch))) == NULL) return NULL;
+        pthread_setspecific(HSScratchKey, scratch);
+    }
+    if (scratch->documents < documents || scratch->counts == NULL) {
+        free(scratch->counts);
+        free(scratch->touched);
+        scratch->counts = calloc(documents ? documents : 1, sizeof(uint32_t));
+        scratch->touched = calloc((documents + 63) / 64 + 1, sizeof(uint64_t));
+        scratch->documents = documents;
+        if (scratch->counts == NULL || scratch->touched == NULL) {
+            free(scratch->counts);
+            free(scratch->touched);
+            scratch->counts = NULL;
+            scratch->touched = NULL;
+            scratch->documents = 0;
+            return NULL;
+        }
+    }
+    if (scratch->largest < largest || scratch->intersections == NULL) {
+        free(scratch->intersections);
+        free(scratch->known);
+        scratch->intersections = malloc((largest ? largest : 1) * sizeof(uint32_t));
+        scratch->known = malloc((largest ? largest : 1) * sizeof(uint32_t));
+        scratch->largest = largest;
+        if (scratch->intersections == NULL || scratch->known == NULL) {
+            free(scratch->intersections);
+            free(scratch->known);
+            scratch->intersections = NULL;
+            scratch->known = NULL;
+            scratch->largest = 0;
+            return NULL;
+        }
+    }
+    return scratch;
+}
+
+// Count one more hash shared with document
+static inline void HSTouch(HSScratch *scratch, uint32_t document)
+{
+    scratch->counts[document]++;
+    scratch->touched[document >> 6] |= (uint64_t) 1 << (document & 63);
+}
+
+// Zero what the last classification counted, the first documents documents
+static void HSScratchReset(HSScratch *scratch, uint32_t documents)
+{
+    uint64_t bits;
+    uint32_t word;
+
+    for (word = 0; word < (documents + 63) / 64; word++) {
+        for (bits = scratch->touched[word]; bits; bits &= bits - 1) {
+            scratch->counts[word * 64 + __builtin_ctzll(bits)] = 0;
+        }
+        scratch->touched[word] = 0;
+    }
+}
 
 void initHyperSpaceClassifier(void)
 {
     HSJudgeHashList.slots = 0;
     HSJudgeHashList.hashes = NULL;
     HSJudgeHashList.used = 0;
+    HSJudgeHashList.eytzinger = NULL;
+    HSJudgeHashList.eytzingerRank = NULL;
+    HSJudgeHashList.packed = NULL;
+    HSJudgeHashList.keys = NULL;
+    HSJudgeHashList.offsets = NULL;
+    HSJudgeHashList.pool = NULL;
+    HSJudgeHashList.image = NULL;
+    HSJudgeHashList.imageSize = 0;
+    HSJudgeHashList.radix.start = NULL;
+    HSJudgeHashList.radix.bits = 0;
+    HSJudgeHashList.bloom.blocks = NULL;
+    HSJudgeHashList.bloom.shift = 0;
+    HSJudgeHashList.hierarchy.groupOf = NULL;
+    HSJudgeHashList.hierarchy.offsets = NULL;
+    HSJudgeHashList.hierarchy.entries = NULL;
+    HSJudgeHashList.hierarchy.categories = 0;
+    HSJudgeHashList.hierarchy.groups = 0;
     HSCategories.slots = HYPERSPACE_CATEGORY_INC;
     HSCategories.categories = calloc(HSCategories.slots, sizeof(FHSTextCategory));
     HSCategories.used = 0;
+    HSCategories.documents = 0;
+    HSCategories.largest = 0;
+    HSCategories.secondaries.bits = NULL;
+    HSCategories.secondaries.categories = 0;
+    selectHSKernels();
 }
 
 void deinitHyperSpaceClassifier(void)
@@ -77,35 +211,352 @@ void deinitHyperSpaceClassifier(void)
     uint32_t i=0;
     for (i=0; i < HSCategories.used; i++) {
         free(HSCategories.categories[i].name);
-        free(HSCategories.categories[i].documentKnownHashes);
+        // Image document counts live in the mapping
+        if (HSJudgeHashList.image == NULL) free(HSCategories.categories[i].documentKnownHashes);
     }
     if (HSCategories.used) free(HSCategories.categories);
+    freeSecondaries(&HSCategories.secondaries);
 
-    for (i=0; i < HSJudgeHashList.used; i++) {
-        free(HSJudgeHashList.hashes[i].users);
+    if (HSJudgeHashList.image) {
+#ifdef _POSIX_MAPPED_FILES
+        munmap(HSJudgeHashList.image, HSJudgeHashList.imageSize);
+#endif
+        HSJudgeHashList.image = NULL;
+        HSJudgeHashList.imageSize = 0;
+        HSJudgeHashList.keys = NULL;
+        HSJudgeHashList.offsets = NULL;
+        HSJudgeHashList.pool = NULL;
+    } else {
+        // Packed users all live in the one block
+        for (i=0; i < HSJudgeHashList.used && HSJudgeHashList.packed == NULL; i++) {
+            free(HSJudgeHashList.hashes[i].users);
+        }
+        if (HSJudgeHashList.used) free(HSJudgeHashList.hashes);
+        free(HSJudgeHashList.packed);
+        HSJudgeHashList.packed = NULL;
     }
-    if (HSJudgeHashList.used) free(HSJudgeHashList.hashes);
+    free(HSJudgeHashList.eytzinger);
+    free(HSJudgeHashList.eytzingerRank);
+    HSJudgeHashList.eytzinger = NULL;
+    HSJudgeHashList.eytzingerRank = NULL;
+    freeRadixIndex(&HSJudgeHashList.radix);
+    freeBloomFilter(&HSJudgeHashList.bloom);
+    freeHierarchy(&HSJudgeHashList.hierarchy);
+    // Only this thread's, the others go with their threads
+    pthread_once(&HSScratchOnce, HSScratchKeyCreate);
+    HSScratchFree(pthread_getspecific(HSScratchKey));
+    pthread_setspecific(HSScratchKey, NULL);
 }
 
-static int judgeHash_compare(void const *a, void const *b)
+// Hash i of the judge table, whether it was loaded from fhs files or mapped from an image
+static inline HTMLFeature HSKey(const HashListExt *hashes, int32_t i)
 {
-    hyperspaceFeatureExt *ha, *hb;
+    return hashes->keys ? hashes->keys[i] : hashes->hashes[i].hash;
+}
 
-    ha = (hyperspaceFeatureExt *) a;
-    hb = (hyperspaceFeatureExt *) b;
-    if (ha->hash < hb->hash)
-        return -1;
-    if (ha->hash > hb->hash)
-        return 1;
+// Users of hash i of the judge table, whether it was loaded from fhs files or mapped from an image
+static inline FHSHashJudgeUsers *HSUsers(const HashListExt *hashes, int32_t i, uint32_t *used)
+{
+    if (hashes->image) {
+        *used = hashes->offsets[i + 1] - hashes->offsets[i];
+        return &hashes->pool[hashes->offsets[i]];
+    }
+    *used = hashes->hashes[i].used;
+    return hashes->hashes[i].users;
+}
+
+// Give every document of every category its global number, see FHSTextCategory.firstDocument
+static void HSNumberDocuments(void)
+{
+    uint32_t i;
+
+    HSCategories.documents = 0;
+    HSCategories.largest = 0;
+    for (i = 0; i < HSCategories.used; i++) {
+        HSCategories.categories[i].firstDocument = HSCategories.documents;
+        HSCategories.documents += HSCategories.categories[i].totalDocuments;
+        if (HSCategories.categories[i].totalDocuments > HSCategories.largest) HSCategories.largest = HSCategories.categories[i].totalDocuments;
+    }
+}
+
+// Add the next difference packed from packed on to *document, see HSPackPostings, and return
+// where the one after it starts
+static inline const uint8_t *HSNextPacked(const uint8_t *packed, uint32_t *document)
+{
+    uint32_t delta, shift;
+    uint8_t byte = *packed++;
+
+    delta = byte & 0x7F;
+    for (shift = 7; byte & 0x80; shift += 7) {
+        byte = *packed++;
+        delta |= (uint32_t) (byte & 0x7F) << shift;
+    }
+    *document += delta;
+    return packed;
+}
+
+// Count each of the count documents of the run packed from packed on, and return where the
+// next run starts
+static inline const uint8_t *HSCountPacked(HSScratch *scratch, const uint8_t *packed, uint32_t count)
+{
+    uint32_t document = 0;
+
+    while (count--) {
+        packed = HSNextPacked(packed, &document);
+        HSTouch(scratch, document);
+    }
+    return packed;
+}
+
+// Where the run after the count documents packed from packed on starts
+static inline const uint8_t *HSSkipPacked(const uint8_t *packed, uint32_t count)
+{
+    while (count) {
+        if (!(*packed++ & 0x80)) count--;
+    }
+    return packed;
+}
+
+static int HSDocument_compare(void const *a, void const *b)
+{
+    uint32_t da = *(const uint32_t *) a, db = *(const uint32_t *) b;
+    return da < db ? -1 : da > db;
+}
+
+// Replace the users array of every hash with its global document numbers, varint coded as
+// differences from the one before in one shared block. Each hierarchy group is a run of its
+// own, so HSHierarchyCount can still skip the groups it leaves out. This takes a fraction of
+// the memory of the arrays and their allocations. Returns 0, or -2 with the table left as it
+// was if there is no memory for it.
+static int HSPackPostings(HashListExt *hashes)
+{
+    const myHierarchy_t *hierarchy = (hashes->hierarchy.entries && hashes->hierarchy.categories == HSCategories.used) ? &hashes->hierarchy : NULL;
+    const myHierarchyEntry_t *entry, *last;
+    uint64_t *starts = malloc(((uint64_t) hashes->used + 1) * sizeof(uint64_t));
+    uint32_t *documents = NULL, document, previous, run, end, maxUsers = 0;
+    uint8_t *packed = NULL, *temp;
+    uint64_t size = 0, slots = 0;
+    int32_t i;
+    uint32_t j;
+
+    for (i = 0; i < hashes->used; i++) {
+        if (hashes->hashes[i].used > maxUsers) maxUsers = hashes->hashes[i].used;
+    }
+    if (starts == NULL || (documents = malloc((maxUsers ? maxUsers : 1) * sizeof(uint32_t))) == NULL) goto NO_MEMORY;
+
+    for (i = 0; i < hashes->used; i++) {
+        starts[i] = size;
+        if (slots - size < (uint64_t) hashes->hashes[i].used * 5) { // A number takes 5 bytes at most
+            slots = (slots + (uint64_t) hashes->hashes[i].used * 5) * 2;
+            if ((temp = realloc(packed, slots)) == NULL) goto NO_MEMORY;
+            packed = temp;
+        }
+        for (j = 0; j < hashes->hashes[i].used; j++) {
+            documents[j] = HSCategories.categories[hashes->hashes[i].users[j].category].firstDocument + hashes->hashes[i].users[j].document;
+        }
+        entry = hierarchy ? &hierarchy->entries[hierarchy->offsets[i]] : NULL;
+        last = hierarchy ? &hierarchy->entries[hierarchy->offsets[i + 1]] : NULL;
+        for (run = 0; run < hashes->hashes[i].used; run = end) {
+            end = entry < last ? run + (entry++)->used : hashes->hashes[i].used;
+            qsort(&documents[run], end - run, sizeof(uint32_t), &HSDocument_compare);
+            for (j = run, previous = 0; j < end; j++) {
+                for (document = documents[j] - previous; document >= 0x80; document >>= 7) {
+                    packed[size++] = (document & 0x7F) | 0x80;
+                }
+                packed[size++] = document;
+                previous = documents[j];
+            }
+        }
+    }
+    if (size && (temp = realloc(packed, size)) != NULL) packed = temp;
+
+    for (i = 0; i < hashes->used; i++) {
+        free(hashes->hashes[i].users);
+        hashes->hashes[i].packed = packed + starts[i];
+    }
+    hashes->packed = packed;
+    free(starts);
+    free(documents);
+    return 0;
+
+NO_MEMORY:
+    free(starts);
+    free(documents);
+    free(packed);
+    return -2;
+}
+
+// Give every hash its users array back, for loading more into the table
+static void HSUnpackPostings(HashListExt *hashes)
+{
+    const myHierarchy_t *hierarchy = (hashes->hierarchy.entries && hashes->hierarchy.categories == HSCategories.used) ? &hashes->hierarchy : NULL;
+    const myHierarchyEntry_t *entry, *last;
+    const uint8_t *packed;
+    uint32_t document, run, end, j;
+    uint16_t category;
+    int32_t i;
+
+    if (hashes->packed == NULL) return;
+    for (i = 0; i < hashes->used; i++) {
+        packed = hashes->hashes[i].packed;
+        hashes->hashes[i].users = NULL;
+        if (hashes->hashes[i].used == 0) continue; // Only preloaded
+        if ((hashes->hashes[i].users = malloc(hashes->hashes[i].used * sizeof(FHSHashJudgeUsers))) == NULL) {
+            ci_debug_printf(1, "Unable to allocate memory to unpack the FHS hash users. Dying.\n");
+            exit(-1);
+        }
+        entry = hierarchy ? &hierarchy->entries[hierarchy->offsets[i]] : NULL;
+        last = hierarchy ? &hierarchy->entries[hierarchy->offsets[i + 1]] : NULL;
+        for (run = 0; run < hashes->hashes[i].used; run = end) {
+            end = entry < last ? run + (entry++)->used : hashes->hashes[i].used;
+            for (j = run, document = 0, category = 0; j < end; j++) {
+                packed = HSNextPacked(packed, &document);
+                // The run is sorted, so its categories only go up
+                while (category + 1 < HSCategories.used && document >= HSCategories.categories[category + 1].firstDocument) category++;
+                hashes->hashes[i].users[j].category = category;
+                hashes->hashes[i].users[j].document = document - HSCategories.categories[category].firstDocument;
+            }
+        }
+    }
+    free(hashes->packed);
+    hashes->packed = NULL;
+}
+
+static uint32_t HSHierarchyUsers(const void *table, uint32_t hash, uint16_t *categories, float *scores)
+{
+    const FHSHashJudgeUsers *users;
+    uint32_t j, used;
+
+    users = HSUsers(table, hash, &used);
+    for (j = 0; j < used; j++) {
+        categories[j] = users[j].category;
+    }
+    return used;
+}
+
+static void HSHierarchyRegroup(void *table, uint32_t hash, const uint32_t *order, void *scratch)
+{
+    HashListExt *hashes = table;
+    FHSHashJudgeUsers *users = scratch;
+    uint32_t j;
+
+    memcpy(users, hashes->hashes[hash].users, hashes->hashes[hash].used * sizeof(FHSHashJudgeUsers));
+    for (j = 0; j < hashes->hashes[hash].used; j++) {
+        hashes->hashes[hash].users[j] = users[order[j]];
+    }
+}
+
+// Group the categories by top level name, see buildHierarchy. An image can only be grouped if
+// it was written from a grouped table.
+static void HSBuildHierarchy(HashListExt *hashes)
+{
+    const char **names;
+    uint32_t maxUsers = 0, used;
+    int32_t i;
 
-    return 0; // Equal
+    freeHierarchy(&hashes->hierarchy);
+    if (hierarchy_groups <= 0) return;
+    if ((names = malloc((HSCategories.used ? HSCategories.used : 1) * sizeof(char *))) == NULL) return;
+    for (i = 0; i < HSCategories.used; i++) {
+        names[i] = HSCategories.categories[i].name;
+    }
+    for (i = 0; i < hashes->used; i++) {
+        HSUsers(hashes, i, &used);
+        if (used > maxUsers) maxUsers = used;
+    }
+    buildHierarchy(&hashes->hierarchy, names, HSCategories.used, hashes, hashes->used, maxUsers, HSHierarchyUsers, hashes->image ? NULL : HSHierarchyRegroup, 0);
+    free(names);
 }
 
+// Build the search helpers of the judge table once it has been loaded
+static void initHSSearch(HashListExt *hashes)
+{
+    const void *keys = hashes->keys ? (const void *) hashes->keys : (const void *) hashes->hashes;
+    size_t stride = hashes->keys ? sizeof(HTMLFeature) : sizeof(hyperspaceFeatureExt);
+
+    HSNumberDocuments();
+#ifdef CLASSIFYWITHRADIX
+    buildRadixIndex(&hashes->radix, keys, stride, hashes->used);
+#endif
+#ifdef CLASSIFYWITHBLOOM
+    buildBloomFilter(&hashes->bloom, keys, stride, hashes->used);
+#endif
+    HSBuildHierarchy(hashes);
+    buildHSSecondaries();
+}
+
+static void freeHSEytzinger(HashListExt *hashes)
+{
+    free(hashes->eytzinger);
+    free(hashes->eytzingerRank);
+    hashes->eytzinger = NULL;
+    hashes->eytzingerRank = NULL;
+}
+
+// In order walk of the implicit tree, so the sorted keys land in breadth first order
+static uint32_t HSEytzingerFill(HashListExt *hashes, uint32_t i, uint32_t k)
+{
+    if (k <= (uint32_t) hashes->used) {
+        i = HSEytzingerFill(hashes, i, 2 * k);
+        hashes->eytzinger[k] = HSKey(hashes, i);
+        hashes->eytzingerRank[k] = i;
+        i++;
+        i = HSEytzingerFill(hashes, i, 2 * k + 1);
+    }
+    return i;
+}
+
+// The hyperspace table does not change after loading, so build a static search layout
+// for it and pack its users. Loading more data afterwards undoes both again.
+int optimizeFHS(HashListExt *hashes)
+{
+    void *temp = NULL;
+
+    freeHSEytzinger(hashes);
+    if (hashes->used == 0) return -1;
+    // Cache line aligned so that the prefetch in HSEytzingerSearch fetches whole nodes
+    if (posix_memalign(&temp, 64, (hashes->used + 1) * sizeof(HTMLFeature)) != 0) temp = NULL;
+    hashes->eytzinger = temp;
+    hashes->eytzingerRank = malloc((hashes->used + 1) * sizeof(uint32_t));
+    if (hashes->eytzinger == NULL || hashes->eytzingerRank == NULL) {
+        ci_debug_printf(1, "optimizeFHS: unable to allocate memory, using the sorted hashes.\n");
+        freeHSEytzinger(hashes);
+        return -2;
+    }
+    hashes->eytzinger[0] = 0;
+    hashes->eytzingerRank[0] = 0;
+    HSEytzingerFill(hashes, 0, 1);
+    // An image has its own read only users
+    if (hashes->image == NULL && hashes->packed == NULL && HSPackPostings(hashes) != 0) {
+        ci_debug_printf(1, "optimizeFHS: unable to allocate memory to pack the hash users, leaving them as they are.\n");
+        return -2;
+    }
+    return 0;
+}
+
+// Loading more data changes the table, so drop what optimizeFHS built for it
+static void HSUnoptimize(HashListExt *hashes)
+{
+    freeHSEytzinger(hashes);
+    HSUnpackPostings(hashes);
+}
+
+// Read a count that is oldSize bytes in files before version 3 and newSize bytes from then on.
+// Returns 0, or -1 if the file ends first.
+static int readFHSQty(int fhs_file, const FHS_HEADERv1 *header, uint32_t *qty, size_t oldSize, size_t newSize)
+{
+    uint16_t oldQty;
+
+    if (header->version >= HYPERSPACE_FORMAT_VERSION) return read(fhs_file, qty, newSize) == (ssize_t) newSize ? 0 : -1;
+    if (read(fhs_file, &oldQty, oldSize) != (ssize_t) oldSize) return -1;
+    *qty = oldQty;
+    return 0;
+}
 
 static int verifyFHS(int fhs_file, FHS_HEADERv1 *header)
 {
     int offsetFixup;
-    if (fhs_file) return -999;
+    if (fhs_file < 0) return -999;
     lseek64(fhs_file, 0, SEEK_SET);
     do {
         offsetFixup = read(fhs_file, &header->ID, 3);
@@ -120,7 +571,7 @@ static int verifyFHS(int fhs_file, FHS_HEADERv1 *header)
             offsetFixup = read(fhs_file, &header->version, FHS_HEADERv1_VERSION_SIZE);
             if (offsetFixup < FHS_HEADERv1_VERSION_SIZE) lseek64(fhs_file, -offsetFixup, SEEK_CUR);
         } while (offsetFixup > 0 && offsetFixup < FHS_HEADERv1_VERSION_SIZE);
-        if (header->version != HYPERSPACE_FORMAT_VERSION && header->version != OLD_HYPERSPACE_FORMAT_VERSION) {
+        if (header->version != HYPERSPACE_FORMAT_VERSION && header->version != HYPERSPACE_16BIT_FORMAT_VERSION && header->version != OLD_HYPERSPACE_FORMAT_VERSION) {
             ci_debug_printf(1, "Wrong version of FastHyperSpace file\n");
             return -2;
         }
@@ -142,7 +593,7 @@ static int verifyFHS(int fhs_file, FHS_HEADERv1 *header)
                 return -6;
             }
         } else ci_debug_printf(5, "Loading old FastHyperSpace file\n");
-        if (read(fhs_file, &header->records, FHS_HEADERv1_RECORDS_QTY_SIZE) != FHS_HEADERv1_RECORDS_QTY_SIZE) {
+        if (readFHSQty(fhs_file, header, &header->records, FHS_HEADERv1_RECORDS_QTY_SIZE, FHS_HEADERv3_RECORDS_QTY_SIZE) != 0) {
             ci_debug_printf(1, "FastHyperSpace file has invalid header: no records count\n");
             return -4;
         }
@@ -187,9 +638,9 @@ void writeFHSHeader(int file, FHS_HEADERv1 *header)
     } while (i >= 0 && i < FHS_HEADERv2_WCS_SIZE);
 
     do {
-        i = write(file, &header->records, FHS_HEADERv1_RECORDS_QTY_SIZE);
-        if (i < FHS_HEADERv1_RECORDS_QTY_SIZE) lseek64(file, -i, SEEK_CUR);
-    } while (i >= 0 && i < FHS_HEADERv1_RECORDS_QTY_SIZE);
+        i = write(file, &header->records, FHS_HEADERv3_RECORDS_QTY_SIZE);
+        if (i < FHS_HEADERv3_RECORDS_QTY_SIZE) lseek64(file, -i, SEEK_CUR);
+    } while (i >= 0 && i < FHS_HEADERv3_RECORDS_QTY_SIZE);
 }
 #endif
 
@@ -233,20 +684,130 @@ static inline void binary2char(char *source, char *destination, int16_t bytes)
 }
 #endif
 
+// Write the records count of header at its place in the header
+static void writeFHSRecords(int file, FHS_HEADERv1 *header)
+{
+    uint16_t oldRecords = header->records;
+    const void *records = &header->records;
+    int size = FHS_HEADERv3_RECORDS_QTY_SIZE, writecheck;
+
+    if (header->version < HYPERSPACE_FORMAT_VERSION) {
+        records = &oldRecords;
+        size = FHS_HEADERv1_RECORDS_QTY_SIZE;
+    }
+    lseek64(file, FHS_HEADER_RECORDS_OFFSET, SEEK_SET);
+    do {
+        writecheck = write(file, records, size);
+        if (writecheck < size) lseek64(file, -writecheck, SEEK_CUR);
+    } while (writecheck >=0 && writecheck < size);
+}
+
+// Rewrite the version 2 file in place as version 3, with every record it has, so that a category
+// which outgrew the 16 bit counts can go on being learned. Returns 0, or -1 with the file as it was.
+static int upgradeFHSFile(int file, FHS_HEADERv1 *header)
+{
+    struct stat st;
+    uint8_t *old = NULL, *new = NULL, *in, *out, *end;
+    uint_least16_t version = HYPERSPACE_FORMAT_VERSION, qty16;
+    uint32_t qty, record;
+    int64_t done, size;
+    ssize_t count;
+
+    if (fstat(file, &st) < 0 || st.st_size < (off_t) FHS_HEADER_RECORDS_OFFSET + FHS_HEADERv1_RECORDS_QTY_SIZE) return -1;
+    // Each record count grows by two bytes, as does the header
+    size = st.st_size + (int64_t) (header->records + 1) * (FHS_v3_QTY_SIZE - FHS_v1_QTY_SIZE);
+    old = malloc(st.st_size);
+    new = malloc(size);
+    if (old == NULL || new == NULL) {
+        ci_debug_printf(1, "upgradeFHSFile: unable to allocate memory to rewrite the file\n");
+        goto FAILED;
+    }
+    lseek64(file, 0, SEEK_SET);
+    for (done = 0; done < st.st_size; done += count) {
+        do {
+            count = read(file, old + done, st.st_size - done);
+        } while (count < 0 && errno == EINTR);
+        if (count <= 0) goto FAILED;
+    }
+
+    memcpy(new, old, FHS_HEADER_RECORDS_OFFSET);
+    memcpy(new + FHS_HEADERv1_ID_SIZE, &version, FHS_HEADERv1_VERSION_SIZE);
+    memcpy(new + FHS_HEADER_RECORDS_OFFSET, &header->records, FHS_HEADERv3_RECORDS_QTY_SIZE);
+    in = old + FHS_HEADER_RECORDS_OFFSET + FHS_HEADERv1_RECORDS_QTY_SIZE;
+    end = old + st.st_size;
+    out = new + FHS_HEADERv3_TOTAL_SIZE;
+    for (record = 0; record < header->records; record++) {
+        if (end - in < (ptrdiff_t) FHS_v1_QTY_SIZE) goto TRUNCATED;
+        memcpy(&qty16, in, FHS_v1_QTY_SIZE);
+        in += FHS_v1_QTY_SIZE;
+        if ((end - in) / FHS_v1_HASH_SIZE < qty16) goto TRUNCATED;
+        qty = qty16;
+        memcpy(out, &qty, FHS_v3_QTY_SIZE);
+        out += FHS_v3_QTY_SIZE;
+        memcpy(out, in, qty * FHS_v1_HASH_SIZE);
+        out += qty * FHS_v1_HASH_SIZE;
+        in += qty * FHS_v1_HASH_SIZE;
+    }
+
+    // Anything past the last record is not part of the file, as the loaders go by the count
+    size = out - new;
+    lseek64(file, 0, SEEK_SET);
+    for (done = 0; done < size; done += count) {
+        do {
+            count = write(file, new + done, size - done);
+        } while (count < 0 && errno == EINTR);
+        if (count <= 0) {
+            ci_debug_printf(1, "upgradeFHSFile: failed to write the file as version 3: %s\n", strerror(errno));
+            goto FAILED;
+        }
+    }
+    do {
+        count = ftruncate(file, size);
+    } while (count == -1 && errno == EINTR);
+    header->version = HYPERSPACE_FORMAT_VERSION;
+    free(old);
+    free(new);
+    return 0;
+
+TRUNCATED:
+    ci_debug_printf(1, "upgradeFHSFile: the file has fewer records than its header says\n");
+FAILED:
+    free(old);
+    free(new);
+    return -1;
+}
+
+// Version 2 files are added to in their own format, as long as the document fits in it. One
+// that it does not fit in is rewritten as version 3 first.
 int writeFHSHashes(int file, FHS_HEADERv1 *header, HashList *hashes_list)
 {
-    uint16_t i;
+    uint32_t i;
+    uint16_t oldQty = hashes_list->used;
+    const void *qty = &hashes_list->used;
+    int qtySize = FHS_v3_QTY_SIZE;
     int writecheck;
-    if (header->WCS != sizeof(wchar_t) || header->version != HYPERSPACE_FORMAT_VERSION) {
+    if (header->WCS != sizeof(wchar_t) || (header->version != HYPERSPACE_FORMAT_VERSION && header->version != HYPERSPACE_16BIT_FORMAT_VERSION)) {
         ci_debug_printf(1, "writeFHSHashes cannot write to a different version file or to a file with a different WCS!\n");
         return -2;
     }
+    if (header->version == HYPERSPACE_16BIT_FORMAT_VERSION &&
+            (hashes_list->used > FHS_v1_QTY_MAX || header->records >= FHS_HEADERv1_RECORDS_QTY_MAX)) {
+        ci_debug_printf(3, "writeFHSHashes: the document does not fit in a version 2 file, rewriting it as version 3\n");
+        if (upgradeFHSFile(file, header) != 0) {
+            ci_debug_printf(1, "writeFHSHashes: unable to rewrite the file as version 3!\n");
+            return -2;
+        }
+    }
+    if (header->version == HYPERSPACE_16BIT_FORMAT_VERSION) {
+        qty = &oldQty;
+        qtySize = FHS_v1_QTY_SIZE;
+    }
     lseek64(file, 0, SEEK_END);
     if (hashes_list->used) { // check before we write
         do {
-            writecheck = write(file, &hashes_list->used, FHS_v1_QTY_SIZE);
-            if (writecheck < FHS_v1_QTY_SIZE) lseek64(file, -writecheck, SEEK_CUR);
-        } while (writecheck >= 0 && writecheck < FHS_v1_QTY_SIZE);
+            writecheck = write(file, qty, qtySize);
+            if (writecheck < qtySize) lseek64(file, -writecheck, SEEK_CUR);
+        } while (writecheck >= 0 && writecheck < qtySize);
         for (i = 0; i < hashes_list->used; i++) {
             do {
                 writecheck = write(file, &hashes_list->hashes[i], FHS_v1_HASH_SIZE);
@@ -255,87 +816,42 @@ int writeFHSHashes(int file, FHS_HEADERv1 *header, HashList *hashes_list)
         }
         /* Ok, have written hashes, now save new count */
         header->records = header->records+1;
-        lseek64(file, 9, SEEK_SET);
-        do {
-            writecheck = write(file, &header->records, FHS_HEADERv1_RECORDS_QTY_SIZE);
-            if (writecheck < FHS_HEADERv1_RECORDS_QTY_SIZE) lseek64(file, -writecheck, SEEK_CUR);
-        } while (writecheck >=0 && writecheck < FHS_HEADERv1_RECORDS_QTY_SIZE);
+        writeFHSRecords(file, header);
         return 0;
     }
     return -1;
 }
 
+// The preload is always written as a new version 3 file, which holds all of the hashes in one
+// record
 int writeFHSHashesPreload(int file, FHS_HEADERv1 *header, HashListExt *hashes_list)
 {
-    uint32_t realHashesUsed = 0, i = 0;
-    hyperspaceFeatureExt *realHashes;
+    uint32_t used = hashes_list->used, hash;
     int writecheck;
-    uint16_t hash;
     // Set records to zero and truncate the file
-    do {
-        writecheck = ftruncate64(file, 11);
-    } while (writecheck == -1 && errno == EINTR);
-    if (writecheck == -1) {
-        ci_debug_printf(1, "Failed to truncate file in writeFHSHashesPreload, this will be a problem!\n");
-    }
-    lseek64(file, 0, SEEK_END);
-    header->records = 0;
+    writeFHSHeader(file, header);
 
-    realHashesUsed = hashes_list->used;
-    realHashes = hashes_list->hashes;
-
-    if (hashes_list->used == 0) return -1;
+    if (hashes_list->used <= 0) return -1;
+    lseek64(file, 0, SEEK_END);
     do {
-        // Make sure we only write out FHS_v1_QTY_MAX records per document
-        // Do this by screwing with hashes_list->used, save old, modify
-        if (hashes_list->used > FHS_v1_QTY_MAX) {
-            hashes_list->used = FHS_v1_QTY_MAX - 1;
-        }
-        // Also, change HSJudgeHashList.hashes to offset for previously used ones
-        hashes_list->hashes = &hashes_list->hashes[i];
-
-        // Actually do writing
-        if (hashes_list->used) { // check before we write
-            do {
-                writecheck = write(file, &hashes_list->used, FHS_v1_QTY_SIZE);
-                if (writecheck < FHS_v1_QTY_SIZE) lseek64(file, -writecheck, SEEK_CUR);
-            } while (writecheck >=0 && writecheck < FHS_v1_QTY_SIZE);
-            for (hash = 0; hash < hashes_list->used; hash++) {
-                do {
-                    writecheck = write(file, &hashes_list->hashes[hash], FHS_v1_HASH_SIZE);
-                    if (writecheck < FHS_v1_HASH_SIZE) lseek64(file, -writecheck, SEEK_CUR);
-                } while (writecheck >=0 && writecheck < FHS_v1_HASH_SIZE);
-            }
-        }
-
-        header->records = header->records + 1;
-
-        // Restore hashes_list->hashes
-        hashes_list->hashes = realHashes;
-
-        // Make sure that we never write out more than FHS_HEADERv1_RECORDS_QTY_MAX times as this is our maximum document count
-        if (header->records > FHS_HEADERv1_RECORDS_QTY_MAX) {
-            ci_debug_printf(5, "PROBLEM: We have more hashes than allowed!!\n");
-        }
-
-        // Change hashes_list->used
-        i += hashes_list->used;
-        hashes_list->used = realHashesUsed - i;
-    } while (i < realHashesUsed);
-
-    // Restore hashes_list->used
-    HSJudgeHashList.used = realHashesUsed;
+        writecheck = write(file, &used, FHS_v3_QTY_SIZE);
+        if (writecheck < FHS_v3_QTY_SIZE) lseek64(file, -writecheck, SEEK_CUR);
+    } while (writecheck >=0 && writecheck < FHS_v3_QTY_SIZE);
+    for (hash = 0; hash < used; hash++) {
+        do {
+            writecheck = write(file, &hashes_list->hashes[hash].hash, FHS_v1_HASH_SIZE);
+            if (writecheck < FHS_v1_HASH_SIZE) lseek64(file, -writecheck, SEEK_CUR);
+        } while (writecheck >=0 && writecheck < FHS_v1_HASH_SIZE);
+    }
 
     /* Ok, have written hashes, now save new count */
-    lseek64(file, 9, SEEK_SET);
-    do {
-        writecheck = write(file, &header->records, FHS_HEADERv1_RECORDS_QTY_SIZE);
-        if (writecheck < FHS_HEADERv1_RECORDS_QTY_SIZE) lseek64(file, -writecheck, SEEK_CUR);
-    } while (writecheck >=0 && writecheck < FHS_HEADERv1_RECORDS_QTY_SIZE);
+    header->records = 1;
+    writeFHSRecords(file, header);
     return header->records;
 }
 #endif
 
+#ifndef CLASSIFYWITHMERGE
 static int32_t HSBinarySearch(HashListExt *hashes_list, int32_t start, int32_t end, uint64_t key)
 {
     int32_t mid=0;
@@ -344,14 +860,86 @@ static int32_t HSBinarySearch(HashListExt *hashes_list, int32_t start, int32_t e
     mid = start + ((end - start) / 2);
 //  ci_debug_printf(10, "Start %"PRId64" end %"PRId64" mid %"PRId64"\n", start, end, mid);
 //  ci_debug_printf(10, "Keys @ mid: %"PRIX64" looking for %"PRIX64"\n", hashes_list->hashes[mid].hash, key);
-    if (hashes_list->hashes[mid].hash > key)
+    if (HSKey(hashes_list, mid) > key)
         return HSBinarySearch(hashes_list, start, mid-1, key);
-    else if (hashes_list->hashes[mid].hash < key)
+    else if (HSKey(hashes_list, mid) < key)
         return HSBinarySearch(hashes_list, mid+1, end, key);
     else return mid;
 
     return -1; // This should never be reached
 }
+#endif
+
+// Branch free search of the Eytzinger ordered hashes. Each step only picks a child, the
+// prefetch pulls in the cache line holding the nodes three levels further down.
+static inline int32_t HSEytzingerSearch(HashListExt *hashes_list, uint64_t key)
+{
+    const HTMLFeature *eytzinger = hashes_list->eytzinger;
+    uint32_t k = 1;
+
+    while (k <= (uint32_t) hashes_list->used) {
+        __builtin_prefetch(eytzinger + k * 8);
+        k = 2 * k + (eytzinger[k] < key);
+    }
+    k >>= __builtin_ffs(~k); // Undo the right turns taken after the last left turn
+    if (k && eytzinger[k] == key) return hashes_list->eytzingerRank[k];
+    return -1;
+}
+
+#ifdef CLASSIFYWITHMERGE
+// Galloping (exponential) search starting at *cursor. Everything before *cursor is
+// smaller than the previous key, so with ascending keys each search picks up where the
+// last one ended. *cursor is left at the first key not smaller than key (past it on a hit).
+// Only the keys before used are searched.
+static inline int32_t HSGallopSearch(HashListExt *hashes_list, int32_t used, int32_t *cursor, uint64_t key)
+{
+    int32_t lo = *cursor, hi, mid, step = 1;
+
+    // Keys out of order, start over rather than miss
+    if (lo > 0 && HSKey(hashes_list, lo - 1) >= key) lo = 0;
+    hi = lo;
+    while (hi < used && HSKey(hashes_list, hi) < key) {
+        lo = hi + 1;
+        hi += step;
+        step <<= 1;
+    }
+    if (hi >= used) hi = used - 1;
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (HSKey(hashes_list, mid) < key) lo = mid + 1;
+        else hi = mid;
+    }
+    *cursor = lo;
+    if (lo < used && HSKey(hashes_list, lo) == key) {
+        (*cursor)++;
+        return lo;
+    }
+    return -1;
+}
+#endif
+
+// Find key in the judge table for classification. cursor must start at 0 for each document.
+static inline int32_t HSJudgeSearch(HashListExt *hashes_list, int32_t *cursor, uint64_t key)
+{
+    int32_t start, end;
+
+#ifdef CLASSIFYWITHBLOOM
+    if (hashes_list->bloom.blocks && !bloomMayContain(&hashes_list->bloom, key)) return -1;
+#endif
+    if (hashes_list->eytzinger) return HSEytzingerSearch(hashes_list, key);
+    start = 0;
+    end = hashes_list->used - 1;
+#ifdef CLASSIFYWITHRADIX
+    if (hashes_list->radix.start) radixRange(&hashes_list->radix, key, &start, &end);
+#endif
+#ifdef CLASSIFYWITHMERGE
+    // Gallop only inside the key's bucket, jumping straight to it past any gap in the document
+    if (*cursor < start || *cursor > end + 1) *cursor = start;
+    return HSGallopSearch(hashes_list, end + 1, cursor, key);
+#else
+    return HSBinarySearch(hashes_list, start, end, key);
+#endif
+}
 
 static uint32_t featuresInCategory(int fhs_file, FHS_HEADERv1 *header)
 {
@@ -362,23 +950,23 @@ static uint32_t featuresInCategory(int fhs_file, FHS_HEADERv1 *header)
     else return 0;
 }
 
-HTMLFeature *loadDocument(const char *fhs_name, const char *cat_name, int fhs_file, uint16_t numHashes)
+HTMLFeature *loadDocument(const char *fhs_name, const char *cat_name, int fhs_file, uint32_t numHashes)
 {
     HTMLFeature *hashes=NULL;
-    int status = 0;
-    int bytes = 0;
-    int to_read = FHS_v1_HASH_SIZE * numHashes;
-    hashes = malloc(FHS_v1_HASH_SIZE * numHashes);
-    // ci_debug_printf(5, "Going to read %"PRIu16" hashes from record %"PRIu16"\n", numHashes, i);
+    ssize_t status = 0;
+    size_t bytes = 0;
+    size_t to_read = FHS_v1_HASH_SIZE * (size_t) numHashes;
+    hashes = malloc(to_read ? to_read : 1);
+    // ci_debug_printf(5, "Going to read %"PRIu32" hashes from record %"PRIu32"\n", numHashes, i);
     do {
-        status = read(fhs_file, hashes + bytes, to_read);
+        status = read(fhs_file, (char *) hashes + bytes, to_read);
         if (status > 0) {
             bytes += status;
             to_read -= status;
         }
 
     } while (status > 0);
-    if (bytes < FHS_v1_HASH_SIZE * numHashes) ci_debug_printf(3, "Corrupted fhs file: %s for cat_name: %s\n", fhs_name, cat_name);
+    if (bytes < FHS_v1_HASH_SIZE * (size_t) numHashes) ci_debug_printf(3, "Corrupted fhs file: %s for cat_name: %s\n", fhs_name, cat_name);
     return hashes;
 }
 
@@ -387,23 +975,110 @@ void closeDocument(uint64_t *hashes)
     free(hashes);
 }
 
-// The following number is based on a lot of experimentation. It should be between 35-70. The larger the data set, the higher the number should be.
-// 95 is ideal for my training set.
-#define HS_OFFSET_MAX 95
+// One use of a hash, as the loaders collect them
+typedef struct {
+    HTMLFeature hash;
+    uint16_t category;
+    uint32_t document;
+} HSPosting;
+
+// Sort postings on their hash, least significant byte first, with swap as the second buffer.
+// The sort is stable, so the users of a hash stay in the order they were collected in. Bytes
+// that every hash shares are skipped. Returns whichever of the two buffers holds the result.
+static HSPosting *HSRadixSort(HSPosting *postings, HSPosting *swap, int64_t count)
+{
+    HSPosting *from = postings, *to = swap, *temp;
+    int64_t counts[8][256], total, next, n;
+    int byte, digit;
+
+    memset(counts, 0, sizeof(counts));
+    for (n = 0; n < count; n++) {
+        for (byte = 0; byte < 8; byte++) counts[byte][(postings[n].hash >> (byte * 8)) & 0xFF]++;
+    }
+    for (byte = 0; byte < 8; byte++) {
+        if (count == 0 || counts[byte][(postings[0].hash >> (byte * 8)) & 0xFF] == count) continue;
+        for (digit = 0, total = 0; digit < 256; digit++) {
+            next = counts[byte][digit];
+            counts[byte][digit] = total;
+            total += next;
+        }
+        for (n = 0; n < count; n++) to[counts[byte][(from[n].hash >> (byte * 8)) & 0xFF]++] = from[n];
+        temp = from;
+        from = to;
+        to = temp;
+    }
+    return from;
+}
+
+// Merge sorted postings into the sorted entries existing as a new table, in one pass. The users
+// of existing move to the new table and the postings of a hash are added after them.
+// Returns the table with *used set, or NULL without memory.
+static hyperspaceFeatureExt *HSMergePostings(hyperspaceFeatureExt *existing, uint32_t existingCount, const HSPosting *postings, int64_t count, int32_t *used)
+{
+    hyperspaceFeatureExt *hashes, *tempHashes;
+    FHSHashJudgeUsers *tempUsers;
+    HTMLFeature hash;
+    int64_t distinct = 0, next, last;
+    uint32_t e = 0;
+
+    for (next = 0; next < count; next++) {
+        if (next == 0 || postings[next].hash != postings[next - 1].hash) distinct++;
+    }
+    if (existingCount + distinct > INT32_MAX) return NULL;
+    hashes = malloc((existingCount + distinct + 1) * sizeof(hyperspaceFeatureExt));
+    if (hashes == NULL) return NULL;
+    *used = 0;
+    next = 0;
+    while (next < count || e < existingCount) {
+        if (next < count && (e >= existingCount || postings[next].hash < existing[e].hash))
+            hash = postings[next].hash;
+        else hash = existing[e].hash;
+        for (last = next; last < count && postings[last].hash == hash; last++);
+
+        if (e < existingCount && existing[e].hash == hash) {
+            hashes[*used] = existing[e];
+            e++;
+        } else {
+            hashes[*used].hash = hash;
+            hashes[*used].used = 0;
+            hashes[*used].users = NULL;
+        }
+        if (last > next) {
+            tempUsers = realloc(hashes[*used].users, (hashes[*used].used + (last - next)) * sizeof(FHSHashJudgeUsers));
+            if (tempUsers == NULL) {
+                free(hashes);
+                return NULL;
+            }
+            hashes[*used].users = tempUsers;
+            for (; next < last; next++) {
+                tempUsers[hashes[*used].used].category = postings[next].category;
+                tempUsers[hashes[*used].used].document = postings[next].document;
+                hashes[*used].used++;
+            }
+        }
+        (*used)++;
+    }
+    if (*used && (tempHashes = realloc(hashes, *used * sizeof(hyperspaceFeatureExt))) != NULL) hashes = tempHashes;
+    return hashes;
+}
+
+// Every hash of the category is collected with its document, radix sorted once and merged
+// into HSJudgeHashList.
 int loadHyperSpaceCategory(const char *fhs_name, const char *cat_name)
 {
     int fhs_file;
-    uint16_t i, j, z, shortcut=0, offsetPos=2;
-    int32_t BSRet=-1;
-    int64_t offsets[HS_OFFSET_MAX+1];
+    uint32_t i, j;
     HTMLFeature *docHashes;
     FHSTextCategory *tempCategory = NULL;
-    hyperspaceFeatureExt *tempHashes = NULL;
+    hyperspaceFeatureExt *hashes;
+    HSPosting *postings = NULL, *swap = NULL, *sorted, *tempPostings;
     FHS_HEADERv1 header;
-    uint16_t numHashes=0;
-    uint32_t startHashes = HSJudgeHashList.used;
-    offsets[0] = 0;
+    uint32_t numHashes=0;
+    int64_t count = 0, slots = 0;
+    int32_t used;
+    if (HSJudgeHashList.image) return -1; // We cannot add to a mapped image
     if ((fhs_file = openFHS(fhs_name, &header, 0)) < 0) return fhs_file;
+    HSUnoptimize(&HSJudgeHashList);
     if (HSCategories.used == HSCategories.slots) {
         HSCategories.slots += HYPERSPACE_CATEGORY_INC;
         tempCategory = realloc(HSCategories.categories, HSCategories.slots * sizeof(FHSTextCategory));
@@ -412,80 +1087,55 @@ int loadHyperSpaceCategory(const char *fhs_name, const char *cat_name)
     HSCategories.categories[HSCategories.used].name = strndup(cat_name, MAX_HYPSERSPACE_CATEGORY_NAME);
     HSCategories.categories[HSCategories.used].totalDocuments = header.records;
     HSCategories.categories[HSCategories.used].totalFeatures = 0;
-    HSCategories.categories[HSCategories.used].documentKnownHashes = malloc(header.records * sizeof(uint16_t));
+    HSCategories.categories[HSCategories.used].documentKnownHashes = malloc(header.records * sizeof(uint32_t));
 
-    if (header.records && HSJudgeHashList.used + featuresInCategory(fhs_file, &header) >= HSJudgeHashList.slots) {
-        HSJudgeHashList.slots += featuresInCategory(fhs_file, &header);
-        tempHashes = realloc(HSJudgeHashList.hashes, HSJudgeHashList.slots * sizeof(hyperspaceFeatureExt));
-        if (tempHashes != NULL) HSJudgeHashList.hashes = tempHashes;
-    }
+    if (header.records) slots = featuresInCategory(fhs_file, &header);
+    if (slots && (postings = malloc(slots * sizeof(HSPosting))) == NULL) goto NO_MEMORY;
 
-//  ci_debug_printf(7, "Going to read %"PRIu16" records from %s\n", header.records, cat_name);
-    offsets[1] = HSJudgeHashList.used;
+//  ci_debug_printf(7, "Going to read %"PRIu32" records from %s\n", header.records, cat_name);
     for (i = 0; i < header.records; i++) {
-        if (read(fhs_file, &numHashes, FHS_v1_QTY_SIZE) < FHS_v1_QTY_SIZE) ; // ERRORFIXME;
+        if (readFHSQty(fhs_file, &header, &numHashes, FHS_v1_QTY_SIZE, FHS_v3_QTY_SIZE) != 0) numHashes = 0; // ERRORFIXME;
         docHashes = loadDocument(fhs_name, cat_name, fhs_file, numHashes);
 
         HSCategories.categories[HSCategories.used].documentKnownHashes[i] = numHashes;
         HSCategories.categories[HSCategories.used].totalFeatures += numHashes;
-        if (HSJudgeHashList.used + numHashes > HSJudgeHashList.slots) {
-            if (HSJudgeHashList.slots != 0) ci_debug_printf(10, "Ooops, we shouldn't be allocating more memory here. (%s)\n", fhs_name);
-            HSJudgeHashList.slots += numHashes;
-            tempHashes = realloc(HSJudgeHashList.hashes, HSJudgeHashList.slots * sizeof(hyperspaceFeatureExt));
-            if (tempHashes != NULL) HSJudgeHashList.hashes = tempHashes;
+        if (count + numHashes > slots) {
+            ci_debug_printf(10, "Ooops, we shouldn't be allocating more memory here. (%s)\n", fhs_name);
+            slots = count + numHashes;
+            if ((tempPostings = realloc(postings, slots * sizeof(HSPosting))) == NULL) goto NO_MEMORY;
+            postings = tempPostings;
         }
 
         for (j = 0; j < numHashes; j++) {
-//          ci_debug_printf(10, "Loading keys: %"PRIX64" in Category: %s Document:%"PRIu16"\n", docHashes[j], cat_name, i);
-            if (i > 0 || offsets[0] != offsets[1]) {
-                shortcut = 0;
-                for (z = 1; z < offsetPos; z++) {
-                    if ((BSRet=HSBinarySearch(&HSJudgeHashList, offsets[z-1], offsets[z] - 1, docHashes[j])) >= 0) {
-                        if (shortcut == 0) {
-                            HSJudgeHashList.hashes[BSRet].users = realloc(HSJudgeHashList.hashes[BSRet].users, (HSJudgeHashList.hashes[BSRet].used+1) * sizeof(FHSHashJudgeUsers));
-//                          ci_debug_printf(10, "Found keys: %"PRIX64" already in table (offset %"PRIu16"), updating\n", docHashes[j], z);
-                            HSJudgeHashList.hashes[BSRet].users[HSJudgeHashList.hashes[BSRet].used].category = HSCategories.used;
-                            HSJudgeHashList.hashes[BSRet].users[HSJudgeHashList.hashes[BSRet].used].document = i;
-                            HSJudgeHashList.hashes[BSRet].used++;
-                        }
-//                      else ci_debug_printf(10, "PROBLEM IN THE CITY\n");
-                        shortcut++;
-                    }
-                }
-                if (!shortcut) goto STORE_NEW;
-            } else {
-STORE_NEW:
-//              ci_debug_printf(10, "Didn't find keys: %"PRIX64" in table\n", docHashes[j]);
-                HSJudgeHashList.hashes[HSJudgeHashList.used].hash = docHashes[j];
-                HSJudgeHashList.hashes[HSJudgeHashList.used].used = 0;
-                HSJudgeHashList.hashes[HSJudgeHashList.used].users = calloc(1, sizeof(FHSHashJudgeUsers));
-                HSJudgeHashList.hashes[HSJudgeHashList.used].users[HSJudgeHashList.hashes[HSJudgeHashList.used].used].category = HSCategories.used;
-                HSJudgeHashList.hashes[HSJudgeHashList.used].users[HSJudgeHashList.hashes[HSJudgeHashList.used].used].document = i;
-                HSJudgeHashList.hashes[HSJudgeHashList.used].used++;
-                HSJudgeHashList.used++;
-            }
+//          ci_debug_printf(10, "Loading keys: %"PRIX64" in Category: %s Document:%"PRIu32"\n", docHashes[j], cat_name, i);
+            postings[count].hash = docHashes[j];
+            postings[count].category = HSCategories.used;
+            postings[count].document = i;
+            count++;
         }
         closeDocument(docHashes);
-        if (offsetPos > HS_OFFSET_MAX) {
-//            qsort(HSJudgeHashList.hashes, HSJudgeHashList.used, sizeof(hyperspaceFeatureExt), &judgeHash_compare);
-            HS_fluxsort(HSJudgeHashList.hashes, HSJudgeHashList.used, sizeof(hyperspaceFeatureExt), &judgeHash_compare);
-            offsetPos = 2;
-        }
-        offsets[offsetPos] = HSJudgeHashList.used;
-        if (offsets[offsetPos-1] != offsets[offsetPos]) offsetPos++;
     }
-//    if (startHashes != HSJudgeHashList.used) qsort(HSJudgeHashList.hashes, HSJudgeHashList.used, sizeof(hyperspaceFeatureExt), &judgeHash_compare);
-    if (startHashes != HSJudgeHashList.used) HS_fluxsort(HSJudgeHashList.hashes, HSJudgeHashList.used, sizeof(hyperspaceFeatureExt), &judgeHash_compare);
+    close(fhs_file);
+    if (count) {
+        if ((swap = malloc(count * sizeof(HSPosting))) == NULL) goto NO_MEMORY;
+        sorted = HSRadixSort(postings, swap, count);
+        if ((hashes = HSMergePostings(HSJudgeHashList.hashes, HSJudgeHashList.used, sorted, count, &used)) == NULL) goto NO_MEMORY;
+        // The users of the old entries now belong to hashes
+        free(HSJudgeHashList.hashes);
+        HSJudgeHashList.hashes = hashes;
+        HSJudgeHashList.used = used;
+        HSJudgeHashList.slots = used;
+    }
+    free(postings);
+    free(swap);
 //  ci_debug_printf(10, "Categories: %"PRIu32" Hashes Used: %"PRIu32"\n", HSCategories.used, HSJudgeHashList.used);
     HSCategories.used++;
-    // Fixup memory usage
-    if (HSJudgeHashList.slots > HSJudgeHashList.used && HSJudgeHashList.used > 1) {
-        HSJudgeHashList.slots = HSJudgeHashList.used;
-        tempHashes = realloc(HSJudgeHashList.hashes, HSJudgeHashList.slots * sizeof(hyperspaceFeatureExt));
-        if (tempHashes != NULL) HSJudgeHashList.hashes = tempHashes;
-    }
-    close(fhs_file);
+    initHSSearch(&HSJudgeHashList);
     return 1;
+
+NO_MEMORY:
+    ci_debug_printf(1, "Unable to allocate memory while loading %s. Dying.\n", fhs_name);
+    exit(-1);
 }
 
 static int preload_hash_compare(const uint_least64_t a, const uint_least64_t b)
@@ -505,13 +1155,13 @@ static int preload_hash_compare(const uint_least64_t a, const uint_least64_t b)
 int preLoadHyperSpace(const char *fhs_name)
 {
     int fhs_file;
-    uint16_t i, j;
+    uint32_t i, j;
     uint_least64_t *docHashes;
     hyperspaceFeatureExt *tempHashes = NULL;
     FHS_HEADERv1 header;
-    uint16_t numHashes=0;
+    uint32_t numHashes=0;
 
-    if (HSJudgeHashList.used > 0) {
+    if (HSJudgeHashList.used > 0 || HSJudgeHashList.image) {
         ci_debug_printf(1, "TextPreload / preLoadHyperSpace called with some hashes already loaded. ABORTING PRELOAD!\n");
         return -1;
     }
@@ -523,9 +1173,9 @@ int preLoadHyperSpace(const char *fhs_name)
         if (tempHashes != NULL) HSJudgeHashList.hashes = tempHashes;
     }
 
-//  ci_debug_printf(10, "Going to read %"PRIu16" records from %s\n", header.records, fhs_name);
+//  ci_debug_printf(10, "Going to read %"PRIu32" records from %s\n", header.records, fhs_name);
     for (i = 0; i < header.records; i++) {
-        if (read(fhs_file, &numHashes, 2)<2) ; // ERRORFIXME;
+        if (readFHSQty(fhs_file, &header, &numHashes, FHS_v1_QTY_SIZE, FHS_v3_QTY_SIZE) != 0) numHashes = 0; // ERRORFIXME;
         docHashes = loadDocument(fhs_name, fhs_name, fhs_file, numHashes);
 
         if (HSJudgeHashList.used + numHashes > HSJudgeHashList.slots) {
@@ -536,7 +1186,7 @@ int preLoadHyperSpace(const char *fhs_name)
         }
 
         for (j = 0; j < numHashes; j++) {
-//          ci_debug_printf(10, "Loading keys: %"PRIX64", in Category: %s Document:%"PRIu16"\n", docHashes[j], cat_name, i);
+//          ci_debug_printf(10, "Loading keys: %"PRIX64", in Category: %s Document:%"PRIu32"\n", docHashes[j], cat_name, i);
             if (HSJudgeHashList.used == 0) goto ADD_HASH;
             switch (preload_hash_compare(HSJudgeHashList.hashes[HSJudgeHashList.used-1].hash, docHashes[j])) {
             case -1:
@@ -567,9 +1217,255 @@ ADD_HASH:
         if (tempHashes != NULL) HSJudgeHashList.hashes = tempHashes;
     }
     close(fhs_file);
+    initHSSearch(&HSJudgeHashList);
     return 1;
 }
 
+#ifdef _POSIX_MAPPED_FILES
+// One mapped fhs file taking part in loadMassHSCategories' partitioned build
+typedef struct {
+    char *catName;
+    char *address;
+    int64_t size;
+    int64_t *documents;             // Offset of the first hash of each document
+    uint32_t *documentKnownHashes;  // Becomes FHSTextCategory.documentKnownHashes
+    int32_t totalFeatures;
+    uint32_t records;
+} HSMassFile;
+
+typedef struct {
+    HSMassFile *files;
+    uint16_t used;
+    uint16_t slots;
+} HSMassList;
+
+// One slice of the hash space, built on its own thread
+typedef struct {
+    HSMassList *list;
+    HTMLFeature low;                // Hashes [low, high] belong to the partition
+    HTMLFeature high;
+    uint32_t existing;              // Entries [existing, existingEnd) of HSJudgeHashList belong to the partition
+    uint32_t existingEnd;
+    uint16_t firstCategory;
+    hyperspaceFeatureExt *hashes;   // The partition's part of the table
+    int32_t used;
+} HSMassPartition;
+
+static void HSMassAdd(HSMassList *list, const char *fhs_name, const char *cat_name)
+{
+    int fhs_file;
+    FHS_HEADERv1 header;
+    struct stat st;
+    HSMassFile *file, *tempFiles;
+    int64_t offset;
+    uint32_t i, numHashes;
+    uint16_t oldQty;
+    int qtySize;
+    char *address;
+
+    if ((fhs_file = openFHS(fhs_name, &header, 0)) < 0) return;
+    qtySize = (header.version >= HYPERSPACE_FORMAT_VERSION ? FHS_v3_QTY_SIZE : FHS_v1_QTY_SIZE);
+    if (list->used == list->slots) {
+        tempFiles = realloc(list->files, (list->slots + HYPERSPACE_CATEGORY_INC) * sizeof(HSMassFile));
+        if (tempFiles == NULL) {
+            ci_debug_printf(1, "Unable to allocate memory for %s in loadMassHSCategories\n", fhs_name);
+            close(fhs_file);
+            return;
+        }
+        list->files = tempFiles;
+        list->slots += HYPERSPACE_CATEGORY_INC;
+    }
+    file = &list->files[list->used];
+    fstat(fhs_file, &st);
+    file->size = st.st_size;
+    offset = lseek64(fhs_file, 0, SEEK_CUR);
+    address = mmap(0, file->size, PROT_READ, MAP_PRIVATE, fhs_file, 0);
+    close(fhs_file);
+    if (address == MAP_FAILED) {
+        ci_debug_printf(3, "Failed to mmap %s in loadMassHSCategories\n", fhs_name);
+        return;
+    }
+    file->address = address;
+    file->records = header.records;
+    file->totalFeatures = 0;
+    file->documents = malloc((header.records ? header.records : 1) * sizeof(int64_t));
+    file->documentKnownHashes = malloc((header.records ? header.records : 1) * sizeof(uint32_t));
+    if (file->documents == NULL || file->documentKnownHashes == NULL) {
+        ci_debug_printf(1, "Unable to allocate memory for %s in loadMassHSCategories\n", fhs_name);
+        free(file->documents);
+        free(file->documentKnownHashes);
+        munmap(address, file->size);
+        return;
+    }
+    // Find every document up front, so the partitions only have to look at the hashes
+    for (i = 0; i < header.records; i++) {
+        numHashes = oldQty = 0;
+        if (offset + qtySize <= file->size) {
+            if (qtySize == FHS_v1_QTY_SIZE) {
+                memcpy(&oldQty, address + offset, FHS_v1_QTY_SIZE);
+                numHashes = oldQty;
+            } else memcpy(&numHashes, address + offset, FHS_v3_QTY_SIZE);
+        }
+        offset += qtySize;
+        if (offset + (int64_t) numHashes * FHS_v1_HASH_SIZE > file->size) {
+            ci_debug_printf(3, "Corrupted fhs file: %s for cat_name: %s\n", fhs_name, cat_name);
+            numHashes = (offset < file->size ? (file->size - offset) / FHS_v1_HASH_SIZE : 0);
+        }
+        file->documents[i] = offset;
+        file->documentKnownHashes[i] = numHashes;
+        file->totalFeatures += numHashes;
+        offset += (int64_t) numHashes * FHS_v1_HASH_SIZE;
+    }
+    file->catName = strdup(cat_name);
+    list->used++;
+}
+
+// First entry of HSJudgeHashList whose hash is not below hash
+static uint32_t HSMassExistingFind(HTMLFeature hash)
+{
+    uint32_t low = 0, high = HSJudgeHashList.used, mid;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (HSJudgeHashList.hashes[mid].hash < hash) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Collect every use of the partition's hashes, in category then document order, radix sort
+// them and merge them with the partition's part of HSJudgeHashList (preload and anything loaded
+// before) into part->hashes.
+static void *HSMassBuild(void *arg)
+{
+    HSMassPartition *part = arg;
+    HSPosting *postings = NULL, *swap = NULL, *sorted;
+    HSMassFile *file;
+    HTMLFeature hash;
+    int64_t offset, count = 0, filled = 0;
+    uint32_t i, j;
+    uint16_t f;
+    int fill;
+
+    // First count, then fill, so postings is allocated once at its exact size
+    for (fill = 0; fill < 2; fill++) {
+        for (f = 0; f < part->list->used; f++) {
+            file = &part->list->files[f];
+            for (i = 0; i < file->records; i++) {
+                offset = file->documents[i];
+                for (j = 0; j < file->documentKnownHashes[i]; j++, offset += FHS_v1_HASH_SIZE) {
+                    memcpy(&hash, file->address + offset, FHS_v1_HASH_SIZE);
+                    if (hash < part->low || hash > part->high) continue;
+                    if (fill) {
+                        postings[filled].hash = hash;
+                        postings[filled].category = part->firstCategory + f;
+                        postings[filled].document = i;
+                        filled++;
+                    } else count++;
+                }
+            }
+        }
+        if (!fill && count && ((postings = malloc(count * sizeof(HSPosting))) == NULL ||
+                               (swap = malloc(count * sizeof(HSPosting))) == NULL)) goto NO_MEMORY;
+    }
+    sorted = HSRadixSort(postings, swap, count);
+    part->hashes = HSMergePostings(&HSJudgeHashList.hashes[part->existing], part->existingEnd - part->existing, sorted, count, &part->used);
+    if (part->hashes == NULL) goto NO_MEMORY;
+    free(postings);
+    free(swap);
+    return NULL;
+
+NO_MEMORY:
+    ci_debug_printf(1, "Unable to allocate memory while building the hyperspace table. Dying.\n");
+    exit(-1);
+}
+
+// Build HSJudgeHashList from every file in list. The hash space is split into one partition per
+// load thread; each partition collects, sorts and merges its own hashes on its own thread and the
+// table is the partitions laid end to end.
+static int HSMassLoad(HSMassList *list)
+{
+    HSMassPartition *parts = NULL;
+    hyperspaceFeatureExt *hashes = NULL;
+    FHSTextCategory *tempCategory = NULL;
+    int64_t used = 0;
+    int partitions = loadThreadCount(), p;
+    uint16_t i;
+    int ret = 1;
+
+    if (list->used == 0) return 1;
+    if (HSJudgeHashList.image) {
+        ret = -1; // We cannot add to a mapped image
+        goto CLEANUP;
+    }
+    if ((parts = malloc(partitions * sizeof(HSMassPartition))) == NULL) {
+        ci_debug_printf(1, "Unable to allocate memory for partitions in loadMassHSCategories\n");
+        ret = -2;
+        goto CLEANUP;
+    }
+    if (HSCategories.used + list->used > HSCategories.slots) {
+        tempCategory = realloc(HSCategories.categories, (HSCategories.used + list->used) * sizeof(FHSTextCategory));
+        if (tempCategory == NULL) {
+            ci_debug_printf(1, "Unable to allocate memory for categories in loadMassHSCategories\n");
+            ret = -2;
+            goto CLEANUP;
+        }
+        HSCategories.categories = tempCategory;
+        HSCategories.slots = HSCategories.used + list->used;
+    }
+    HSUnoptimize(&HSJudgeHashList);
+
+    for (p = 0; p < partitions; p++) {
+        parts[p].list = list;
+        parts[p].low = loadPartitionStart(p, partitions);
+        parts[p].high = (p + 1 < partitions ? loadPartitionStart(p + 1, partitions) - 1 : UINT64_MAX);
+        parts[p].existing = (p ? parts[p - 1].existingEnd : 0);
+        parts[p].existingEnd = (p + 1 < partitions ? HSMassExistingFind(parts[p].high + 1) : (uint32_t) HSJudgeHashList.used);
+        parts[p].firstCategory = HSCategories.used;
+        parts[p].hashes = NULL;
+        parts[p].used = 0;
+    }
+    runLoadWorkers(HSMassBuild, parts, sizeof(HSMassPartition), partitions);
+    for (p = 0; p < partitions; p++) used += parts[p].used;
+    if (used > INT32_MAX || (used && (hashes = malloc(used * sizeof(hyperspaceFeatureExt))) == NULL)) {
+        ci_debug_printf(1, "Unable to allocate memory for %"PRId64" hashes in loadMassHSCategories. Dying.\n", used);
+        exit(-1);
+    }
+    // Partitions are in hash order, so laying them out one after the other gives the sorted table
+    for (p = 0, used = 0; p < partitions; p++) {
+        if (parts[p].used) memcpy(&hashes[used], parts[p].hashes, parts[p].used * sizeof(hyperspaceFeatureExt));
+        used += parts[p].used;
+        free(parts[p].hashes);
+    }
+    for (i = 0; i < list->used; i++) {
+        HSCategories.categories[HSCategories.used].name = strndup(list->files[i].catName, MAX_HYPSERSPACE_CATEGORY_NAME);
+        HSCategories.categories[HSCategories.used].totalDocuments = list->files[i].records;
+        HSCategories.categories[HSCategories.used].totalFeatures = list->files[i].totalFeatures;
+        HSCategories.categories[HSCategories.used].documentKnownHashes = list->files[i].documentKnownHashes;
+        list->files[i].documentKnownHashes = NULL;
+        HSCategories.used++;
+    }
+    // The users of the old entries now belong to hashes
+    free(HSJudgeHashList.hashes);
+    HSJudgeHashList.hashes = hashes;
+    HSJudgeHashList.used = used;
+    HSJudgeHashList.slots = used;
+    initHSSearch(&HSJudgeHashList);
+
+CLEANUP:
+    free(parts);
+    for (i = 0; i < list->used; i++) {
+        munmap(list->files[i].address, list->files[i].size);
+        free(list->files[i].documents);
+        free(list->files[i].documentKnownHashes);
+        free(list->files[i].catName);
+    }
+    free(list->files);
+    list->files = NULL;
+    list->used = list->slots = 0;
+    return ret;
+}
+#endif
+
 int loadMassHSCategories(const char *fhs_dir)
 {
     DIR *dirp;
@@ -577,6 +1473,9 @@ int loadMassHSCategories(const char *fhs_dir)
     char old_dir[PATH_MAX];
     int name_len;
     char *cat_name;
+#ifdef _POSIX_MAPPED_FILES
+    HSMassList mass = { .files = NULL, .used = 0, .slots = 0 };
+#endif
 
     if (getcwd(old_dir, PATH_MAX) == NULL) {
         ci_debug_printf(1, "Unable to get current working directory in loadMassHSCategories because %s. Dying.", strerror(errno));
@@ -608,7 +1507,11 @@ int loadMassHSCategories(const char *fhs_dir)
                 cat_name = malloc(name_len + 1);
                 strncpy(cat_name, dp->d_name, name_len);
                 cat_name[name_len] = '\0';
+#ifdef _POSIX_MAPPED_FILES
+                HSMassAdd(&mass, dp->d_name, cat_name);
+#else
                 loadHyperSpaceCategory(dp->d_name, cat_name);
+#endif
                 free(cat_name);
             }
         }
@@ -617,6 +1520,9 @@ int loadMassHSCategories(const char *fhs_dir)
         perror("error reading directory");
     else
         (void) closedir(dirp);
+#ifdef _POSIX_MAPPED_FILES
+    HSMassLoad(&mass);
+#endif
 
     if (chdir(old_dir) == -1) {
         ci_debug_printf(1, "Unable to change directory in loadMassHSCategories because %s. This should be impossible. Ignoring.", strerror(errno));
@@ -624,19 +1530,37 @@ int loadMassHSCategories(const char *fhs_dir)
     return 1;
 }
 
-static HTMLClassification doHyperSpaceClassify(uint32_t **categories, HashList *unknown)
+// Resolve TextPrimarySecondary for the categories in HSCategories. It must be done again
+// whenever categories are loaded or secondaries are added.
+void buildHSSecondaries(void)
 {
-    double total_radiance = DBL_MIN;
-    double remainder = DBL_MIN;
-    double *class_radiance = malloc(HSCategories.used * sizeof(double));
+    const char **names;
+    uint32_t i;
 
-    uint32_t bestseen = 0, secondbest = 1;
-    HTMLClassification myReply = { .primary_name = NULL, .primary_probability = 0.0, .primary_probScaled = 0.0, .secondary_name = NULL, .secondary_probability = 0.0, .secondary_probScaled = 0.0 };
+    if ((names = malloc((HSCategories.used ? HSCategories.used : 1) * sizeof(char *))) == NULL) {
+        freeSecondaries(&HSCategories.secondaries);
+        return;
+    }
+    for (i = 0; i < HSCategories.used; i++) {
+        names[i] = HSCategories.categories[i].name;
+    }
+    buildSecondaries(&HSCategories.secondaries, names, HSCategories.used);
+    free(names);
+}
 
-    uint32_t cls, doc; // class and document counters
+// May secondbest be reported as the secondary of bestseen?
+static int HSIsSecondary(const FHSModel *model, uint32_t bestseen, uint32_t secondbest)
+{
+    if (model->categories->secondaries.bits && model->categories->secondaries.categories == model->categories->used)
+        return isSecondary(&model->categories->secondaries, bestseen, secondbest);
+    return secondaryMatch(model->categories->categories[bestseen].name, model->categories->categories[secondbest].name);
+}
+
+// Radiance of one known document with intersections features in common with an unknown one
+// of ufeats features, 0 when the two are too small to count
+static inline float HSDocumentRadiance(uint32_t intersections, uint32_t kfeats, uint32_t ufeats)
+{
     uint32_t nfeats;   // total features
-    uint32_t ufeats;   // features in this unknown
-    uint32_t kfeats;   // features in the known
 
 // Basic match parameters
     float k_disjoint_u;   // features in known doc, not in unknown
@@ -655,94 +1579,188 @@ static HTMLClassification doHyperSpaceClassify(uint32_t **categories, HashList *
 // Since distance and light are per document, we sum them up
 // and do the inverse square law and then sum the results in
 // a running total. The final value is per class.
-    float radiance;
-
-    ufeats = unknown->used;
-
-    for (cls = 0; cls < HSCategories.used; cls++)
-        class_radiance[cls]=0.0;
-
-    // Class-level loop
-    for (cls = 0; cls < HSCategories.used; cls++) {
-        // Document-level loop
-        for (doc = 0 ; doc < HSCategories.categories[cls].totalDocuments; doc++) {
-            kfeats = HSCategories.categories[cls].documentKnownHashes[doc];
-            k_intersect_u = categories[cls][doc];
-            u_disjoint_k = ufeats - (uint32_t) k_intersect_u;
-            k_disjoint_u = HSCategories.categories[cls].documentKnownHashes[doc] - (uint32_t) k_intersect_u;
-            nfeats = kfeats + ufeats - (uint32_t) k_intersect_u;
-
-            if (nfeats > 10) {
-                // This is not proper Pythagorean (Euclidean) distance.
-                // Proper would be sqrtf(u_disjoint_k^2 + k_disjoint_u^2).
-                // Proper distance is not used because it would tend to
-                // "repulse" things from the right class. Using something
-                // that weakens radiance for differences, but doesn't
-                // "repulse."
-                // We don't actually take a square root here, because our only
-                // use is in the radience formula (inverse square law), where
-                // we just square it again.
-                distance = u_disjoint_k + k_disjoint_u;
-
-                // This formula was the best found in the MIT `SC 2006 paper.
-                // It works well because by doing k_intersect_u^2, we get a "pulling"
-                // effect which helps "pull" things into the right class.
-                // The first line is inverse square law, the .000001 is to avoid
-                // divide by zero.
-                // We don't bother squaring the distance as it is effectively
-                // squared already.
-                if (distance > 0) { // If there is no distance, ignore it
-                    radiance = 1.0 / distance;
-                    radiance = radiance * k_intersect_u * k_intersect_u;
-                } else radiance = k_intersect_u * k_intersect_u;
-
-                class_radiance[cls] += radiance;
-            }
+    float radiance = 0;
+
+    k_intersect_u = intersections;
+    u_disjoint_k = ufeats - (uint32_t) k_intersect_u;
+    k_disjoint_u = kfeats - (uint32_t) k_intersect_u;
+    nfeats = kfeats + ufeats - (uint32_t) k_intersect_u;
+
+    if (nfeats > 10) {
+        // This is not proper Pythagorean (Euclidean) distance.
+        // Proper would be sqrtf(u_disjoint_k^2 + k_disjoint_u^2).
+        // Proper distance is not used because it would tend to
+        // "repulse" things from the right class. Using something
+        // that weakens radiance for differences, but doesn't
+        // "repulse."
+        // We don't actually take a square root here, because our only
+        // use is in the radience formula (inverse square law), where
+        // we just square it again.
+        distance = u_disjoint_k + k_disjoint_u;
+
+        // This formula was the best found in the MIT `SC 2006 paper.
+        // It works well because by doing k_intersect_u^2, we get a "pulling"
+        // effect which helps "pull" things into the right class.
+        // The first line is inverse square law, the .000001 is to avoid
+        // divide by zero.
+        // We don't bother squaring the distance as it is effectively
+        // squared already.
+        if (distance > 0) { // If there is no distance, ignore it
+            radiance = 1.0 / distance;
+            radiance = radiance * k_intersect_u * k_intersect_u;
+        } else radiance = k_intersect_u * k_intersect_u;
+    }
+    return radiance;
+}
+
+// Total radiance of the documents of a class, known[doc] features each, of which
+// intersections[doc] are in the unknown
+static double HSRadianceScalar(const uint32_t *intersections, const uint32_t *known, uint32_t documents, uint32_t ufeats)
+{
+    double total = 0.0;
+    uint32_t doc;
+
+    for (doc = 0; doc < documents; doc++) {
+        total += HSDocumentRadiance(intersections[doc], known[doc], ufeats);
+    }
+    return total;
+}
+
+#ifdef KERNEL_DISPATCH
+// Works out the radiance of eight documents at once just as HSDocumentRadiance does, from the
+// parallel intersections and known arrays, and adds them up in four double lanes that are only
+// summed at the end. The total can differ from HSRadianceScalar's, which adds them in document
+// order, in its last bits; kernel_level scalar keeps that as the reference. A document has no
+// more features in common with the unknown than either has, and all the counts are below
+// HS_RADIANCE_EXACT (see HSScratchRadiance), so they are exact as floats and as signed lanes.
+static KERNEL_TARGET_AVX2 double HSRadianceAVX2(const uint32_t *intersections, const uint32_t *known, uint32_t documents, uint32_t ufeats)
+{
+    const __m256i unknown = _mm256_set1_epi32(ufeats);
+    const __m256i ten = _mm256_set1_epi32(10);
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m256i intersect, nfeats;
+    __m256 k_intersect_u, distance, inverse, radiance;
+    __m256d sum = _mm256_setzero_pd();
+    __m128d half;
+    double total;
+    uint32_t doc = 0;
+
+    for (; documents - doc >= 8; doc += 8) {
+        intersect = _mm256_loadu_si256((const __m256i *) (intersections + doc));
+        nfeats = _mm256_sub_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i *) (known + doc)), unknown), intersect);
+        k_intersect_u = _mm256_cvtepi32_ps(intersect);
+        distance = _mm256_cvtepi32_ps(_mm256_sub_epi32(nfeats, intersect));
+        // 1.0 / distance is a double division, rounded to float
+        inverse = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_div_pd(one, _mm256_cvtps_pd(_mm256_extractf128_ps(distance, 1)))),
+                                  _mm256_cvtpd_ps(_mm256_div_pd(one, _mm256_cvtps_pd(_mm256_castps256_ps128(distance)))));
+        radiance = _mm256_blendv_ps(_mm256_mul_ps(k_intersect_u, k_intersect_u), _mm256_mul_ps(_mm256_mul_ps(inverse, k_intersect_u), k_intersect_u),
+                                    _mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_GT_OQ));
+        radiance = _mm256_and_ps(radiance, _mm256_castsi256_ps(_mm256_cmpgt_epi32(nfeats, ten)));
+        sum = _mm256_add_pd(sum, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(radiance)), _mm256_cvtps_pd(_mm256_extractf128_ps(radiance, 1))));
+    }
+    half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+    total = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for (; doc < documents; doc++) {
+        total += HSDocumentRadiance(intersections[doc], known[doc], ufeats);
+    }
+    return total;
+}
+#endif
+
+static double (*HSRadiance)(const uint32_t *intersections, const uint32_t *known, uint32_t documents, uint32_t ufeats) = HSRadianceScalar;
+
+void selectHSKernels(void)
+{
+    HSRadiance = HSRadianceScalar;
+#ifdef KERNEL_DISPATCH
+    // Sixteen lanes were no faster
+    if (kernelLevel() >= KERNEL_AVX2) HSRadiance = HSRadianceAVX2;
+#endif
+}
+
+// Radiance of the touched documents of category, gathered in order; the rest have nothing in
+// common with the unknown and add 0. With HSRadianceScalar the total is the same as over all of
+// them. The vector kernels group the documents into lanes differently once the untouched ones
+// are left out, so theirs can differ in its last bits, as it already can from the scalar total.
+// Counts from HS_RADIANCE_EXACT up are left to HSRadianceScalar.
+#define HS_RADIANCE_EXACT (1 << 24)
+
+static double HSScratchRadiance(HSScratch *scratch, const FHSTextCategory *category, uint32_t ufeats)
+{
+    uint32_t first = category->firstDocument, end = first + category->totalDocuments;
+    uint32_t word, document, used = 0, widest = ufeats;
+    uint64_t bits;
+
+    if (category->totalDocuments == 0) return 0.0;
+    for (word = first / 64; word <= (end - 1) / 64; word++) {
+        bits = scratch->touched[word];
+        if (word == first / 64) bits &= ~(uint64_t) 0 << (first & 63);
+        if (word == (end - 1) / 64 && (end & 63)) bits &= ((uint64_t) 1 << (end & 63)) - 1;
+        for (; bits; bits &= bits - 1) {
+            document = word * 64 + __builtin_ctzll(bits);
+            scratch->intersections[used] = scratch->counts[document];
+            scratch->known[used] = category->documentKnownHashes[document - first];
+            widest |= scratch->known[used++];
         }
     }
+    if (widest >= HS_RADIANCE_EXACT) return HSRadianceScalar(scratch->intersections, scratch->known, used, ufeats);
+    return HSRadiance(scratch->intersections, scratch->known, used, ufeats);
+}
+
+// Only the categories set in scored are scored, and only those set in allowed may be
+// reported, unless it is NULL
+static HTMLClassification doHyperSpaceClassify(const FHSModel *model, HSScratch *scratch, const uint8_t *scored, HashList *unknown, const uint8_t *allowed)
+{
+    double total_radiance = DBL_MIN;
+    double remainder = DBL_MIN;
+    double *class_radiance = malloc(model->categories->used * sizeof(double));
+
+    uint32_t bestseen = 0, secondbest = 1;
+    HTMLClassification myReply = { .primary_name = NULL, .primary_probability = 0.0, .primary_probScaled = 0.0, .secondary_name = NULL, .secondary_probability = 0.0, .secondary_probScaled = 0.0 };
+
+    uint32_t cls; // class counter
+
+    // Class-level loop, the document-level loop is HSScratchRadiance
+    for (cls = 0; cls < model->categories->used; cls++) {
+        if (!scored[cls]) class_radiance[cls] = 0.0; // Left out by HSHierarchyCount or the subset
+        else class_radiance[cls] = HSScratchRadiance(scratch, &model->categories->categories[cls], unknown->used);
+    }
 
     // Renormalize radiance to probability
-    for (cls = 0; cls < HSCategories.used; cls++) {
+    for (cls = 0; cls < model->categories->used; cls++) {
         // Avoid divide by zero and keep value small, for log10(remainder) below
         if (class_radiance[cls] < DBL_MIN)
             class_radiance[cls] = DBL_MIN;
         total_radiance += class_radiance[cls];
     }
 
-    for (cls = 0; cls < HSCategories.used; cls++) { // Order of instructions in this loop matters!
+    if (allowed) { // Start from the first two that may be reported, there are at least two
+        for (bestseen = 0; !allowed[bestseen]; bestseen++);
+        for (secondbest = bestseen + 1; !allowed[secondbest]; secondbest++);
+    }
+
+    for (cls = 0; cls < model->categories->used; cls++) { // Order of instructions in this loop matters!
         class_radiance[cls] = class_radiance[cls] / total_radiance; // fix-up probability
-        if (class_radiance[cls] > class_radiance[bestseen]) {
+        if ((!allowed || allowed[cls]) && class_radiance[cls] > class_radiance[bestseen]) {
             secondbest = bestseen;
             bestseen = cls; // are we the best
-        } else if (cls != bestseen && class_radiance[cls] > class_radiance[secondbest]) secondbest = cls;
+        } else if (cls != bestseen && (!allowed || allowed[cls]) && class_radiance[cls] > class_radiance[secondbest]) secondbest = cls;
         remainder += class_radiance[cls]; // add up remainder
     }
     remainder -= class_radiance[bestseen]; // fix-up remainder
     if (remainder < DBL_MIN) remainder = DBL_MIN;
 
-    for (int i = 0; i < number_secondaries; i++) {
-        if (tre_regexec(&secondary_compares[i].primary_regex, HSCategories.categories[bestseen].name, 0, NULL, 0) != REG_NOMATCH && tre_regexec(&secondary_compares[i].secondary_regex, HSCategories.categories[secondbest].name, 0, NULL, 0) != REG_NOMATCH) {
-            remainder -= class_radiance[secondbest];
-            if (remainder < DBL_MIN) remainder = DBL_MIN;
-            myReply.secondary_probability = class_radiance[secondbest];
-            myReply.secondary_probScaled = 10 * (log10(class_radiance[secondbest]) - log10(remainder));
-            myReply.secondary_name = HSCategories.categories[secondbest].name;
-            i = number_secondaries;
-        } else if (secondary_compares[i].bidirectional == 1) {
-            if (tre_regexec(&secondary_compares[i].primary_regex, HSCategories.categories[secondbest].name, 0, NULL, 0) != REG_NOMATCH && tre_regexec(&secondary_compares[i].secondary_regex, HSCategories.categories[bestseen].name, 0, NULL, 0) != REG_NOMATCH) {
-                remainder -= class_radiance[secondbest];
-                if (remainder < DBL_MIN) remainder = DBL_MIN;
-                myReply.secondary_probability = class_radiance[secondbest];
-                myReply.secondary_probScaled = 10 * (log10(class_radiance[secondbest]) - log10(remainder));
-                myReply.secondary_name = HSCategories.categories[secondbest].name;
-                i = number_secondaries;
-            }
-        }
+    if (number_secondaries && HSIsSecondary(model, bestseen, secondbest)) {
+        remainder -= class_radiance[secondbest];
+        if (remainder < DBL_MIN) remainder = DBL_MIN;
+        myReply.secondary_probability = class_radiance[secondbest];
+        myReply.secondary_probScaled = 10 * (log10(class_radiance[secondbest]) - log10(remainder));
+        myReply.secondary_name = model->categories->categories[secondbest].name;
     }
 
     myReply.primary_probability = class_radiance[bestseen];
     myReply.primary_probScaled = 10 * (log10(class_radiance[bestseen]) - log10(remainder));
-    myReply.primary_name = HSCategories.categories[bestseen].name;
+    myReply.primary_name = model->categories->categories[bestseen].name;
 
     // cleanup time!
     free(class_radiance);
@@ -750,38 +1768,473 @@ static HTMLClassification doHyperSpaceClassify(uint32_t **categories, HashList *
     return myReply;
 }
 
-HTMLClassification doHSPrepandClassify(HashList *toClassify)
+// Two stage version of the counting in doHSPrepandClassify. The first stage scores each group
+// by how many hashes its documents share with the unknown, on average; the second counts only
+// the documents of the best hierarchy_groups groups into scratch. scored is set for their
+// categories that are also set in allowed. Returns 0, or -2 if there is no memory for it, in
+// which case nothing is counted or scored.
+static int HSHierarchyCount(const FHSModel *model, HSScratch *scratch, uint8_t *scored, HashList *toClassify, const uint8_t *allowed)
 {
-    uint32_t i, j;
-    uint32_t **categories = NULL;
-    int32_t BSRet = -1;
+    const myHierarchy_t *hierarchy = &model->hashes->hierarchy;
+    const myHierarchyEntry_t *entry, *last;
+    const FHSHashJudgeUsers *users, *end;
+    const FHSTextCategory *known = model->categories->categories;
+    const uint8_t *packed;
+    int32_t *found = malloc((toClassify->used ? toClassify->used : 1) * sizeof(int32_t));
+    uint64_t *groupHits = calloc(hierarchy->groups, sizeof(uint64_t));
+    double *groupScores = calloc(hierarchy->groups, sizeof(double));
+    uint8_t *active = malloc(hierarchy->groups);
+    int32_t BSRet, cursor = 0, hits = 0, h;
+    uint32_t i, users_used;
+    uint16_t g;
+    int ret = -2;
+
+    memset(scored, 0, model->categories->used);
+    if (found == NULL || groupHits == NULL || groupScores == NULL || active == NULL) goto CLEANUP;
+
+    for (i = 0; i < toClassify->used; i++) {
+        if ((BSRet = HSJudgeSearch(model->hashes, &cursor, toClassify->hashes[i])) >= 0) {
+            found[hits++] = BSRet;
+            last = &hierarchy->entries[hierarchy->offsets[BSRet + 1]];
+            for (entry = &hierarchy->entries[hierarchy->offsets[BSRet]]; entry < last; entry++) {
+                groupHits[entry->group] += entry->used;
+            }
+        }
+    }
+    for (i = 0; i < model->categories->used; i++) {
+        groupScores[hierarchy->groupOf[i]] += known[i].totalDocuments;
+    }
+    for (g = 0; g < hierarchy->groups; g++) {
+        if (groupScores[g] > 0) groupScores[g] = groupHits[g] / groupScores[g];
+    }
+    hierarchyTopGroups(hierarchy, groupScores, hierarchy_groups, allowed, active);
+
+    for (i = 0; i < model->categories->used; i++) {
+        scored[i] = active[hierarchy->groupOf[i]] && (!allowed || allowed[i]);
+    }
+    for (h = 0; h < hits; h++) {
+        // The hashes were last seen a whole document ago
+        if (h + HIERARCHY_PREFETCH < hits) {
+            BSRet = found[h + HIERARCHY_PREFETCH];
+            __builtin_prefetch(&hierarchy->entries[hierarchy->offsets[BSRet]]);
+            if (model->hashes->packed) __builtin_prefetch(model->hashes->hashes[BSRet].packed);
+            else __builtin_prefetch(HSUsers(model->hashes, BSRet, &users_used));
+        }
+        BSRet = found[h];
+        last = &hierarchy->entries[hierarchy->offsets[BSRet + 1]];
+        entry = &hierarchy->entries[hierarchy->offsets[BSRet]];
+        if (model->hashes->packed) {
+            for (packed = model->hashes->hashes[BSRet].packed; entry < last; entry++) {
+                if (active[entry->group]) packed = HSCountPacked(scratch, packed, entry->used);
+                else packed = HSSkipPacked(packed, entry->used);
+            }
+            continue;
+        }
+        for (users = HSUsers(model->hashes, BSRet, &users_used); entry < last; entry++) {
+            if (active[entry->group]) {
+                for (end = users + entry->used; users < end; users++) {
+                    HSTouch(scratch, known[users->category].firstDocument + users->document);
+                }
+            } else users += entry->used;
+        }
+    }
+    ret = 0;
+
+CLEANUP:
+    free(found);
+    free(groupHits);
+    free(groupScores);
+    free(active);
+    return ret;
+}
+
+// Which categories subset names, see categoryInSubset. Returns NULL with *count set to
+// the number of categories of model if subset is NULL or empty, as then all of them are scored.
+static uint8_t *HSSubset(const FHSModel *model, const char *subset, uint32_t *count)
+{
+    uint8_t *allowed;
+    uint32_t cls;
+
+    *count = model->categories->used;
+    if (subset == NULL || subset[0] == '\0') return NULL;
+    if ((allowed = malloc(model->categories->used)) == NULL) {
+        *count = 0;
+        return NULL;
+    }
+    *count = 0;
+    for (cls = 0; cls < model->categories->used; cls++) {
+        allowed[cls] = categoryInSubset(subset, model->categories->categories[cls].name);
+        *count += allowed[cls];
+    }
+    return allowed;
+}
+
+// subset restricts scoring to the categories it names, see categoryInSubset. NULL scores them all.
+HTMLClassification doHSPrepandClassify(const FHSModel *model, HashList *toClassify, const char *subset)
+{
+    uint32_t i, j, users_used;
+    int32_t BSRet = -1, cursor = 0;
+    FHSHashJudgeUsers *users;
+    const FHSTextCategory *known = model->categories->categories;
+    const myHierarchy_t *hierarchy = (model->hashes->hierarchy.entries && model->hashes->hierarchy.categories == model->categories->used) ? &model->hashes->hierarchy : NULL;
+    const myHierarchyEntry_t *entry, *last;
+    const uint8_t *packed;
     HTMLClassification data = { .primary_name = NULL, .primary_probability = 0.0, .primary_probScaled = 0.0, .secondary_name = NULL, .secondary_probability = 0.0, .secondary_probScaled = 0.0  };;
+    HSScratch *scratch;
+    uint8_t *allowed, *scored;
+    uint32_t allowed_used;
 
-    if (HSCategories.used < 2) return data; // We must have at least two categories loaded or it is pointless to run
-    else categories = malloc(HSCategories.used * sizeof(uint32_t *));
+    if (model->categories->used < 2) return data; // We must have at least two categories loaded or it is pointless to run
 
-    // alloc data for document hash match stats
-    for (i = 0; i < HSCategories.used; i++) {
-        categories[i] = calloc(HSCategories.categories[i].totalDocuments, sizeof(uint32_t));
+    allowed = HSSubset(model, subset, &allowed_used);
+    if (allowed_used < 2) { // The same goes for the categories we may score
+        ci_debug_printf(3, "Category subset %s leaves fewer than two FHS categories, not classifying\n", subset);
+        free(allowed);
+        return data;
+    }
+    // Document hash match stats, by global document number
+    scored = malloc(model->categories->used);
+    if (scored == NULL || (scratch = HSGetScratch(model->categories->documents, model->categories->largest)) == NULL) {
+        ci_debug_printf(1, "Unable to allocate memory to classify with FHS\n");
+        free(scored);
+        free(allowed);
+        return data;
+    }
+
+    if (hierarchy && HSHierarchyCount(model, scratch, scored, toClassify, allowed) == 0) {
+        data = doHyperSpaceClassify(model, scratch, scored, toClassify, allowed);
+        HSScratchReset(scratch, model->categories->documents);
+        free(scored);
+        free(allowed);
+        return data;
+    }
+
+    // The categories left out of the subset are counted, but not scored
+    for (i = 0; i < model->categories->used; i++) {
+        scored[i] = !allowed || allowed[i];
     }
 
     // set the hash as having been seen on each category/document pair
     for (i=0; i < toClassify->used; i++) {
-        if ((BSRet = HSBinarySearch(&HSJudgeHashList, 0, HSJudgeHashList.used-1, toClassify->hashes[i]))>=0) {
+        if ((BSRet = HSJudgeSearch(model->hashes, &cursor, toClassify->hashes[i])) >= 0) {
 //          ci_debug_printf(10, "Found %"PRIX64"\n", toClassify->hashes[i]);
-            for (j = 0; j < HSJudgeHashList.hashes[BSRet].used; j++) {
-                categories[HSJudgeHashList.hashes[BSRet].users[j].category][HSJudgeHashList.hashes[BSRet].users[j].document]++;
+            if (model->hashes->packed) {
+                // Each hierarchy run was coded from 0 on its own, see HSPackPostings
+                packed = model->hashes->hashes[BSRet].packed;
+                if (hierarchy) {
+                    last = &hierarchy->entries[hierarchy->offsets[BSRet + 1]];
+                    for (entry = &hierarchy->entries[hierarchy->offsets[BSRet]]; entry < last; entry++) {
+                        packed = HSCountPacked(scratch, packed, entry->used);
+                    }
+                } else HSCountPacked(scratch, packed, model->hashes->hashes[BSRet].used);
+                continue;
+            }
+            users = HSUsers(model->hashes, BSRet, &users_used);
+            for (j = 0; j < users_used; j++) {
+                HSTouch(scratch, known[users[j].category].firstDocument + users[j].document);
             }
         }
     }
 //  ci_debug_printf(10, "Found %"PRIu16" out of %"PRIu16" items\n", z, toClassify->used);
 
-    data = doHyperSpaceClassify(categories, toClassify);
+    data = doHyperSpaceClassify(model, scratch, scored, toClassify, allowed);
 
     // cleanup
+    HSScratchReset(scratch, model->categories->documents);
+    free(scored);
+    free(allowed);
+    return data;
+}
+
+#ifdef TRAINER
+static int writeFHSImageData(int file, const void *data, int64_t bytes)
+{
+    ssize_t i;
+    const char *pos = data;
+    while (bytes > 0) {
+        i = write(file, pos, bytes);
+        if (i < 0) {
+            if (errno == EINTR) continue;
+            ci_debug_printf(1, "writeFHSImage: write failed with error: %s\n", strerror(errno));
+            return -1;
+        }
+        pos += i;
+        bytes -= i;
+    }
+    return 0;
+}
+
+static int writeFHSImagePadding(int file, int64_t written)
+{
+    const char zeros[8] = { 0 };
+    return writeFHSImageData(file, zeros, FHS_IMAGE_ALIGN(written) - written);
+}
+
+int writeFHSImage(int file, HashListExt *hashes)
+{
+    FHS_IMAGE_HEADERv1 header;
+    int64_t written, pool_used = 0;
+    uint32_t i, offset;
+    int status;
+
+    if (hashes->image) {
+        ci_debug_printf(1, "writeFHSImage: cannot write an image from an image\n");
+        return -1;
+    }
+    HSUnpackPostings(hashes); // The image holds category and document pairs
+    memset(&header, 0, sizeof(FHS_IMAGE_HEADERv1));
+    memcpy(&header.ID, "FHI", 4);
+    header.version = FHS_IMAGE_FORMAT_VERSION;
+    header.UBM = UNICODE_BYTE_MARK;
+    header.WCS = sizeof(wchar_t);
+    header.categories = HSCategories.used;
     for (i = 0; i < HSCategories.used; i++) {
-        free(categories[i]);
+        header.namesSize += strlen(HSCategories.categories[i].name) + 1;
+        header.documents += HSCategories.categories[i].totalDocuments;
     }
-    free(categories);
-    return data;
+    for (i = 0; i < hashes->used; i++) {
+        if (hashes->hashes[i].used) {
+            header.keys++;
+            pool_used += hashes->hashes[i].used;
+        }
+    }
+    if (pool_used > UINT32_MAX) {
+        ci_debug_printf(1, "writeFHSImage: too many hash users (%"PRId64") for an image\n", pool_used);
+        return -2;
+    }
+    header.pool = pool_used;
+
+    do {
+        status = ftruncate(file, 0);
+    } while (status == -1 && errno == EINTR);
+    if (status == -1) {
+        ci_debug_printf(1, "writeFHSImage: failed to truncate file: %s\n", strerror(errno));
+        return -1;
+    }
+    lseek64(file, 0, SEEK_SET);
+
+    if (writeFHSImageData(file, &header, sizeof(FHS_IMAGE_HEADERv1)) < 0) return -1;
+    written = sizeof(FHS_IMAGE_HEADERv1);
+    for (i = 0; i < HSCategories.used; i++) {
+        if (writeFHSImageData(file, &HSCategories.categories[i].totalFeatures, sizeof(int32_t)) < 0) return -1;
+    }
+    written += HSCategories.used * sizeof(int32_t);
+    if (writeFHSImagePadding(file, written) < 0) return -1;
+    written = FHS_IMAGE_ALIGN(written);
+    for (i = 0; i < HSCategories.used; i++) {
+        if (writeFHSImageData(file, &HSCategories.categories[i].totalDocuments, sizeof(uint32_t)) < 0) return -1;
+    }
+    written += HSCategories.used * sizeof(uint32_t);
+    if (writeFHSImagePadding(file, written) < 0) return -1;
+    written = FHS_IMAGE_ALIGN(written);
+    for (i = 0; i < HSCategories.used; i++) {
+        if (writeFHSImageData(file, HSCategories.categories[i].name, strlen(HSCategories.categories[i].name) + 1) < 0) return -1;
+    }
+    written += header.namesSize;
+    if (writeFHSImagePadding(file, written) < 0) return -1;
+    written = FHS_IMAGE_ALIGN(written);
+    for (i = 0; i < HSCategories.used; i++) {
+        if (writeFHSImageData(file, HSCategories.categories[i].documentKnownHashes, HSCategories.categories[i].totalDocuments * sizeof(uint32_t)) < 0) return -1;
+    }
+    written += (int64_t) header.documents * sizeof(uint32_t);
+    if (writeFHSImagePadding(file, written) < 0) return -1;
+    written = FHS_IMAGE_ALIGN(written);
+
+    // Keys, offsets and then users, each in one pass over the table
+    for (i = 0; i < hashes->used; i++) {
+        if (hashes->hashes[i].used && writeFHSImageData(file, &hashes->hashes[i].hash, sizeof(HTMLFeature)) < 0) return -1;
+    }
+    written += (int64_t) header.keys * sizeof(HTMLFeature);
+    offset = 0;
+    for (i = 0; i < hashes->used; i++) {
+        if (hashes->hashes[i].used) {
+            if (writeFHSImageData(file, &offset, sizeof(uint32_t)) < 0) return -1;
+            offset += hashes->hashes[i].used;
+        }
+    }
+    if (writeFHSImageData(file, &offset, sizeof(uint32_t)) < 0) return -1;
+    written += ((int64_t) header.keys + 1) * sizeof(uint32_t);
+    if (writeFHSImagePadding(file, written) < 0) return -1;
+    for (i = 0; i < hashes->used; i++) {
+        if (hashes->hashes[i].used && writeFHSImageData(file, hashes->hashes[i].users, hashes->hashes[i].used * sizeof(FHSHashJudgeUsers)) < 0) return -1;
+    }
+    return 0;
+}
+#endif
+
+#ifdef _POSIX_MAPPED_FILES
+// Is a mapped image sound enough to use? HSSearch needs the keys in order, and HSUsers and
+// HSTouch use the offsets and each user's category and document without any further checks.
+static int checkHSImage(const FHS_IMAGE_HEADERv1 *header, const uint32_t *totalDocuments, const HTMLFeature *keys, const uint32_t *offsets, const FHSHashJudgeUsers *pool)
+{
+    uint32_t i;
+
+    // offsets[header->keys] is already known to be header->pool
+    for (i = 0; i < header->keys; i++) {
+        if (offsets[i] > offsets[i + 1] || (i && keys[i - 1] >= keys[i])) return 0;
+    }
+    for (i = 0; i < header->pool; i++) {
+        if (pool[i].category >= header->categories || pool[i].document >= totalDocuments[pool[i].category]) return 0;
+    }
+    return 1;
+}
+#endif
+
+// Map a compiled image made by fhs_makeimage. Every process mapping the same image shares
+// the pages, and there is nothing to read, merge or sort.
+int loadHyperSpaceImage(const char *image_name)
+{
+#ifndef _POSIX_MAPPED_FILES
+    ci_debug_printf(1, "loadHyperSpaceImage: %s cannot be loaded, this system lacks mmap\n", image_name);
+    return -1;
+#else
+    int image_file;
+    struct stat st;
+    char *address, *names, *name_end;
+    FHS_IMAGE_HEADERv1 *header;
+    FHSTextCategory *tempCategory = NULL;
+    int32_t *totalFeatures;
+    uint32_t *totalDocuments, *documentKnownHashes;
+    int64_t size, documents = 0, names_pos, counts_pos, keys_pos, offsets_pos, pool_pos;
+    uint32_t i;
+
+    if (HSJudgeHashList.image || HSJudgeHashList.used || HSCategories.used) {
+        ci_debug_printf(1, "loadHyperSpaceImage: %s cannot be loaded on top of other fhs data\n", image_name);
+        return -1;
+    }
+    if ((image_file = open(image_name, O_RDONLY)) < 0) {
+        ci_debug_printf(1, "loadHyperSpaceImage: unable to open %s: %s\n", image_name, strerror(errno));
+        return -1;
+    }
+    if (fstat(image_file, &st) < 0 || st.st_size < (off_t) sizeof(FHS_IMAGE_HEADERv1)) {
+        ci_debug_printf(1, "loadHyperSpaceImage: %s is not a fhs image\n", image_name);
+        close(image_file);
+        return -1;
+    }
+    size = st.st_size;
+    address = mmap(0, size, PROT_READ, MAP_SHARED, image_file, 0);
+    close(image_file);
+    if (address == MAP_FAILED) {
+        ci_debug_printf(1, "loadHyperSpaceImage: failed to mmap %s: %s\n", image_name, strerror(errno));
+        return -1;
+    }
+
+    header = (FHS_IMAGE_HEADERv1 *) address;
+    if (memcmp(header->ID, "FHI", 4) == 0 && header->version < FHS_IMAGE_FORMAT_VERSION) {
+        ci_debug_printf(1, "loadHyperSpaceImage: %s is an old fhs image, make it again with fhs_makeimage\n", image_name);
+        goto BAD_IMAGE;
+    }
+    if (memcmp(header->ID, "FHI", 4) != 0 || header->version != FHS_IMAGE_FORMAT_VERSION ||
+            header->UBM != UNICODE_BYTE_MARK || header->WCS != sizeof(wchar_t)) {
+        ci_debug_printf(1, "loadHyperSpaceImage: %s is not a fhs image for this system\n", image_name);
+        goto BAD_IMAGE;
+    }
+    names_pos = FHS_IMAGE_ALIGN(FHS_IMAGE_ALIGN(sizeof(FHS_IMAGE_HEADERv1) + header->categories * sizeof(int32_t)) + header->categories * sizeof(uint32_t));
+    counts_pos = FHS_IMAGE_ALIGN(names_pos + header->namesSize);
+    keys_pos = FHS_IMAGE_ALIGN(counts_pos + (int64_t) header->documents * sizeof(uint32_t));
+    offsets_pos = keys_pos + (int64_t) header->keys * sizeof(HTMLFeature);
+    pool_pos = FHS_IMAGE_ALIGN(offsets_pos + ((int64_t) header->keys + 1) * sizeof(uint32_t));
+    if (pool_pos + (int64_t) header->pool * sizeof(FHSHashJudgeUsers) > size ||
+            ((uint32_t *) (address + offsets_pos))[header->keys] != header->pool) {
+        ci_debug_printf(1, "loadHyperSpaceImage: %s is truncated or corrupted\n", image_name);
+        goto BAD_IMAGE;
+    }
+    totalFeatures = (int32_t *) (address + sizeof(FHS_IMAGE_HEADERv1));
+    totalDocuments = (uint32_t *) (address + FHS_IMAGE_ALIGN(sizeof(FHS_IMAGE_HEADERv1) + header->categories * sizeof(int32_t)));
+    for (i = 0; i < header->categories; i++) documents += totalDocuments[i];
+    if (documents != header->documents) {
+        ci_debug_printf(1, "loadHyperSpaceImage: %s has corrupted document counts\n", image_name);
+        goto BAD_IMAGE;
+    }
+    if (!checkHSImage(header, totalDocuments, (HTMLFeature *) (address + keys_pos), (uint32_t *) (address + offsets_pos), (FHSHashJudgeUsers *) (address + pool_pos))) {
+        ci_debug_printf(1, "loadHyperSpaceImage: %s has corrupted hashes\n", image_name);
+        goto BAD_IMAGE;
+    }
+
+    if (header->categories > HSCategories.slots) {
+        tempCategory = realloc(HSCategories.categories, header->categories * sizeof(FHSTextCategory));
+        if (tempCategory == NULL) {
+            ci_debug_printf(1, "loadHyperSpaceImage: unable to allocate memory for categories\n");
+            goto BAD_IMAGE;
+        }
+        HSCategories.categories = tempCategory;
+        HSCategories.slots = header->categories;
+    }
+    names = address + names_pos;
+    name_end = names + header->namesSize;
+    documentKnownHashes = (uint32_t *) (address + counts_pos);
+    for (i = 0; i < header->categories; i++) {
+        if (names >= name_end || memchr(names, '\0', name_end - names) == NULL) {
+            ci_debug_printf(1, "loadHyperSpaceImage: %s has corrupted category names\n", image_name);
+            while (HSCategories.used) free(HSCategories.categories[--HSCategories.used].name);
+            goto BAD_IMAGE;
+        }
+        HSCategories.categories[i].name = strndup(names, MAX_HYPSERSPACE_CATEGORY_NAME);
+        HSCategories.categories[i].totalDocuments = totalDocuments[i];
+        HSCategories.categories[i].totalFeatures = totalFeatures[i];
+        HSCategories.categories[i].documentKnownHashes = documentKnownHashes;
+        documentKnownHashes += totalDocuments[i];
+        HSCategories.used++;
+        names += strlen(names) + 1;
+    }
+
+    HSJudgeHashList.keys = (HTMLFeature *) (address + keys_pos);
+    HSJudgeHashList.offsets = (uint32_t *) (address + offsets_pos);
+    HSJudgeHashList.pool = (FHSHashJudgeUsers *) (address + pool_pos);
+    HSJudgeHashList.hashes = NULL;
+    HSJudgeHashList.used = header->keys;
+    HSJudgeHashList.slots = header->keys;
+    HSJudgeHashList.image = address;
+    HSJudgeHashList.imageSize = size;
+    initHSSearch(&HSJudgeHashList);
+    return 1;
+
+BAD_IMAGE:
+    munmap(address, size);
+    return -1;
+#endif
+}
+
+// Exchange the contents of model with HSCategories and HSJudgeHashList, so the loading and
+// optimizing functions, which only know those, work on model. Swap again to put them back.
+void swapHSModel(FHSModel *model)
+{
+    FHSTextCategoryExt categories = HSCategories;
+    HashListExt hashes = HSJudgeHashList;
+
+    HSCategories = *model->categories;
+    HSJudgeHashList = *model->hashes;
+    *model->categories = categories;
+    *model->hashes = hashes;
+}
+
+// An empty model set to load categories into, or NULL if there is no memory for it
+FHSModel *newHSModel(void)
+{
+    FHSModel *model = malloc(sizeof(FHSModel));
+
+    if (model == NULL) return NULL;
+    model->categories = calloc(1, sizeof(FHSTextCategoryExt));
+    model->hashes = calloc(1, sizeof(HashListExt));
+    if (model->categories == NULL || model->hashes == NULL) {
+        free(model->categories);
+        free(model->hashes);
+        free(model);
+        return NULL;
+    }
+    swapHSModel(model);
+    initHyperSpaceClassifier();
+    swapHSModel(model);
+    return model;
+}
+
+void freeHSModel(FHSModel *model)
+{
+    if (model == NULL) return;
+    swapHSModel(model);
+    deinitHyperSpaceClassifier();
+    swapHSModel(model);
+    free(model->categories);
+    free(model->hashes);
+    free(model);
 }
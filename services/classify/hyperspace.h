@@ -20,7 +20,8 @@
 #define MAX_HYPSERSPACE_CATEGORY_NAME 100
 
 #define OLD_HYPERSPACE_FORMAT_VERSION 1
-#define HYPERSPACE_FORMAT_VERSION 2
+#define HYPERSPACE_16BIT_FORMAT_VERSION 2
+#define HYPERSPACE_FORMAT_VERSION 3
 #define UNICODE_BYTE_MARK 0xFEFF
 
 // Fast Hyper Space File Format Version 1 is as follows
@@ -38,38 +39,92 @@
 // Qty is the number of 64-bit hashes in the record. 8 bytes per Hash
 // END is a 128 bit all zero delimiter to allow for verifying the file
 // END is currently not written nor checked
+//
+// Version 3 is the same, except that the header Qty and the record Qty are UINT32_T,
+// so a category may have more than 65535 documents and a document more than 65535
+// hashes. Version 1 and 2 files still load. Version 2 files are added to in their own format
+// until a document does not fit, then they are rewritten as version 3.
 
 #define FHS_HEADERv1_ID_SIZE 3
 #define FHS_HEADERv1_VERSION_SIZE sizeof(uint_least16_t)
 #define FHS_HEADERv1_UBM_SIZE sizeof(uint_least16_t)
 #define FHS_HEADERv2_WCS_SIZE sizeof(uint_least16_t)
 #define FHS_HEADERv1_RECORDS_QTY_SIZE sizeof(uint_least16_t)
+#define FHS_HEADERv3_RECORDS_QTY_SIZE sizeof(uint32_t)
 #define FHS_HEADERv1_TOTAL_SIZE (FHS_HEADERv1_ID_SIZE + FHS_HEADERv1_VERSION_SIZE + FHS_HEADERv1_UBM_SIZE + FHS_HEADERv1_RECORDS_QTY_SIZE)
+#define FHS_HEADERv3_TOTAL_SIZE (FHS_HEADERv1_ID_SIZE + FHS_HEADERv1_VERSION_SIZE + FHS_HEADERv1_UBM_SIZE + FHS_HEADERv2_WCS_SIZE + FHS_HEADERv3_RECORDS_QTY_SIZE)
+#define FHS_HEADER_RECORDS_OFFSET (FHS_HEADERv1_ID_SIZE + FHS_HEADERv1_VERSION_SIZE + FHS_HEADERv1_UBM_SIZE + FHS_HEADERv2_WCS_SIZE)
 #define FHS_v1_QTY_SIZE sizeof(uint_least16_t)
+#define FHS_v3_QTY_SIZE sizeof(uint32_t)
 #define FHS_v1_HASH_SIZE sizeof(HTMLFeature)
 
 #define FHS_HEADERv1_RECORDS_QTY_MAX UINT_LEAST16_MAX
 #define FHS_v1_QTY_MAX UINT_LEAST16_MAX
+#define FHS_HEADERv3_RECORDS_QTY_MAX UINT32_MAX
+#define FHS_v3_QTY_MAX UINT32_MAX
 
 typedef struct {
     char ID[3];
     uint_least16_t version;
     uint_least16_t UBM;
     uint_least16_t WCS;
-    uint_least16_t records;
+    uint32_t records; // Whatever size the version has on disk
 } FHS_HEADERv1;
 
+// Fast Hyper Space Image File Format Version 2 is as follows
+// An image is a compiled, read only copy of HSJudgeHashList and HSCategories (see fhs_makeimage)
+// so that c-icap can mmap it instead of loading every fhs file.
+// Header
+// BYTE 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32
+//      ID      Ver UBM WCS   FLAGS CATS  RSVD  KEYS        POOL        NAMES       DOCS
+//      F H I 0
+// ID = 3 characters and a NUL, Ver, UBM, WCS are as in the FHS format
+// FLAGS is UINT16_T and currently always 0, CATS is UINT16_T, the number of categories
+// KEYS is UINT32_T, the number of hashes; POOL is UINT32_T, the number of hash users
+// NAMES is UINT32_T, the size in bytes of the category name block
+// DOCS is UINT32_T, the number of documents in all categories
+// Sections, each starting on an 8 byte boundary
+// INT32_T total features for each category
+// UINT32_T total documents for each category
+// Category names, each NUL terminated, in category order
+// DOCS UINT32_T known hash counts, category by category, document by document
+// KEYS sorted UINT64_T hashes (hashes without users, such as preload only hashes, are left out)
+// KEYS + 1 UINT32_T offsets into the pool
+// POOL FHSHashJudgeUsers
+// Version 1 had UINT16_T document totals, counts and FHSHashJudgeUsers documents, it has to be
+// made again with fhs_makeimage.
+#define FHS_IMAGE_FORMAT_VERSION 2
+#define FHS_IMAGE_ALIGN(x) (((x) + 7) & ~((int64_t) 7))
+
+typedef struct {
+    char ID[4];
+    uint16_t version;
+    uint16_t UBM;
+    uint16_t WCS;
+    uint16_t flags;
+    uint16_t categories;
+    uint16_t reserved;
+    uint32_t keys;
+    uint32_t pool;
+    uint32_t namesSize;
+    uint32_t documents;
+} FHS_IMAGE_HEADERv1;
+
 typedef struct {
     char *name;
-    uint16_t totalDocuments;
+    uint32_t totalDocuments;
     int32_t totalFeatures;
-    uint16_t *documentKnownHashes; // documents[TextCategory.totalDocuments] with the value being the number of known hashes
+    uint32_t *documentKnownHashes; // documents[TextCategory.totalDocuments] with the value being the number of known hashes
+    uint32_t firstDocument; // Global number of document 0, the documents of all categories are numbered in category order
 } FHSTextCategory;
 
 typedef struct {
     FHSTextCategory *categories;
     uint16_t used;
     uint16_t slots;
+    uint32_t documents; // Documents of all categories, the global document numbers run from 0 to this
+    uint32_t largest; // Documents of the largest category
+    mySecondaries_t secondaries; // see buildHSSecondaries
 } FHSTextCategoryExt;
 
 typedef struct __attribute__ ((__packed__))
@@ -77,23 +132,54 @@ typedef struct __attribute__ ((__packed__))
 //  uint16_t category;
 //  uint16_t document;
     uint_least16_t category;
-    uint_least16_t document;
+    uint32_t document;
 } FHSHashJudgeUsers;
 
 typedef struct __attribute__ ((__packed__))
 {
     HTMLFeature hash;
-    FHSHashJudgeUsers *users;
+    union {
+        FHSHashJudgeUsers *users;
+        const uint8_t *packed; // Where the users start in HashListExt.packed, once it is set
+    };
 //  uint16_t used;
-    uint_least16_t used;
+    uint32_t used;
 } hyperspaceFeatureExt;
 
 typedef struct  {
     hyperspaceFeatureExt *hashes;
     int32_t used;
     int32_t slots;
+    // Built by optimizeFHS once loading is done, dropped if anything else is loaded.
+    // eytzinger holds the hashes in Eytzinger (breadth first) order, 1 based, and
+    // eytzingerRank[k] is the index in hashes of eytzinger[k].
+    HTMLFeature *eytzinger;
+    uint32_t *eytzingerRank;
+    // Also built by optimizeFHS. The users of each hash are then global document numbers, sorted
+    // and coded as varint differences, in this one block instead of a users array per hash. Each
+    // hierarchy group of a hash is coded as a run of its own, starting again from 0.
+    uint8_t *packed;
+    // Set by loadHyperSpaceImage. hashes is then NULL and the users of keys[i] are
+    // pool[offsets[i]] through pool[offsets[i + 1] - 1], all inside the read only mapping image.
+    HTMLFeature *keys;
+    uint32_t *offsets;
+    FHSHashJudgeUsers *pool;
+    char *image;
+    int64_t imageSize;
+    // Prefix index and Bloom filter of hashes (or of keys for an image), rebuilt after each load
+    myRadix_t radix;
+    myBloom_t bloom;
+    // Category groups, rebuilt with them if hierarchy_groups is set
+    myHierarchy_t hierarchy;
 } HashListExt;
 
+// Categories and judge table classified together. HSModel is HSCategories and HSJudgeHashList,
+// the other model sets are swapped into them with swapHSModel to be loaded.
+typedef struct {
+    FHSTextCategoryExt *categories;
+    HashListExt *hashes;
+} FHSModel;
+
 #ifdef IN_HYPSERSPACE
 void writeFHSHeader(int file, FHS_HEADERv1 *header);
 int openFHS(const char *filename, FHS_HEADERv1 *header, int forWriting);
@@ -101,11 +187,19 @@ void writeFHSHashes(int file, FHS_HEADERv1 *header, HashList *hashes_list);
 int writeFHSHashesPreload(int file, FHS_HEADERv1 *header, HashListExt *hashes_list);
 int preLoadHyperSpace(const char *fhs_name);
 int loadHyperSpaceCategory(const char *fhs_name, const char *cat_name);
-HTMLClassification doHSPrepandClassify(HashList *toClassify);
+HTMLClassification doHSPrepandClassify(const FHSModel *model, HashList *toClassify, const char *subset);
 void initHyperSpaceClassifier(void);
 void deinitHyperSpaceClassifier(void);
+void buildHSSecondaries(void);
+void selectHSKernels(void);
 int isHyperSpace(const char *filename);
 int loadMassHSCategories(const char *fhs_dir);
+int optimizeFHS(HashListExt *hashes);
+int writeFHSImage(int file, HashListExt *hashes);
+int loadHyperSpaceImage(const char *image_name);
+FHSModel *newHSModel(void);
+void swapHSModel(FHSModel *model);
+void freeHSModel(FHSModel *model);
 #else
 extern void writeFHSHeader(int file, FHS_HEADERv1 *header);
 extern int openFHS(const char *filename, FHS_HEADERv1 *header, int forWriting);
@@ -113,11 +207,19 @@ extern int writeFHSHashes(int file, FHS_HEADERv1 *header, HashList *hashes_list)
 extern int writeFHSHashesPreload(int file, FHS_HEADERv1 *header, HashListExt *hashes_list);
 extern int preLoadHyperSpace(const char *fhs_name);
 extern int loadHyperSpaceCategory(const char *fhs_name, const char *cat_name);
-extern HTMLClassification doHSPrepandClassify(HashList *toClassify);
+extern HTMLClassification doHSPrepandClassify(const FHSModel *model, HashList *toClassify, const char *subset);
 extern void initHyperSpaceClassifier(void);
 extern void deinitHyperSpaceClassifier(void);
+extern void buildHSSecondaries(void);
+extern void selectHSKernels(void);
 extern int isHyperSpace(const char *filename);
 extern int loadMassHSCategories(const char *fhs_dir);
+extern int optimizeFHS(HashListExt *hashes);
+extern int writeFHSImage(int file, HashListExt *hashes);
+extern int loadHyperSpaceImage(const char *image_name);
+extern FHSModel *newHSModel(void);
+extern void swapHSModel(FHSModel *model);
+extern void freeHSModel(FHSModel *model);
 #endif
 
 #define HYPERSPACE_CATEGORY_INC 10
@@ -125,6 +227,7 @@ extern int loadMassHSCategories(const char *fhs_dir);
 #ifndef IN_HYPERSPACE
 extern FHSTextCategoryExt HSCategories;
 extern HashListExt HSJudgeHashList;
+extern FHSModel HSModel;
 #endif
 
 extern uint32_t HASHSEED1;
@@ -150,54 +253,3 @@ extern void (*__log_error)(void *req, const char *format,... );
 #define ci_debug_printf(i, args...) fprintf(stderr, args);
 #endif
 
-#ifdef IN_HYPERSPACE
-// Use fluxsort -- things from fluxsort.h, we don't use it.
-typedef int CMPFUNC (const void *a, const void *b);
-
-#define parity_merge_two(array, swap, x, y, ptl, ptr, pts, cmp)  \
-{  \
-	ptl = array + 0; ptr = array + 2; pts = swap + 0;  \
-	x = cmp(ptl, ptr) <= 0; y = !x; pts[x] = *ptr; ptr += y; pts[y] = *ptl; ptl += x; pts++;  \
-	*pts = cmp(ptl, ptr) <= 0 ? *ptl : *ptr;  \
-  \
-	ptl = array + 1; ptr = array + 3; pts = swap + 3;  \
-	x = cmp(ptl, ptr) <= 0; y = !x; pts--; pts[x] = *ptr; ptr -= x; pts[y] = *ptl; ptl -= y;  \
-	*pts = cmp(ptl, ptr)  > 0 ? *ptl : *ptr;  \
-}
-
-#define parity_merge_four(array, swap, x, y, ptl, ptr, pts, cmp)  \
-{  \
-	ptl = array + 0; ptr = array + 4; pts = swap;  \
-	x = cmp(ptl, ptr) <= 0; y = !x; pts[x] = *ptr; ptr += y; pts[y] = *ptl; ptl += x; pts++;  \
-	x = cmp(ptl, ptr) <= 0; y = !x; pts[x] = *ptr; ptr += y; pts[y] = *ptl; ptl += x; pts++;  \
-	x = cmp(ptl, ptr) <= 0; y = !x; pts[x] = *ptr; ptr += y; pts[y] = *ptl; ptl += x; pts++;  \
-	*pts = cmp(ptl, ptr) <= 0 ? *ptl : *ptr;  \
-  \
-	ptl = array + 3; ptr = array + 7; pts = swap + 7;  \
-	x = cmp(ptl, ptr) <= 0; y = !x; pts--; pts[x] = *ptr; ptr -= x; pts[y] = *ptl; ptl -= y;  \
-	x = cmp(ptl, ptr) <= 0; y = !x; pts--; pts[x] = *ptr; ptr -= x; pts[y] = *ptl; ptl -= y;  \
-	x = cmp(ptl, ptr) <= 0; y = !x; pts--; pts[x] = *ptr; ptr -= x; pts[y] = *ptl; ptl -= y;  \
-	*pts = cmp(ptl, ptr)  > 0 ? *ptl : *ptr;  \
-}
-
-#undef VAR
-#undef FUNC
-#undef STRUCT
-
-#define VAR hyperspaceFeatureExt
-#define FUNC(NAME) NAME##hyperspaceFeatureExt
-#define STRUCT(NAME) struct NAME##hyperspaceFeatureExt
-
-#include "quadsort.c"
-#include "fluxsort.c"
-
-static void HS_fluxsort(void *array, size_t nmemb, size_t size, CMPFUNC *cmp)
-{
-	if (nmemb < 2)
-	{
-		return;
-	}
-
-	return fluxsorthyperspaceFeatureExt(array, nmemb, cmp);
-}
-#endif
@@ -111,6 +111,47 @@ static int TEXT_SOLID_LEVEL = 5; // Lowest level to be considered a solid match
 /* Window Size */
 static int MAX_WINDOW = 4096; // This is for sliding window buffers
 
+/* Naive Bayes scoring */
+static int FNB_LOG_DOMAIN = 0; // Sum log probabilities instead of multiplying (set before OptimizeFNB)
+static int FNB_EYTZINGER = 0; // Search optimized data in Eytzinger order (set before OptimizeFNB)
+static int FNB_QUANTIZE = 0; // Store log probabilities as 8 or 16 bit codes, 0 to not quantize (set before OptimizeFNB)
+static int FNB_EARLY_EXIT = 0; // Stop scoring once the best category is certain (set before OptimizeFNB)
+static double FNB_PRUNE = 0; // Drop hashes whose category scores are closer than this (set before OptimizeFNB)
+
+/* Text categories to score, all of them if NULL (see categoryInSubset) */
+static char *CATEGORY_SUBSET = NULL;
+
+/* Engine cascade, see TextCascade */
+#define CASCADE_OFF 0 // Run both engines
+#define CASCADE_NB_FIRST 1
+#define CASCADE_HS_FIRST 2
+static int TEXT_CASCADE = CASCADE_OFF;
+static double CASCADE_LEVEL = 0; // Run the second engine when the first is below this level
+static char *CASCADE_WATCH = NULL; // or when its category is one of these (see categoryInSubset)
+
+/* Model sets picked by the script of the text, see guessScript. Text in no set's scripts, or
+   with no letters, is classified with NBModel and HSModel. */
+#define MAX_MODEL_SETS 16
+typedef struct {
+    char *scripts; // Comma separated ISO 15924 codes, see categoryInSubset
+    FBCModel *nb;
+    FHSModel *hs;
+} textModelSet_t;
+static textModelSet_t MODEL_SETS[MAX_MODEL_SETS];
+static int model_sets = 0;
+static textModelSet_t *LOADING_MODEL_SET = NULL; // Where loading directives load, NULL for the default models
+
+/* Naive Bayes online learning */
+static char *FNB_LEARN_LOG = NULL; // Learning log shared by all children, learning is off without it
+static char *FNB_LEARN_KEY = NULL; // learnkey= a request must give to be learned
+static FBCHashList FNBLearnCounts; // Unoptimized counts the next snapshot is optimized from
+static int64_t FNBLearnOffset = 0; // How much of FNB_LEARN_LOG is in FNBLearnCounts
+static time_t FNBLearnChecked = 0; // When FNB_LEARN_LOG was last checked for new documents
+static int FNBLearnBuilding = 0; // A snapshot is being built
+static int FNBLearnThreadStarted = 0;
+static ci_thread_t FNBLearnThread;
+static ci_thread_mutex_t learn_mtx;
+
 /* Locking */
 ci_thread_rwlock_t textclassify_rwlock;
 ci_thread_mutex_t memmanage_mtx;
@@ -157,9 +198,18 @@ int cfg_ClassifyFileTypes(const char *directive, const char **argv, void *setdat
 int cfg_DoTextPreload(const char *directive, const char **argv, void *setdata);
 int cfg_AddTextCategory(const char *directive, const char **argv, void *setdata);
 int cfg_AddTextCategoryDirectoryHS(const char *directive, const char **argv, void *setdata);
+int cfg_TextCategoryImageHS(const char *directive, const char **argv, void *setdata);
 int cfg_AddTextCategoryDirectoryNB(const char *directive, const char **argv, void *setdata);
+int cfg_TextCategoryImageNB(const char *directive, const char **argv, void *setdata);
 int cfg_TextHashSeeds(const char *directive, const char **argv, void *setdata);
 int cfg_OptimizeFNB(const char *directive, const char **argv, void *setdata);
+int cfg_OptimizeFHS(const char *directive, const char **argv, void *setdata);
+int cfg_LearnFNB(const char *directive, const char **argv, void *setdata);
+int cfg_PruneFNB(const char *directive, const char **argv, void *setdata);
+int cfg_TextCategorySubset(const char *directive, const char **argv, void *setdata);
+int cfg_KernelLevel(const char *directive, const char **argv, void *setdata);
+int cfg_TextModelScript(const char *directive, const char **argv, void *setdata);
+int cfg_TextCascade(const char *directive, const char **argv, void *setdata);
 int cfg_ClassifyTmpDir(const char *directive, const char **argv, void *setdata);
 int cfg_TmpDir(const char *directive, const char **argv, void *setdata);
 int cfg_TextSecondary(const char *directive, const char **argv, void *setdata);
@@ -173,6 +223,9 @@ char *findCharset(const char *input, int64_t);
 int make_wchar(ci_request_t *req);
 int make_wchar_from_buf(ci_request_t *req, ci_membuf_t *input);
 static void addTextErrorHeaders(ci_request_t *req, int error, char *extra_info);
+static void checkBayesLearning(int learned);
+static void swapLoadingModelSet(void);
+static int cascadeNeedsSecond(const HTMLClassification *first);
 /*External functions*/
 extern char *strcasestr(const char *haystack, const char *needle);
 
@@ -222,10 +275,27 @@ static struct ci_conf_entry conf_variables[] = {
     /*     {"ExternalTextMimeType", NULL, cfg_ExternalTextConversion, NULL}, // Mime type handling not yet implemented */
     {"TextPreload", NULL, cfg_DoTextPreload, NULL},
     {"TextCategory", NULL, cfg_AddTextCategory, NULL},
+    {"LoadThreads", &load_threads, ci_cfg_set_int, NULL},
+    {"RadixIndexBits", &radix_bits, ci_cfg_set_int, NULL},
+    {"HierarchyGroups", &hierarchy_groups, ci_cfg_set_int, NULL},
+    {"TextCategorySubset", NULL, cfg_TextCategorySubset, NULL},
+    {"KernelLevel", NULL, cfg_KernelLevel, NULL},
+    {"TextModelScript", NULL, cfg_TextModelScript, NULL},
+    {"TextCascade", NULL, cfg_TextCascade, NULL},
     {"TextCategoryDirectoryHS", NULL, cfg_AddTextCategoryDirectoryHS, NULL},
+    {"TextCategoryImageHS", NULL, cfg_TextCategoryImageHS, NULL},
     {"TextCategoryDirectoryNB", NULL, cfg_AddTextCategoryDirectoryNB, NULL},
+    {"TextCategoryImageNB", NULL, cfg_TextCategoryImageNB, NULL},
     {"TextHashSeeds", NULL, cfg_TextHashSeeds, NULL},
+    {"LogDomainFNB", &FNB_LOG_DOMAIN, ci_cfg_onoff, NULL},
+    {"EytzingerFNB", &FNB_EYTZINGER, ci_cfg_onoff, NULL},
+    {"QuantizeFNB", &FNB_QUANTIZE, ci_cfg_set_int, NULL},
+    {"EarlyExitFNB", &FNB_EARLY_EXIT, ci_cfg_onoff, NULL},
+    {"PruneFNB", NULL, cfg_PruneFNB, NULL},
+    {"LearnLogFNB", NULL, cfg_LearnFNB, NULL},
+    {"LearnKeyFNB", NULL, cfg_LearnFNB, NULL},
     {"OptimizeFNB", NULL, cfg_OptimizeFNB, NULL},
+    {"OptimizeFHS", NULL, cfg_OptimizeFHS, NULL},
     {"MaxObjectSize", &MAX_OBJECT_SIZE, ci_cfg_size_off, NULL},
     {"MaxWindowSize", &MAX_WINDOW, ci_cfg_size_off, NULL},
     {"Allow204Responces", &ALLOW204, ci_cfg_onoff, NULL},
@@ -379,6 +449,7 @@ int srvclassify_init_service(ci_service_xdata_t *srv_xdata,
     ci_thread_rwlock_init(&textclassify_rwlock);
     ci_thread_rwlock_wrlock(&textclassify_rwlock);
     ci_thread_mutex_init(&memmanage_mtx);
+    ci_thread_mutex_init(&learn_mtx);
 
     magic_db = server_conf->MAGIC_DB;
     classifytypes = (int *) malloc(ci_magic_types_num(magic_db) * sizeof(int));
@@ -444,6 +515,10 @@ int srvclassify_post_init_service(ci_service_xdata_t *srv_xdata,
 #endif
     set_istag(srv_classify_xdata);
 
+    // FNB early exit must not move a level across any of these, see setBayesExitLevels
+    double levels[3] = { TEXT_AMBIGUOUS_LEVEL, TEXT_SOLID_LEVEL, CASCADE_LEVEL };
+    setBayesExitLevels(levels, TEXT_CASCADE == CASCADE_NB_FIRST ? 3 : 2);
+
     if (CI_BODY_MAX_MEM > MAX_MEM_CLASS_SIZE) MAX_MEM_CLASS_SIZE = CI_BODY_MAX_MEM - 1;
     if (MAX_OBJECT_SIZE > INT_MAX) MAX_OBJECT_SIZE = INT_MAX;
     return ret;
@@ -451,6 +526,8 @@ int srvclassify_post_init_service(ci_service_xdata_t *srv_xdata,
 
 void srvclassify_close_service()
 {
+    int started;
+
 #if defined(HAVE_OPENCV) || defined(HAVE_OPENCV_22X) || defined(HAVE_OPENCV_23X)
     closeImageClassification();
     freeReferrerTable();
@@ -459,7 +536,30 @@ void srvclassify_close_service()
     ci_object_pool_unregister(HASHDATA_POOL);
     ci_object_pool_unregister(CLASSIFYREQDATA_POOL);
 
+    // The builder takes learn_mtx on its way out, so it must be joined without holding it
+    ci_thread_mutex_lock(&learn_mtx);
+    started = FNBLearnThreadStarted;
+    FNBLearnThreadStarted = 0;
+    ci_thread_mutex_unlock(&learn_mtx);
+    if (started) ci_thread_join(FNBLearnThread);
+
     ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    freeFBCHashList(&FNBLearnCounts);
+    if (FNB_LEARN_LOG) free(FNB_LEARN_LOG);
+    FNB_LEARN_LOG = NULL;
+    if (FNB_LEARN_KEY) free(FNB_LEARN_KEY);
+    FNB_LEARN_KEY = NULL;
+    if (CATEGORY_SUBSET) free(CATEGORY_SUBSET);
+    CATEGORY_SUBSET = NULL;
+    for (int i = 0; i < model_sets; i++) {
+        free(MODEL_SETS[i].scripts);
+        freeBayesModel(MODEL_SETS[i].nb);
+        freeHSModel(MODEL_SETS[i].hs);
+    }
+    model_sets = 0;
+    LOADING_MODEL_SET = NULL;
+    if (CASCADE_WATCH) free(CASCADE_WATCH);
+    CASCADE_WATCH = NULL;
     if (CLASSIFY_TMP_DIR) free(CLASSIFY_TMP_DIR);
     if (classifytypes) free(classifytypes);
     classifytypes = NULL;
@@ -529,6 +629,8 @@ void *srvclassify_init_request_data(ci_request_t *req)
             data->args.enable204 = 0;
         data->args.forcescan = 0;
         data->args.sizelimit = 1;
+        data->args.learn[0] = '\0';
+        data->args.categories[0] = '\0';
 
         if (req->args[0] != '\0') {
             ci_debug_printf(5, "service arguments:%s\n", req->args);
@@ -810,7 +912,13 @@ int categorize_text(ci_request_t *req)
     char type[20];
     regexHead myRegexHead = {.head = NULL, .tail = NULL, .dirty = 0, . main_memory = NULL, .arrays = NULL, .lastarray = NULL};
     HashList myHashes;
-    HTMLClassification HSclassification, NBclassification;
+    HTMLClassification HSclassification = { .primary_name = NULL, .primary_probability = 0.0, .primary_probScaled = 0.0, .secondary_name = NULL, .secondary_probability = 0.0, .secondary_probScaled = 0.0 };
+    HTMLClassification NBclassification = HSclassification;
+    const char *subset, *script;
+    const char *engines = "HS NB";
+    const FBCModel *NBmodel = &NBModel;
+    const FHSModel *HSmodel = &HSModel;
+    int learn, learned = 0;
 
     // sanity check
     if (!data->uncompressedbody) {
@@ -833,16 +941,52 @@ int categorize_text(ci_request_t *req)
     myHashes.used = 0;
     computeOSBHashes(&myRegexHead, HASHSEED1, HASHSEED2, &myHashes);
 
-    HSclassification = doHSPrepandClassify(&myHashes);
-    NBclassification = doBayesPrepandClassify(&myHashes);
+    if (model_sets && (script = guessScript(&myRegexHead)) != NULL) {
+        for (int i = 0; i < model_sets; i++) {
+            if (categoryInSubset(MODEL_SETS[i].scripts, script)) {
+                NBmodel = MODEL_SETS[i].nb;
+                HSmodel = MODEL_SETS[i].hs;
+                ci_debug_printf(10, "Classifying %s text with the model set for %s\n", script, MODEL_SETS[i].scripts);
+                break;
+            }
+        }
+    }
+
+    subset = data->args.categories[0] != '\0' ? data->args.categories : CATEGORY_SUBSET;
+    if (TEXT_CASCADE == CASCADE_NB_FIRST) {
+        NBclassification = doBayesPrepandClassify(NBmodel, &myHashes, subset);
+        engines = "NB";
+        if (cascadeNeedsSecond(&NBclassification)) {
+            HSclassification = doHSPrepandClassify(HSmodel, &myHashes, subset);
+            engines = "NB HS";
+        }
+    } else if (TEXT_CASCADE == CASCADE_HS_FIRST) {
+        HSclassification = doHSPrepandClassify(HSmodel, &myHashes, subset);
+        engines = "HS";
+        if (cascadeNeedsSecond(&HSclassification)) {
+            NBclassification = doBayesPrepandClassify(NBmodel, &myHashes, subset);
+            engines = "HS NB";
+        }
+    } else {
+        HSclassification = doHSPrepandClassify(HSmodel, &myHashes, subset);
+        NBclassification = doBayesPrepandClassify(NBmodel, &myHashes, subset);
+    }
+
+    // Only the default models learn, so text routed to a TextModelScript model set is not learned.
+    learn = data->args.learn[0] != '\0' && FNB_LEARN_LOG && NBmodel == &NBModel;
 
-    ci_object_pool_free(myHashes.hashes);
     freeRegexHead(&myRegexHead);
     data->uncompressedbody->buf = NULL; // This was freed who knows how many times in the classification, avoid double free
 
     // modify headers
     if (!ci_http_response_headers(req))
         ci_http_response_create(req, 1, 1);
+    if (TEXT_CASCADE != CASCADE_OFF) {
+        snprintf(reply, CI_MAX_PATH, "X-TEXT-ENGINES: %s", engines);
+        reply[CI_MAX_PATH]='\0';
+        ci_http_response_add_header(req, reply);
+        ci_debug_printf(10, "Added header: %s\n", reply);
+    }
     if (HSclassification.primary_name != NULL) {
         if (HSclassification.primary_probScaled >= (float) TEXT_AMBIGUOUS_LEVEL && HSclassification.primary_probScaled < (float) TEXT_SOLID_LEVEL) strcpy(type,"AMBIGUOUS");
         else if (HSclassification.primary_probScaled >= (float) TEXT_SOLID_LEVEL) strcpy(type, "SOLID");
@@ -920,9 +1064,102 @@ int categorize_text(ci_request_t *req)
     // Release Read Lock
     ci_thread_rwlock_unlock(&textclassify_rwlock);
 
+    // Only the log is written here, the model changes when a snapshot learned from it is swapped in.
+    // It is written without the read lock, so waiting on another child's lock of the log never
+    // holds up the snapshot swap, or the readers behind it.
+    if (learn && writeBayesLearnLog(FNB_LEARN_LOG, data->args.learn, &myHashes) == 0) {
+        snprintf(reply, CI_MAX_PATH, "X-TEXT-LEARNED-NB: %s", data->args.learn);
+        reply[CI_MAX_PATH]='\0';
+        ci_http_response_add_header(req, reply);
+        ci_debug_printf(10, "Added header: %s\n", reply);
+        learned = 1;
+    }
+    ci_object_pool_free(myHashes.hashes);
+
+    if (FNB_LEARN_LOG) checkBayesLearning(learned);
+
     return CI_OK;
 }
 
+// Build a new optimized snapshot of the FNB data from the documents added to the learning log
+// and swap it in. The old snapshot is freed outside of the lock, so classification only ever
+// waits for the swap itself.
+static void *buildBayesSnapshot(void *unused)
+{
+    FBCHashList snapshot;
+    int32_t *newFeatures;
+    int applied;
+    uint16_t i;
+
+    newFeatures = calloc(NBCategories.used ? NBCategories.used : 1, sizeof(int32_t));
+    if (newFeatures == NULL) goto DONE;
+    applied = applyBayesLearnLog(FNB_LEARN_LOG, &FNBLearnOffset, &FNBLearnCounts, newFeatures);
+    if (applied <= 0 || copyFBCCounts(&snapshot, &FNBLearnCounts) != 0) {
+        free(newFeatures);
+        goto DONE;
+    }
+    snapshot.FBC_LOG_DOMAIN = NBJudgeHashList.FBC_LOG_DOMAIN;
+    snapshot.FBC_EYTZINGER = NBJudgeHashList.FBC_EYTZINGER;
+    snapshot.FBC_QUANTIZE = NBJudgeHashList.FBC_QUANTIZE;
+    snapshot.FBC_EARLY_EXIT = NBJudgeHashList.FBC_EARLY_EXIT;
+    snapshot.FBC_PRUNE = NBJudgeHashList.FBC_PRUNE;
+    optimizeFBC(&snapshot);
+
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    swapBayesSnapshot(&snapshot);
+    for (i = 0; i < NBCategories.used; i++)
+        NBCategories.categories[i].totalFeatures += newFeatures[i];
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
+
+    freeFBCHashList(&snapshot);
+    free(newFeatures);
+    ci_debug_printf(3, "Learned %d FNB documents, learning log now at %"PRId64"\n", applied, FNBLearnOffset);
+
+DONE:
+    ci_thread_mutex_lock(&learn_mtx);
+    FNBLearnBuilding = 0;
+    ci_thread_mutex_unlock(&learn_mtx);
+    return NULL;
+}
+
+// Is the result of the first engine of the cascade too weak, or in a watched category, so the
+// second engine must run as well? The first engine not classifying at all counts as weak.
+static int cascadeNeedsSecond(const HTMLClassification *first)
+{
+    if (first->primary_name == NULL || first->primary_probScaled < CASCADE_LEVEL) return 1;
+    return CASCADE_WATCH && categoryInSubset(CASCADE_WATCH, first->primary_name);
+}
+
+// Put the model set TextModelScript is loading into in place of the default models, where the
+// loading functions look, or put the default models back. The caller holds the write lock.
+static void swapLoadingModelSet(void)
+{
+    if (LOADING_MODEL_SET == NULL) return;
+    swapBayesModel(LOADING_MODEL_SET->nb);
+    swapHSModel(LOADING_MODEL_SET->hs);
+}
+
+// Start building a snapshot if the learning log has grown. Other children write to the same
+// log, so unless this request was just learned it is checked at most once a second.
+static void checkBayesLearning(int learned)
+{
+    struct stat st;
+    time_t now = time(NULL);
+
+    ci_thread_mutex_lock(&learn_mtx);
+    if (!FNBLearnBuilding && (learned || FNBLearnChecked != now)) {
+        FNBLearnChecked = now;
+        if (stat(FNB_LEARN_LOG, &st) == 0 && st.st_size > FNBLearnOffset) {
+            // FNBLearnBuilding is 0, so the last builder is past taking learn_mtx and this cannot wait on us
+            if (FNBLearnThreadStarted) ci_thread_join(FNBLearnThread);
+            FNBLearnBuilding = 1;
+            FNBLearnThreadStarted = (ci_thread_create(&FNBLearnThread, buildBayesSnapshot, NULL) == 0);
+            if (!FNBLearnThreadStarted) FNBLearnBuilding = 0;
+        }
+    }
+    ci_thread_mutex_unlock(&learn_mtx);
+}
+
 int categorize_external_text(ci_request_t *req, int classification_type)
 {
     FILE *conversion_in;
@@ -1519,9 +1756,24 @@ void freeReferrerTable(void)
 }
 #endif
 
+// Value of argument name in args, or NULL. Only a name at the start of args or right after an
+// '&' counts, so no other argument's value can stand in for it.
+static char *findArg(char *args, const char *name)
+{
+    size_t len = strlen(name);
+    char *str = args;
+
+    while (str) {
+        if (strncmp(str, name, len) == 0 && str[len] == '=') return str + len + 1;
+        if ((str = strchr(str, '&'))) str++;
+    }
+    return NULL;
+}
+
 /***************************************************************************************/
 /* Parse arguments function -
-   Current arguments: allow204=on|off, force=on, sizelimit=off
+   Current arguments: allow204=on|off, force=on, sizelimit=off, learn=CATEGORY, learnkey=KEY,
+   categories=CATEGORY,CATEGORY,...
 */
 void srvclassify_parse_args(classify_req_data_t *data, char *args)
 {
@@ -1540,6 +1792,19 @@ void srvclassify_parse_args(classify_req_data_t *data, char *args)
         if (strncmp(str + 10, "off", 3) == 0)
             data->args.sizelimit = 0;
     }
+    // learn=CATEGORY is only honored with the configured learnkey=
+    if ((str = findArg(args, "learnkey")) && FNB_LEARN_KEY) {
+        if (strncmp(str, FNB_LEARN_KEY, strlen(FNB_LEARN_KEY)) == 0
+                && (str[strlen(FNB_LEARN_KEY)] == '\0' || str[strlen(FNB_LEARN_KEY)] == '&')
+                && (str = findArg(args, "learn")) && *str != '\0' && *str != '&') {
+            snprintf(data->args.learn, sizeof(data->args.learn), "%.*s", (int) strcspn(str, "&"), str);
+            data->args.forcescan = 1;
+        } else ci_debug_printf(3, "Refusing to learn a document, learnkey does not match\n");
+    }
+    // categories= replaces TextCategorySubset for this request, categories=* scores them all
+    if ((str = findArg(args, "categories")) && *str != '\0' && *str != '&') {
+        snprintf(data->args.categories, sizeof(data->args.categories), "%.*s", (int) strcspn(str, "&"), str);
+    }
 }
 
 /*************************************************************************************/
@@ -1647,10 +1912,12 @@ int cfg_DoTextPreload(const char *directive, const char **argv, void *setdata)
     }
     ci_debug_printf(1, "BE PATIENT -- Preloading Text Classification File: %s\n", argv[0]);
     ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    swapLoadingModelSet();
     if (isHyperSpace(argv[0]))
         ret = preLoadHyperSpace(argv[0]);
     else if (isBayes(argv[0]))
         ret = preLoadBayes(argv[0]);
+    swapLoadingModelSet();
     ci_thread_rwlock_unlock(&textclassify_rwlock);
     return ret;
 }
@@ -1665,10 +1932,12 @@ int cfg_AddTextCategory(const char *directive, const char **argv, void *setdata)
     }
     ci_debug_printf(1, "BE PATIENT -- Loading and optimizing Text Category: %s from File: %s\n", argv[0], argv[1]);
     ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    swapLoadingModelSet();
     if (isHyperSpace(argv[1]))
         val = loadHyperSpaceCategory(argv[1], argv[0]);
     else if (isBayes(argv[1]))
         val = loadBayesCategory(argv[1], argv[0]);
+    swapLoadingModelSet();
     ci_thread_rwlock_unlock(&textclassify_rwlock);
     return val;
 }
@@ -1683,11 +1952,30 @@ int cfg_AddTextCategoryDirectoryHS(const char *directive, const char **argv, voi
     }
     ci_debug_printf(1, "BE PATIENT -- Mass Loading and optimizing Text Categories from directory: %s\n", argv[0]);
     ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    swapLoadingModelSet();
     val = loadMassHSCategories(argv[0]);
+    swapLoadingModelSet();
     ci_thread_rwlock_unlock(&textclassify_rwlock);
     return val;
 }
 
+int cfg_TextCategoryImageHS(const char *directive, const char **argv, void *setdata)
+{
+    int val = 0;
+    if (argv == NULL || argv[0] == NULL) {
+        ci_debug_printf(1, "Missing arguments in directive:%s\n", directive);
+        ci_debug_printf(1, "Format: %s FHS_IMAGE_FILE\n", directive);
+        return val;
+    }
+    ci_debug_printf(1, "Mapping Text Categories from FHS image: %s\n", argv[0]);
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    swapLoadingModelSet();
+    val = loadHyperSpaceImage(argv[0]);
+    swapLoadingModelSet();
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
+    return val > 0 ? 1 : 0;
+}
+
 int cfg_AddTextCategoryDirectoryNB(const char *directive, const char **argv, void *setdata)
 {
     int val = 0;
@@ -1698,11 +1986,32 @@ int cfg_AddTextCategoryDirectoryNB(const char *directive, const char **argv, voi
     }
     ci_debug_printf(1, "BE PATIENT -- Mass Loading and optimizing Text Categories from directory: %s\n", argv[0]);
     ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    swapLoadingModelSet();
     val = loadMassBayesCategories(argv[0]);
+    swapLoadingModelSet();
     ci_thread_rwlock_unlock(&textclassify_rwlock);
     return val;
 }
 
+int cfg_TextCategoryImageNB(const char *directive, const char **argv, void *setdata)
+{
+    int val = 0;
+    if (argv == NULL || argv[0] == NULL) {
+        ci_debug_printf(1, "Missing arguments in directive:%s\n", directive);
+        ci_debug_printf(1, "Format: %s FNB_IMAGE_FILE\n", directive);
+        return val;
+    }
+    ci_debug_printf(1, "Mapping Text Categories from FNB image: %s\n", argv[0]);
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    swapLoadingModelSet();
+    NBJudgeHashList.FBC_EYTZINGER = FNB_EYTZINGER;
+    NBJudgeHashList.FBC_EARLY_EXIT = FNB_EARLY_EXIT;
+    val = loadBayesImage(argv[0]);
+    swapLoadingModelSet();
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
+    return val > 0 ? 1 : 0;
+}
+
 int cfg_TextHashSeeds(const char *directive, const char **argv, void *setdata)
 {
     if (argv == NULL || argv[0] == NULL || argv[1] == NULL) {
@@ -1754,17 +2063,237 @@ int cfg_TextSecondary(const char *directive, const char **argv, void *setdata)
 
     ci_debug_printf(1, "Setting parameter: %s (PRIMARY_CATEGORY_REGEX: %s SECONDARY_CATEGORY_REGEX: %s BIDIRECTIONAL: %s)\n", directive, argv[0], argv[1], bidirectional ? "TRUE" : "FALSE" );
     number_secondaries++;
+    // Categories loaded later resolve the secondaries as they are loaded
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    buildBayesSecondaries();
+    buildHSSecondaries();
+    for (int i = 0; i < model_sets; i++) {
+        swapBayesModel(MODEL_SETS[i].nb);
+        swapHSModel(MODEL_SETS[i].hs);
+        buildBayesSecondaries();
+        buildHSSecondaries();
+        swapBayesModel(MODEL_SETS[i].nb);
+        swapHSModel(MODEL_SETS[i].hs);
+    }
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
     return 1;
 }
 
 int cfg_OptimizeFNB(const char *directive, const char **argv, void *setdata)
 {
+    int applied;
+
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    swapLoadingModelSet();
+    NBJudgeHashList.FBC_LOG_DOMAIN = FNB_LOG_DOMAIN;
+    NBJudgeHashList.FBC_EYTZINGER = FNB_EYTZINGER;
+    NBJudgeHashList.FBC_QUANTIZE = FNB_QUANTIZE;
+    NBJudgeHashList.FBC_EARLY_EXIT = FNB_EARLY_EXIT;
+    NBJudgeHashList.FBC_PRUNE = FNB_PRUNE;
+    // Only the default models learn, the model sets of TextModelScript are left as loaded
+    if (FNB_LEARN_LOG && LOADING_MODEL_SET == NULL && NBJudgeHashList.FBC_LOCKED) {
+        ci_debug_printf(1, "Learning needs FNB data loaded from files, not an image. Learning is disabled\n");
+        free(FNB_LEARN_LOG);
+        FNB_LEARN_LOG = NULL;
+    } else if (FNB_LEARN_LOG && LOADING_MODEL_SET == NULL) {
+        // Catch up with what was learned before we started, then keep the counts to learn more
+        FNBLearnOffset = 0;
+        applied = applyBayesLearnLog(FNB_LEARN_LOG, &FNBLearnOffset, &NBJudgeHashList, NULL);
+        if (applied > 0) ci_debug_printf(1, "Learned %d FNB documents from %s\n", applied, FNB_LEARN_LOG);
+        if (applied < 0 || copyFBCCounts(&FNBLearnCounts, &NBJudgeHashList) != 0) {
+            ci_debug_printf(1, "Unable to use learning log %s. Learning is disabled\n", FNB_LEARN_LOG);
+            free(FNB_LEARN_LOG);
+            FNB_LEARN_LOG = NULL;
+        }
+    }
     optimizeFBC(&NBJudgeHashList);
+    swapLoadingModelSet();
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
 
     ci_debug_printf(1, "Optimizing FBC Data\n");
     return 1;
 }
 
+int cfg_LearnFNB(const char *directive, const char **argv, void *setdata)
+{
+    char **setting = (strcmp(directive, "LearnKeyFNB") == 0 ? &FNB_LEARN_KEY : &FNB_LEARN_LOG);
+    if (argv == NULL || argv[0] == NULL) {
+        ci_debug_printf(1, "Missing arguments in directive:%s\n", directive);
+        return 0;
+    }
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    if (*setting) free(*setting);
+    *setting = myStrDup(argv[0]);
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
+    return 1;
+}
+
+// Join argv from first on into buf, which holds MAX_CATEGORY_SUBSET characters, as the same
+// comma separated list the categories= service argument takes. Returns 0 if it does not fit.
+static int joinDirectiveArgs(const char *directive, const char **argv, int first, char *buf)
+{
+    size_t length = 0;
+    int i;
+
+    buf[0] = '\0';
+    for (i = first; argv[i] != NULL; i++) {
+        length += snprintf(buf + length, MAX_CATEGORY_SUBSET + 1 - length, "%s%s", i > first ? "," : "", argv[i]);
+        if (length > MAX_CATEGORY_SUBSET) {
+            ci_debug_printf(1, "%s is limited to %d characters\n", directive, MAX_CATEGORY_SUBSET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int cfg_TextCategorySubset(const char *directive, const char **argv, void *setdata)
+{
+    char subset[MAX_CATEGORY_SUBSET + 1];
+    if (argv == NULL || argv[0] == NULL) {
+        ci_debug_printf(1, "Missing arguments in directive:%s\n", directive);
+        return 0;
+    }
+    if (!joinDirectiveArgs(directive, argv, 0, subset)) return 0;
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    if (CATEGORY_SUBSET) free(CATEGORY_SUBSET);
+    CATEGORY_SUBSET = myStrDup(subset);
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
+    return 1;
+}
+
+int cfg_KernelLevel(const char *directive, const char **argv, void *setdata)
+{
+    int level;
+    if (argv == NULL || argv[0] == NULL) {
+        ci_debug_printf(1, "Missing arguments in directive:%s\n", directive);
+        return 0;
+    }
+    if ((level = parseKernelLevel(argv[0])) < KERNEL_AUTO) {
+        ci_debug_printf(1, "%s needs one of auto, scalar, avx2 or avx512, not %s\n", directive, argv[0]);
+        return 0;
+    }
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    kernel_level = level;
+    selectHTMLKernels();
+    selectBayesKernels();
+    selectHSKernels();
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
+    ci_debug_printf(1, "Setting parameter: %s (%s, using %s)\n", directive, argv[0], kernelLevelName(kernelLevel()));
+    return 1;
+}
+
+int cfg_TextModelScript(const char *directive, const char **argv, void *setdata)
+{
+    char scripts[MAX_CATEGORY_SUBSET + 1];
+    textModelSet_t *set;
+    if (argv == NULL || argv[0] == NULL) {
+        ci_debug_printf(1, "Missing arguments in directive:%s\n", directive);
+        ci_debug_printf(1, "Format: %s ISO_15924_SCRIPT_CODE ... or %s default\n", directive, directive);
+        return 0;
+    }
+    if (strcasecmp(argv[0], "default") == 0) {
+        ci_thread_rwlock_wrlock(&textclassify_rwlock);
+        LOADING_MODEL_SET = NULL;
+        ci_thread_rwlock_unlock(&textclassify_rwlock);
+        ci_debug_printf(1, "Loading Text Categories into the default models\n");
+        return 1;
+    }
+    if (!joinDirectiveArgs(directive, argv, 0, scripts)) return 0;
+    if (model_sets == MAX_MODEL_SETS) {
+        ci_debug_printf(1, "%s: no more than %d model sets can be loaded\n", directive, MAX_MODEL_SETS);
+        return 0;
+    }
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    set = &MODEL_SETS[model_sets];
+    set->nb = newBayesModel();
+    set->hs = newHSModel();
+    if (set->nb == NULL || set->hs == NULL) {
+        freeBayesModel(set->nb);
+        freeHSModel(set->hs);
+        ci_thread_rwlock_unlock(&textclassify_rwlock);
+        ci_debug_printf(1, "%s: unable to allocate memory for the model set of %s\n", directive, scripts);
+        return 0;
+    }
+    set->scripts = myStrDup(scripts);
+    model_sets++;
+    LOADING_MODEL_SET = set;
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
+    ci_debug_printf(1, "Loading Text Categories into the model set for: %s\n", scripts);
+    return 1;
+}
+
+int cfg_TextCascade(const char *directive, const char **argv, void *setdata)
+{
+    char watch[MAX_CATEGORY_SUBSET + 1] = "";
+    int cascade;
+    double level = 0;
+    char *end;
+    if (argv == NULL || argv[0] == NULL) {
+        ci_debug_printf(1, "Missing arguments in directive:%s\n", directive);
+        ci_debug_printf(1, "Format: %s NB|HS LEVEL [WATCHED_CATEGORY ...] or %s off\n", directive, directive);
+        return 0;
+    }
+    if (strcasecmp(argv[0], "off") == 0) cascade = CASCADE_OFF;
+    else if (strcasecmp(argv[0], "NB") == 0) cascade = CASCADE_NB_FIRST;
+    else if (strcasecmp(argv[0], "HS") == 0) cascade = CASCADE_HS_FIRST;
+    else {
+        ci_debug_printf(1, "%s needs NB or HS as the engine to run first, or off, not %s\n", directive, argv[0]);
+        return 0;
+    }
+    if (cascade != CASCADE_OFF) {
+        if (argv[1] == NULL) {
+            ci_debug_printf(1, "%s needs the level below which the second engine runs\n", directive);
+            return 0;
+        }
+        level = strtod(argv[1], &end);
+        if (end == argv[1] || *end != '\0') {
+            ci_debug_printf(1, "%s needs a number as the level, not %s\n", directive, argv[1]);
+            return 0;
+        }
+        if (!joinDirectiveArgs(directive, argv, 2, watch)) return 0;
+    }
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    TEXT_CASCADE = cascade;
+    CASCADE_LEVEL = level;
+    if (CASCADE_WATCH) free(CASCADE_WATCH);
+    CASCADE_WATCH = watch[0] ? myStrDup(watch) : NULL;
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
+    if (cascade == CASCADE_OFF) ci_debug_printf(1, "Setting parameter: %s (off)\n", directive);
+    else ci_debug_printf(1, "Setting parameter: %s (%s first, the other below %f%s%s)\n", directive, argv[0], level, watch[0] ? " or in " : "", watch);
+    return 1;
+}
+
+int cfg_PruneFNB(const char *directive, const char **argv, void *setdata)
+{
+    char *end;
+    double spread;
+    if (argv == NULL || argv[0] == NULL) {
+        ci_debug_printf(1, "Missing arguments in directive:%s\n", directive);
+        return 0;
+    }
+    spread = strtod(argv[0], &end);
+    if (end == argv[0] || *end != '\0' || spread < 0) {
+        ci_debug_printf(1, "%s needs a spread of 0 or more, not %s\n", directive, argv[0]);
+        return 0;
+    }
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    FNB_PRUNE = spread;
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
+    return 1;
+}
+
+int cfg_OptimizeFHS(const char *directive, const char **argv, void *setdata)
+{
+    ci_thread_rwlock_wrlock(&textclassify_rwlock);
+    swapLoadingModelSet();
+    optimizeFHS(&HSJudgeHashList);
+    swapLoadingModelSet();
+    ci_thread_rwlock_unlock(&textclassify_rwlock);
+
+    ci_debug_printf(1, "Optimizing FHS Data\n");
+    return 1;
+}
+
 int cfg_ExternalTextConversion(const char *directive, const char **argv, void *setdata)
 {
     int i, id = -1, k;
@@ -27,6 +27,10 @@
 
 #define IMAGE_CATEGORY_COPIES_MIN 10
 
+#define MAX_LEARN_CATEGORY_NAME 100 // Same as MAX_BAYES_CATEGORY_NAME, bayes.h is not included here
+
+#define MAX_CATEGORY_SUBSET 1024
+
 typedef struct classify_req_data {
     ci_simple_file_t *disk_body;
     ci_membuf_t *mem_body;
@@ -44,6 +48,8 @@ typedef struct classify_req_data {
         int enable204;
         int forcescan;
         int sizelimit;
+        char learn[MAX_LEARN_CATEGORY_NAME + 1]; // FNB category to learn this document as, if any
+        char categories[MAX_CATEGORY_SUBSET + 1]; // Categories to score, TextCategorySubset if empty
     } args;
 } classify_req_data_t;
 